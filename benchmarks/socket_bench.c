@@ -0,0 +1,657 @@
+/*
+ * socket_bench.c
+ * Loopback latency/throughput benchmark for the socket helpers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include <libimobiledevice-glue/socket.h>
+#include <libimobiledevice-glue/thread.h>
+
+/* overall timeout for a single transfer, a stuck peer fails the run instead of hanging it */
+#define BENCH_TIMEOUT 30000
+
+/* latency round trips per message size are capped to keep small sizes quick */
+#define BENCH_MAX_ROUNDTRIPS 10000
+#define BENCH_MIN_ROUNDTRIPS 10
+#define BENCH_MIN_STREAM 4
+
+enum bench_transport {
+	BENCH_UNIX = 0,
+	BENCH_TCP,
+	BENCH_NUM_TRANSPORTS
+};
+
+static const char *transport_names[BENCH_NUM_TRANSPORTS] = { "unix", "tcp" };
+
+enum bench_mode {
+	BENCH_POLL = 0,    /* poll() before every recv()/send(), the default code path */
+	BENCH_OPTIMISTIC,  /* SOCKET_IO_OPTIMISTIC: try MSG_DONTWAIT first, poll only on EAGAIN */
+	BENCH_VECTORED,    /* header and payload in one socket_sendv_all()/socket_receivev_timeout() */
+	BENCH_URING,       /* socket_submit_send()/socket_submit_recv() through io_uring */
+	BENCH_NUM_MODES
+};
+
+static const char *mode_names[BENCH_NUM_MODES] = { "poll", "optimistic", "vectored", "io_uring" };
+
+static const size_t default_sizes[] = { 16, 256, 4096, 65536, 1048576, 16777216 };
+
+struct bench_conn {
+	int fd;
+	enum bench_mode mode;
+	socket_uring_t ring;
+};
+
+struct bench_peer {
+	struct bench_conn conn;
+	size_t size;
+	unsigned int roundtrips;
+	unsigned int stream_count;
+	int result;
+};
+
+struct bench_result {
+	unsigned int roundtrips;
+	double p50_us;
+	double p99_us;
+	double throughput_mb_s;
+};
+
+static uint64_t bench_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int send_full(int fd, const unsigned char *data, size_t length)
+{
+	size_t done = 0;
+	while (done < length) {
+		int res = socket_send(fd, data + done, length - done);
+		if (res < 0) {
+			return res;
+		}
+		done += (size_t)res;
+	}
+	return 0;
+}
+
+static int receive_full(int fd, unsigned char *data, size_t length)
+{
+	size_t done = 0;
+	while (done < length) {
+		int res = socket_receive_timeout(fd, data + done, length - done, 0, BENCH_TIMEOUT);
+		if (res < 0) {
+			return res;
+		}
+		done += (size_t)res;
+	}
+	return 0;
+}
+
+static int receivev_full(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		int res = socket_receivev_timeout(fd, iov, iovcnt, 0, BENCH_TIMEOUT);
+		if (res < 0) {
+			return res;
+		}
+		size_t n = (size_t)res;
+		while (iovcnt > 0 && n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+struct uring_op {
+	int done;
+	int result;
+};
+
+static void uring_op_complete(socket_uring_t ring, int fd, int result, void *user_data)
+{
+	struct uring_op *op = (struct uring_op*)user_data;
+	op->result = result;
+	op->done = 1;
+}
+
+static int uring_full(socket_uring_t ring, int fd, int is_send, unsigned char *data, size_t length)
+{
+	size_t done = 0;
+	while (done < length) {
+		struct uring_op op = { 0, 0 };
+		int res;
+		if (is_send) {
+			res = socket_submit_send(ring, fd, data + done, length - done, uring_op_complete, &op);
+		} else {
+			res = socket_submit_recv(ring, fd, data + done, length - done, 0, uring_op_complete, &op);
+		}
+		if (res < 0) {
+			return res;
+		}
+		while (!op.done) {
+			res = socket_uring_wait(ring, BENCH_TIMEOUT);
+			if (res < 0) {
+				return res;
+			}
+			if (res == 0) {
+				return -ETIMEDOUT;
+			}
+		}
+		if (op.result < 0) {
+			return op.result;
+		}
+		done += (size_t)op.result;
+	}
+	return 0;
+}
+
+/* messages are framed with a 4 byte length header like most protocols built on top of this library */
+static int bench_send_msg(struct bench_conn *conn, unsigned char *data, size_t length)
+{
+	uint32_t hdr = (uint32_t)length;
+	int res;
+
+	switch (conn->mode) {
+		case BENCH_VECTORED: {
+			struct iovec iov[2];
+			size_t sent = 0;
+			iov[0].iov_base = &hdr;
+			iov[0].iov_len = sizeof(hdr);
+			iov[1].iov_base = data;
+			iov[1].iov_len = length;
+			return socket_sendv_all(conn->fd, iov, 2, BENCH_TIMEOUT, &sent);
+		}
+		case BENCH_URING:
+			res = uring_full(conn->ring, conn->fd, 1, (unsigned char*)&hdr, sizeof(hdr));
+			return (res < 0) ? res : uring_full(conn->ring, conn->fd, 1, data, length);
+		case BENCH_POLL:
+		case BENCH_OPTIMISTIC:
+		default:
+			res = send_full(conn->fd, (unsigned char*)&hdr, sizeof(hdr));
+			return (res < 0) ? res : send_full(conn->fd, data, length);
+	}
+}
+
+static int bench_receive_msg(struct bench_conn *conn, unsigned char *data, size_t length)
+{
+	uint32_t hdr = 0;
+	int res;
+
+	switch (conn->mode) {
+		case BENCH_VECTORED: {
+			struct iovec iov[2];
+			iov[0].iov_base = &hdr;
+			iov[0].iov_len = sizeof(hdr);
+			iov[1].iov_base = data;
+			iov[1].iov_len = length;
+			res = receivev_full(conn->fd, iov, 2);
+			break;
+		}
+		case BENCH_URING:
+			res = uring_full(conn->ring, conn->fd, 0, (unsigned char*)&hdr, sizeof(hdr));
+			if (res == 0) {
+				res = uring_full(conn->ring, conn->fd, 0, data, length);
+			}
+			break;
+		case BENCH_POLL:
+		case BENCH_OPTIMISTIC:
+		default:
+			res = receive_full(conn->fd, (unsigned char*)&hdr, sizeof(hdr));
+			if (res == 0) {
+				res = receive_full(conn->fd, data, length);
+			}
+			break;
+	}
+	if (res == 0 && hdr != (uint32_t)length) {
+		res = -EPROTO;
+	}
+	return res;
+}
+
+static int bench_conn_init(struct bench_conn *conn, int fd, enum bench_mode mode)
+{
+	conn->fd = fd;
+	conn->mode = mode;
+	conn->ring = NULL;
+	socket_set_io_flags(fd, (mode == BENCH_OPTIMISTIC) ? SOCKET_IO_OPTIMISTIC : 0);
+	if (mode == BENCH_URING) {
+		conn->ring = socket_uring_new(8);
+		if (!conn->ring) {
+			return -errno;
+		}
+	}
+	return 0;
+}
+
+static void bench_conn_deinit(struct bench_conn *conn)
+{
+	socket_uring_free(conn->ring);
+	conn->ring = NULL;
+}
+
+/* echoes the round trip messages, then swallows the stream and acknowledges it */
+static void* bench_peer_thread(void *data)
+{
+	struct bench_peer *peer = (struct bench_peer*)data;
+	unsigned char *buf = (unsigned char*)malloc(peer->size);
+	unsigned int i;
+	int res = 0;
+
+	if (!buf) {
+		peer->result = -ENOMEM;
+		return NULL;
+	}
+	for (i = 0; i < peer->roundtrips && res == 0; i++) {
+		res = bench_receive_msg(&peer->conn, buf, peer->size);
+		if (res == 0) {
+			res = bench_send_msg(&peer->conn, buf, peer->size);
+		}
+	}
+	for (i = 0; i < peer->stream_count && res == 0; i++) {
+		res = bench_receive_msg(&peer->conn, buf, peer->size);
+	}
+	if (res == 0) {
+		unsigned char ack = 0;
+		res = bench_send_msg(&peer->conn, &ack, 1);
+	}
+	free(buf);
+	peer->result = res;
+	return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t *sorted, unsigned int count, unsigned int pct)
+{
+	unsigned int idx = (unsigned int)(((uint64_t)count * pct + 99) / 100);
+	if (idx > 0) {
+		idx--;
+	}
+	return (double)sorted[idx] / 1000.0;
+}
+
+static int bench_connect(enum bench_transport transport, int fds[2])
+{
+	struct socket_options opts;
+	int lfd;
+
+	fds[0] = fds[1] = -1;
+	socket_options_init(&opts);
+	switch (transport) {
+#ifndef _WIN32
+		case BENCH_UNIX: {
+			char path[64];
+			snprintf(path, sizeof(path), "/tmp/socket_bench.%d", (int)getpid());
+			lfd = socket_create_unix(path);
+			if (lfd < 0) {
+				return -errno;
+			}
+			fds[0] = socket_connect_unix(path);
+			if (fds[0] >= 0) {
+				fds[1] = socket_accept(lfd, 0);
+			}
+			socket_close(lfd);
+			unlink(path);
+			break;
+		}
+#endif
+		case BENCH_TCP: {
+			uint16_t port = 0;
+			lfd = socket_create("127.0.0.1", 0);
+			if (lfd < 0) {
+				return -errno;
+			}
+			if (socket_get_socket_port(lfd, &port) == 0) {
+				fds[0] = socket_connect("127.0.0.1", port);
+				if (fds[0] >= 0) {
+					fds[1] = socket_accept(lfd, port);
+				}
+			}
+			socket_close(lfd);
+			if (fds[1] >= 0) {
+				// same buffer sizes and TCP_NODELAY on both ends
+				socket_set_options(fds[1], &opts);
+			}
+			break;
+		}
+		default:
+			return -ENOTSUP;
+	}
+	if (fds[0] < 0 || fds[1] < 0) {
+		int err = (errno) ? errno : ECONNREFUSED;
+		if (fds[0] >= 0) {
+			socket_close(fds[0]);
+		}
+		if (fds[1] >= 0) {
+			socket_close(fds[1]);
+		}
+		fds[0] = fds[1] = -1;
+		return -err;
+	}
+	return 0;
+}
+
+static int bench_run(enum bench_transport transport, enum bench_mode mode, size_t size, uint64_t budget, struct bench_result *result)
+{
+	struct bench_conn conn;
+	struct bench_peer peer;
+	THREAD_T thread = THREAD_T_NULL;
+	uint64_t *rtt = NULL;
+	unsigned char *buf = NULL;
+	unsigned int i;
+	int fds[2];
+	int res;
+
+	res = bench_connect(transport, fds);
+	if (res < 0) {
+		return res;
+	}
+	memset(&peer, 0, sizeof(peer));
+	peer.size = size;
+	peer.roundtrips = (unsigned int)(budget / size);
+	if (peer.roundtrips > BENCH_MAX_ROUNDTRIPS) {
+		peer.roundtrips = BENCH_MAX_ROUNDTRIPS;
+	} else if (peer.roundtrips < BENCH_MIN_ROUNDTRIPS) {
+		peer.roundtrips = BENCH_MIN_ROUNDTRIPS;
+	}
+	peer.stream_count = (unsigned int)(budget / size);
+	if (peer.stream_count < BENCH_MIN_STREAM) {
+		peer.stream_count = BENCH_MIN_STREAM;
+	}
+
+	res = bench_conn_init(&conn, fds[0], mode);
+	if (res == 0) {
+		res = bench_conn_init(&peer.conn, fds[1], mode);
+	}
+	if (res == 0) {
+		buf = (unsigned char*)malloc(size);
+		rtt = (uint64_t*)malloc(sizeof(uint64_t) * peer.roundtrips);
+		if (!buf || !rtt) {
+			res = -ENOMEM;
+		} else {
+			memset(buf, 0x5a, size);
+		}
+	}
+	if (res == 0 && thread_new(&thread, bench_peer_thread, &peer) != 0) {
+		res = -EAGAIN;
+	}
+
+	for (i = 0; i < peer.roundtrips && res == 0; i++) {
+		uint64_t start = bench_time_ns();
+		res = bench_send_msg(&conn, buf, size);
+		if (res == 0) {
+			res = bench_receive_msg(&conn, buf, size);
+		}
+		rtt[i] = bench_time_ns() - start;
+	}
+	if (res == 0) {
+		unsigned char ack = 0;
+		uint64_t start = bench_time_ns();
+		for (i = 0; i < peer.stream_count && res == 0; i++) {
+			res = bench_send_msg(&conn, buf, size);
+		}
+		if (res == 0) {
+			res = bench_receive_msg(&conn, &ack, 1);
+		}
+		uint64_t elapsed = bench_time_ns() - start;
+		if (res == 0) {
+			qsort(rtt, peer.roundtrips, sizeof(uint64_t), compare_u64);
+			result->roundtrips = peer.roundtrips;
+			result->p50_us = percentile_us(rtt, peer.roundtrips, 50);
+			result->p99_us = percentile_us(rtt, peer.roundtrips, 99);
+			result->throughput_mb_s = ((double)size * peer.stream_count / 1048576.0) / ((double)elapsed / 1e9);
+		}
+	}
+
+	if (res < 0) {
+		// unblock the peer
+		socket_shutdown(fds[0], SHUT_RDWR);
+	}
+	if (thread != THREAD_T_NULL) {
+		thread_join(thread);
+		thread_free(thread);
+		if (res == 0) {
+			res = peer.result;
+		}
+	}
+	bench_conn_deinit(&conn);
+	bench_conn_deinit(&peer.conn);
+	socket_close(fds[0]);
+	socket_close(fds[1]);
+	free(rtt);
+	free(buf);
+	return res;
+}
+
+// splits a comma separated list in place, returns the next token or NULL
+static char* next_token(char **list)
+{
+	char *tok = *list;
+	char *sep;
+
+	if (!tok || *tok == '\0') {
+		return NULL;
+	}
+	sep = strchr(tok, ',');
+	if (sep) {
+		*sep = '\0';
+		*list = sep + 1;
+	} else {
+		*list = NULL;
+	}
+	return tok;
+}
+
+static int parse_list(const char *arg, const char *const *names, int count, unsigned int *mask)
+{
+	char *list = strdup(arg);
+	char *rest = list;
+	char *tok;
+	int res = 0;
+
+	*mask = 0;
+	while ((tok = next_token(&rest)) != NULL) {
+		int i;
+		if (!strcmp(tok, "all")) {
+			*mask = (1u << count) - 1;
+			continue;
+		}
+		for (i = 0; i < count; i++) {
+			if (!strcmp(tok, names[i])) {
+				*mask |= 1u << i;
+				break;
+			}
+		}
+		if (i == count) {
+			fprintf(stderr, "ERROR: unknown value '%s'\n", tok);
+			res = -1;
+		}
+	}
+	free(list);
+	return res;
+}
+
+static int parse_sizes(const char *arg, size_t *sizes, unsigned int max, unsigned int *count)
+{
+	char *list = strdup(arg);
+	char *rest = list;
+	char *tok;
+	int res = 0;
+
+	*count = 0;
+	while ((tok = next_token(&rest)) != NULL) {
+		char *end = NULL;
+		unsigned long long v = strtoull(tok, &end, 0);
+		if (end && (*end == 'k' || *end == 'K')) {
+			v <<= 10;
+			end++;
+		} else if (end && (*end == 'm' || *end == 'M')) {
+			v <<= 20;
+			end++;
+		}
+		if (!end || *end != '\0' || v == 0 || v > UINT32_MAX || *count >= max) {
+			fprintf(stderr, "ERROR: invalid size '%s'\n", tok);
+			res = -1;
+			break;
+		}
+		sizes[(*count)++] = (size_t)v;
+	}
+	free(list);
+	return res;
+}
+
+static void print_usage(const char *name)
+{
+	printf("Usage: %s [OPTIONS]\n", name);
+	printf("\n");
+	printf("Measure round trip latency (p50/p99) and one-way throughput of the socket\n");
+	printf("helpers over loopback connections, one result per line on stdout.\n");
+	printf("\n");
+	printf("OPTIONS:\n");
+	printf("  -t, --transport LIST\tunix, tcp or all (default: all)\n");
+	printf("  -m, --mode LIST\tpoll, optimistic, vectored, io_uring or all (default: all)\n");
+	printf("  -s, --sizes LIST\tmessage sizes in bytes, k/M suffixes allowed\n");
+	printf("                  \t(default: 16,256,4k,64k,1M,16M)\n");
+	printf("  -b, --budget MB\tdata transferred per size and phase (default: 64)\n");
+	printf("  -c, --csv\t\tprint CSV instead of JSON lines\n");
+	printf("  -h, --help\t\tprint usage information\n");
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option longopts[] = {
+		{ "transport", required_argument, NULL, 't' },
+		{ "mode", required_argument, NULL, 'm' },
+		{ "sizes", required_argument, NULL, 's' },
+		{ "budget", required_argument, NULL, 'b' },
+		{ "csv", no_argument, NULL, 'c' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	unsigned int transports = (1u << BENCH_NUM_TRANSPORTS) - 1;
+	unsigned int modes = (1u << BENCH_NUM_MODES) - 1;
+	size_t sizes[32];
+	unsigned int num_sizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+	uint64_t budget = 64ull << 20;
+	int csv = 0;
+	int failed = 0;
+	int c;
+	unsigned int t, m, s;
+
+	memcpy(sizes, default_sizes, sizeof(default_sizes));
+
+	while ((c = getopt_long(argc, argv, "t:m:s:b:ch", longopts, NULL)) != -1) {
+		switch (c) {
+			case 't':
+				if (parse_list(optarg, transport_names, BENCH_NUM_TRANSPORTS, &transports) < 0) {
+					return 2;
+				}
+				break;
+			case 'm':
+				if (parse_list(optarg, mode_names, BENCH_NUM_MODES, &modes) < 0) {
+					return 2;
+				}
+				break;
+			case 's':
+				if (parse_sizes(optarg, sizes, sizeof(sizes) / sizeof(sizes[0]), &num_sizes) < 0) {
+					return 2;
+				}
+				break;
+			case 'b':
+				budget = strtoull(optarg, NULL, 10) << 20;
+				if (budget == 0) {
+					fprintf(stderr, "ERROR: invalid budget '%s'\n", optarg);
+					return 2;
+				}
+				break;
+			case 'c':
+				csv = 1;
+				break;
+			case 'h':
+				print_usage(argv[0]);
+				return 0;
+			default:
+				print_usage(argv[0]);
+				return 2;
+		}
+	}
+
+#ifdef _WIN32
+	transports &= ~(1u << BENCH_UNIX);
+#endif
+
+	if (csv) {
+		printf("transport,mode,size,roundtrips,p50_us,p99_us,throughput_mb_s\n");
+	}
+	for (t = 0; t < BENCH_NUM_TRANSPORTS; t++) {
+		if (!(transports & (1u << t))) {
+			continue;
+		}
+		for (m = 0; m < BENCH_NUM_MODES; m++) {
+			if (!(modes & (1u << m))) {
+				continue;
+			}
+			for (s = 0; s < num_sizes; s++) {
+				struct bench_result result = { 0, 0.0, 0.0, 0.0 };
+				int res = bench_run((enum bench_transport)t, (enum bench_mode)m, sizes[s], budget, &result);
+				if (res == -ENOSYS || res == -ENOTSUP) {
+					fprintf(stderr, "%s/%s: not supported on this system, skipping\n", transport_names[t], mode_names[m]);
+					break;
+				}
+				if (res < 0) {
+					fprintf(stderr, "%s/%s/%zu: failed: %s\n", transport_names[t], mode_names[m], sizes[s], strerror(-res));
+					failed = 1;
+					continue;
+				}
+				if (csv) {
+					printf("%s,%s,%zu,%u,%.2f,%.2f,%.2f\n", transport_names[t], mode_names[m], sizes[s], result.roundtrips, result.p50_us, result.p99_us, result.throughput_mb_s);
+				} else {
+					printf("{\"transport\":\"%s\",\"mode\":\"%s\",\"size\":%zu,\"roundtrips\":%u,\"p50_us\":%.2f,\"p99_us\":%.2f,\"throughput_mb_s\":%.2f}\n", transport_names[t], mode_names[m], sizes[s], result.roundtrips, result.p50_us, result.p99_us, result.throughput_mb_s);
+				}
+				fflush(stdout);
+			}
+		}
+	}
+
+	return (failed) ? 1 : 0;
+}
@@ -32,13 +32,51 @@ enum fd_mode {
 };
 typedef enum fd_mode fd_mode;
 
+enum socket_event {
+	SOCKET_EVENT_READ    = 1 << 0,
+	SOCKET_EVENT_WRITE   = 1 << 1,
+	SOCKET_EVENT_ERROR   = 1 << 2,
+	SOCKET_EVENT_HUP     = 1 << 3,
+	SOCKET_EVENT_TIMEOUT = 1 << 4,
+	/* set together with SOCKET_EVENT_TIMEOUT, see socket_loop_set_io_timeouts() */
+	SOCKET_EVENT_READ_TIMEOUT  = 1 << 5,
+	SOCKET_EVENT_WRITE_TIMEOUT = 1 << 6
+};
+
+enum socket_io_flags {
+	/* try non-blocking recv/send first and only poll() if it would block */
+	SOCKET_IO_OPTIMISTIC = 1 << 0,
+	/* keep per-fd statistics, see socket_get_stats() */
+	SOCKET_IO_STATS      = 1 << 1
+};
+
+enum socket_unix_flags {
+	/* Linux abstract namespace: the name is not a filesystem path and disappears with the last socket */
+	SOCKET_UNIX_ABSTRACT  = 1 << 0,
+	/* fail with EADDRINUSE instead of removing an existing socket file */
+	SOCKET_UNIX_NO_UNLINK = 1 << 1
+};
+
+enum socket_accept_flags {
+	SOCKET_ACCEPT_NONBLOCK = 1 << 0,
+	SOCKET_ACCEPT_CLOEXEC  = 1 << 1
+};
+
 #ifdef _WIN32
 #include <winsock2.h>
 #define SHUT_RD SD_READ
 #define SHUT_WR SD_WRITE
 #define SHUT_RDWR SD_BOTH
+#ifndef _STRUCT_IOVEC
+#define _STRUCT_IOVEC
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+#endif
 #else
 #include <sys/socket.h>
+#include <sys/uio.h>
 #endif
 
 #include <libimobiledevice-glue/glue.h>
@@ -47,15 +85,188 @@ typedef enum fd_mode fd_mode;
 extern "C" {
 #endif
 
+struct socket_msg {
+	void *data;
+	size_t length;
+	size_t transferred;             /* out: number of bytes received/sent */
+	struct sockaddr_storage *addr;  /* optional: source (receive) or destination (send) */
+	unsigned int addr_len;          /* in/out: length of addr, 0 on send derives it from the family */
+	int flags;                      /* out: message flags on receive, e.g. MSG_TRUNC */
+};
+
+#define SOCKET_STATS_HISTOGRAM_BUCKETS 24
+
+struct socket_poll_entry {
+	int fd;       /* negative fds are ignored */
+	int events;   /* SOCKET_EVENT_READ and/or SOCKET_EVENT_WRITE */
+	int revents;  /* ready events, may include SOCKET_EVENT_ERROR and SOCKET_EVENT_HUP */
+};
+
+struct socket_stats {
+	uint64_t bytes_received;
+	uint64_t bytes_sent;
+	uint64_t receive_calls;
+	uint64_t send_calls;
+	uint64_t eagain;            /* calls that would have blocked */
+	uint64_t timeouts;          /* waits that timed out */
+	uint64_t resets;            /* ECONNRESET/EPIPE or connection closed by peer */
+	uint64_t errors;            /* other failures */
+	uint64_t poll_calls;
+	uint64_t poll_wait_us;      /* total time spent waiting in poll()/select() */
+	uint64_t io_us;             /* total time spent in receive/send system calls */
+	/* bucket 0 counts durations below 1us, bucket n those in [2^(n-1), 2^n) us, the last one everything above */
+	uint64_t poll_histogram[SOCKET_STATS_HISTOGRAM_BUCKETS];
+	uint64_t io_histogram[SOCKET_STATS_HISTOGRAM_BUCKETS];
+};
+
+struct socket_options {
+	int send_buffer_size;       /* SO_SNDBUF, 0 keeps the system default */
+	int receive_buffer_size;    /* SO_RCVBUF, 0 keeps the system default */
+	int nodelay;                /* TCP_NODELAY */
+	int quickack;               /* TCP_QUICKACK (Linux) */
+	int cork;                   /* TCP_CORK (Linux) or TCP_NOPUSH (BSD/macOS) */
+	int keepalive;              /* SO_KEEPALIVE */
+	int keepalive_idle;         /* seconds until the first probe, 0 = system default */
+	int keepalive_interval;     /* seconds between probes, 0 = system default */
+	int keepalive_count;        /* number of probes, 0 = system default */
+	unsigned int user_timeout;  /* TCP_USER_TIMEOUT in ms (Linux), 0 = system default */
+	int busy_poll;              /* SO_BUSY_POLL in usec (Linux), 0 = disabled */
+};
+
+typedef struct socket_wakeup* socket_wakeup_t;
+typedef struct socket_cancel* socket_cancel_t;
+
+typedef struct socket_timer_wheel* socket_timer_wheel_t;
+typedef struct socket_timer* socket_timer_t;
+typedef void (*socket_timer_cb_t)(socket_timer_t timer, void *user_data);
+
+typedef struct socket_loop* socket_loop_t;
+typedef void (*socket_loop_cb_t)(socket_loop_t loop, int fd, int events, void *user_data);
+
+typedef struct socket_pool* socket_pool_t;
+
+struct socket_server_options {
+	unsigned int num_listeners;  /* SO_REUSEPORT listeners with one acceptor thread each (Linux), otherwise 1 */
+	int backlog;                 /* listen() backlog */
+	unsigned int defer_accept;   /* TCP_DEFER_ACCEPT in seconds (Linux), 0 = disabled */
+	unsigned int num_workers;    /* threads running the callback, 0 runs it on the acceptor thread */
+};
+
+typedef struct socket_server* socket_server_t;
+/* accepted fds are non-blocking and owned by the callback */
+typedef void (*socket_server_cb_t)(socket_server_t server, int fd, const struct sockaddr_storage *peer, void *user_data);
+
+struct socket_relay_options {
+	size_t buffer_size;          /* per direction, pipe size when splice() is used */
+	unsigned int idle_timeout;   /* ms without any data moving before giving up, 0 = never */
+	int no_splice;               /* always copy through a userspace buffer */
+};
+
+struct socket_relay_stats {
+	uint64_t bytes_a_to_b;
+	uint64_t bytes_b_to_a;
+};
+
+typedef struct socket_reader* socket_reader_t;
+typedef struct socket_writer* socket_writer_t;
+
+struct addrinfo;
+/* status is 0 or a getaddrinfo() error code; result is only valid during the callback */
+typedef void (*socket_resolve_cb_t)(const char *host, uint16_t port, int status, const struct addrinfo *result, void *user_data);
+
+/* per-fd I/O hooks (e.g. a userspace TLS layer); return bytes transferred or a negative errno, -EAGAIN to wait for readiness */
+struct socket_transport {
+	int (*receive)(void *ctx, int fd, void *data, size_t length, int flags);
+	int (*send)(void *ctx, int fd, const void *data, size_t length);
+	int (*pending)(void *ctx, int fd);  /* optional: bytes buffered by the transport, readable without waiting */
+	void (*close)(void *ctx, int fd);   /* optional: called by socket_close() before the fd is closed */
+};
+
+enum socket_ktls_cipher {
+	SOCKET_KTLS_AES_GCM_128 = 1,
+	SOCKET_KTLS_AES_GCM_256,
+	SOCKET_KTLS_CHACHA20_POLY1305
+};
+
+/* negotiated TLS session keys for one direction; key uses 16 or 32 bytes depending on cipher */
+struct socket_ktls_crypto {
+	unsigned int version;       /* 0x0303 (TLS 1.2) or 0x0304 (TLS 1.3) */
+	unsigned int cipher;        /* enum socket_ktls_cipher */
+	unsigned char key[32];
+	unsigned char iv[12];       /* GCM uses salt + the first 8 bytes, ChaCha20-Poly1305 all 12 */
+	unsigned char salt[4];
+	unsigned char rec_seq[8];
+};
+
+typedef struct socket_uring* socket_uring_t;
+typedef void (*socket_uring_cb_t)(socket_uring_t ring, int fd, int result, void *user_data);
+
 #ifndef _WIN32
 LIMD_GLUE_API int socket_create_unix(const char *filename);
 LIMD_GLUE_API int socket_connect_unix(const char *filename);
+/* type is SOCK_STREAM, SOCK_SEQPACKET (keeps message boundaries) or SOCK_DGRAM; flags are enum socket_unix_flags */
+LIMD_GLUE_API int socket_create_unix_type(const char *name, int type, int flags);
+LIMD_GLUE_API int socket_connect_unix_type(const char *name, int type, int flags, const struct socket_options *opts);
+/* pass file descriptors (SCM_RIGHTS) along with data; without data a single zero byte is sent */
+LIMD_GLUE_API int socket_send_fds(int fd, const void *data, size_t length, const int *fds, unsigned int num_fds);
+/* num_fds is the capacity of fds on input and the number of received descriptors on return; returns the number of data bytes */
+LIMD_GLUE_API int socket_receive_fds(int fd, void *data, size_t length, int *fds, unsigned int *num_fds, unsigned int timeout);
 #endif
 LIMD_GLUE_API int socket_create(const char *addr, uint16_t port);
 LIMD_GLUE_API int socket_connect_addr(struct sockaddr *addr, uint16_t port);
 LIMD_GLUE_API int socket_connect(const char *addr, uint16_t port);
+
+/* passing NULL options keeps the behavior of the respective non-_ex function */
+LIMD_GLUE_API void socket_options_init(struct socket_options *opts);
+LIMD_GLUE_API int socket_set_options(int fd, const struct socket_options *opts);
+#ifndef _WIN32
+LIMD_GLUE_API int socket_connect_unix_ex(const char *filename, const struct socket_options *opts);
+#endif
+LIMD_GLUE_API int socket_create_ex(const char *addr, uint16_t port, const struct socket_options *opts);
+LIMD_GLUE_API int socket_connect_addr_ex(struct sockaddr *addr, uint16_t port, const struct socket_options *opts);
+LIMD_GLUE_API int socket_connect_ex(const char *addr, uint16_t port, const struct socket_options *opts);
+
+/* RFC 8305 connect racing all resolved addresses; timeout 0 uses the default connect timeout */
+LIMD_GLUE_API int socket_connect_happy_eyeballs(const char *addr, uint16_t port, const struct socket_options *opts, unsigned int timeout);
+/* non-blocking connect: returns an fd with the connection in progress, poll it for writing, then call socket_connect_finish() (0 = connected) */
+LIMD_GLUE_API int socket_connect_addr_start(struct sockaddr *addr, uint16_t port, const struct socket_options *opts);
+LIMD_GLUE_API int socket_connect_finish(int fd);
+
+/* host name lookups done by socket_connect()/socket_create() are cached for ttl ms (0 disables the cache) */
+LIMD_GLUE_API int socket_resolve_async(const char *host, uint16_t port, socket_resolve_cb_t callback, void *user_data);
+LIMD_GLUE_API void socket_set_resolver_ttl(unsigned int ttl);
+LIMD_GLUE_API void socket_flush_resolver_cache(void);
+
+LIMD_GLUE_API int socket_create_dgram(const char *addr, uint16_t port);
+LIMD_GLUE_API int socket_connect_dgram(const char *addr, uint16_t port);
 LIMD_GLUE_API int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout);
+/* waits on several fds at once; returns the number of ready entries, -ETIMEDOUT or a negative errno */
+LIMD_GLUE_API int socket_check_fds(struct socket_poll_entry *entries, unsigned int count, unsigned int timeout);
+
+/* fd that becomes readable when signaled from any thread, e.g. to interrupt socket_check_fds(); stays readable until cleared */
+LIMD_GLUE_API socket_wakeup_t socket_wakeup_new(void);
+LIMD_GLUE_API void socket_wakeup_free(socket_wakeup_t wakeup);
+LIMD_GLUE_API int socket_wakeup_get_fd(socket_wakeup_t wakeup);
+LIMD_GLUE_API int socket_wakeup_signal(socket_wakeup_t wakeup);
+LIMD_GLUE_API int socket_wakeup_clear(socket_wakeup_t wakeup);
+
+/* cancellation token: once signaled, all *_cancellable() calls waiting on it fail with -ECANCELED until it is reset */
+LIMD_GLUE_API socket_cancel_t socket_cancel_new(void);
+LIMD_GLUE_API void socket_cancel_free(socket_cancel_t cancel);
+LIMD_GLUE_API int socket_cancel_signal(socket_cancel_t cancel);
+LIMD_GLUE_API int socket_cancel_reset(socket_cancel_t cancel);
+LIMD_GLUE_API int socket_cancel_is_set(socket_cancel_t cancel);
+LIMD_GLUE_API int socket_cancel_get_fd(socket_cancel_t cancel);
+/* timeouts in ms, 0 waits until data arrives or the token is signaled; a NULL token only honors the timeout */
+LIMD_GLUE_API int socket_receive_cancellable(int fd, void *data, size_t length, int flags, unsigned int timeout, socket_cancel_t cancel);
+LIMD_GLUE_API int socket_send_cancellable(int fd, const void *data, size_t length, unsigned int timeout, socket_cancel_t cancel);
+LIMD_GLUE_API int socket_receive_all_cancellable(int fd, void *data, size_t length, unsigned int timeout, socket_cancel_t cancel, size_t *received);
+LIMD_GLUE_API int socket_send_all_cancellable(int fd, const void *data, size_t length, unsigned int timeout, socket_cancel_t cancel, size_t *sent);
+/* like socket_connect_happy_eyeballs(), fails with errno ECANCELED when the token is signaled (name resolution is not interrupted) */
+LIMD_GLUE_API int socket_connect_cancellable(const char *addr, uint16_t port, const struct socket_options *opts, unsigned int timeout, socket_cancel_t cancel);
 LIMD_GLUE_API int socket_accept(int fd, uint16_t port);
+/* peer (optional) receives the address of the connecting client; flags are socket_accept_flags */
+LIMD_GLUE_API int socket_accept_ex(int fd, struct sockaddr_storage *peer, int flags);
 
 LIMD_GLUE_API int socket_shutdown(int fd, int how);
 LIMD_GLUE_API int socket_close(int fd);
@@ -65,13 +276,149 @@ LIMD_GLUE_API int socket_peek(int fd, void *data, size_t length);
 LIMD_GLUE_API int socket_receive_timeout(int fd, void *data, size_t length, int flags, unsigned int timeout);
 LIMD_GLUE_API int socket_send(int fd, const void *data, size_t length);
 
+/* transfer exactly length bytes; timeout (ms) is an overall deadline, 0 waits forever */
+LIMD_GLUE_API int socket_receive_all(int fd, void *data, size_t length, unsigned int timeout, size_t *received);
+LIMD_GLUE_API int socket_send_all(int fd, const void *data, size_t length, unsigned int timeout, size_t *sent);
+
+/* datagram batches; returns the number of messages transferred */
+LIMD_GLUE_API int socket_receive_batch(int fd, struct socket_msg *msgs, unsigned int count, unsigned int timeout);
+LIMD_GLUE_API int socket_send_batch(int fd, struct socket_msg *msgs, unsigned int count, unsigned int timeout);
+
+/* send length bytes (0 = until EOF) of a file starting at offset, using sendfile() where possible */
+LIMD_GLUE_API int socket_send_file(int fd, int file_fd, uint64_t offset, uint64_t length, unsigned int timeout, uint64_t *sent);
+LIMD_GLUE_API int socket_send_file_path(int fd, const char *path, uint64_t offset, uint64_t length, unsigned int timeout, uint64_t *sent);
+
+LIMD_GLUE_API int socket_receivev(int fd, struct iovec *iov, int iovcnt);
+LIMD_GLUE_API int socket_receivev_timeout(int fd, struct iovec *iov, int iovcnt, int flags, unsigned int timeout);
+LIMD_GLUE_API int socket_sendv(int fd, const struct iovec *iov, int iovcnt);
+LIMD_GLUE_API int socket_sendv_all(int fd, const struct iovec *iov, int iovcnt, unsigned int timeout, size_t *sent);
+
+LIMD_GLUE_API int socket_set_io_flags(int fd, unsigned int flags);
+LIMD_GLUE_API unsigned int socket_get_io_flags(int fd);
+
+/* statistics are only collected while enabled; fd -1 selects the global counters */
+LIMD_GLUE_API void socket_set_stats_enabled(int enabled);
+LIMD_GLUE_API int socket_get_stats(int fd, struct socket_stats *stats);
+LIMD_GLUE_API int socket_reset_stats(int fd);
+
 LIMD_GLUE_API int socket_get_socket_port(int fd, uint16_t *port);
+/* addr_len (optional) receives the actual address length */
+LIMD_GLUE_API int socket_get_local_addr(int fd, struct sockaddr_storage *addr, unsigned int *addr_len);
+LIMD_GLUE_API int socket_get_peer_addr(int fd, struct sockaddr_storage *addr, unsigned int *addr_len);
 
 LIMD_GLUE_API void socket_set_verbose(int level);
+/* timeouts in ms used by socket_receive(), socket_send() and friends and the connect functions; 0 waits forever */
+LIMD_GLUE_API void socket_set_default_timeouts(unsigned int recv_timeout, unsigned int send_timeout, unsigned int connect_timeout);
+LIMD_GLUE_API void socket_get_default_timeouts(unsigned int *recv_timeout, unsigned int *send_timeout, unsigned int *connect_timeout);
 
 LIMD_GLUE_API const char *socket_addr_to_string(struct sockaddr *addr, char *addr_out, size_t addr_out_size);
+/* formats addr including the port ("1.2.3.4:80", "[::1]:80") or unix socket path ("unix:/path"); SOCKET_ADDR_STRLEN is always large enough */
+#define SOCKET_ADDR_STRLEN 128
+LIMD_GLUE_API const char *socket_addr_format(const struct sockaddr *addr, char *addr_out, size_t addr_out_size);
 
 LIMD_GLUE_API int get_primary_mac_address(unsigned char mac_addr_buf[6]);
+/* drop the cached interface list, e.g. after network configuration changes on systems without netlink */
+LIMD_GLUE_API void socket_flush_interface_cache(void);
+
+/* event loop (epoll on Linux, poll/select elsewhere); not thread-safe except for socket_loop_stop() */
+LIMD_GLUE_API socket_loop_t socket_loop_new(void);
+LIMD_GLUE_API void socket_loop_free(socket_loop_t loop);
+LIMD_GLUE_API int socket_loop_add(socket_loop_t loop, int fd, int events, unsigned int timeout, socket_loop_cb_t callback, void *user_data);
+LIMD_GLUE_API int socket_loop_modify(socket_loop_t loop, int fd, int events, unsigned int timeout);
+LIMD_GLUE_API int socket_loop_remove(socket_loop_t loop, int fd);
+/* deadlines (ms, 0 = none) for the next read/write event while the fd waits for it, restarted whenever one arrives */
+LIMD_GLUE_API int socket_loop_set_io_timeouts(socket_loop_t loop, int fd, unsigned int read_timeout, unsigned int write_timeout);
+/* the loop runs the timers of this wheel; they have to be freed before the loop */
+LIMD_GLUE_API socket_timer_wheel_t socket_loop_get_timer_wheel(socket_loop_t loop);
+LIMD_GLUE_API int socket_loop_run_once(socket_loop_t loop, int timeout);
+LIMD_GLUE_API int socket_loop_run(socket_loop_t loop);
+LIMD_GLUE_API void socket_loop_stop(socket_loop_t loop);
+
+/* hierarchical timer wheel with ms resolution, O(1) start/stop; not thread-safe */
+LIMD_GLUE_API socket_timer_wheel_t socket_timer_wheel_new(void);
+LIMD_GLUE_API void socket_timer_wheel_free(socket_timer_wheel_t wheel);
+/* ms until the next timer might expire, -1 if none, usable as poll() timeout */
+LIMD_GLUE_API int socket_timer_wheel_next_timeout(socket_timer_wheel_t wheel);
+/* runs the callbacks of all expired timers and returns their number */
+LIMD_GLUE_API int socket_timer_wheel_advance(socket_timer_wheel_t wheel);
+LIMD_GLUE_API socket_timer_t socket_timer_new(socket_timer_wheel_t wheel, socket_timer_cb_t callback, void *user_data);
+LIMD_GLUE_API void socket_timer_free(socket_timer_t timer);
+/* one-shot; restarting a pending timer moves its expiry */
+LIMD_GLUE_API int socket_timer_start(socket_timer_t timer, unsigned int timeout);
+LIMD_GLUE_API void socket_timer_stop(socket_timer_t timer);
+LIMD_GLUE_API int socket_timer_pending(socket_timer_t timer);
+
+/* io_uring based asynchronous I/O (Linux only, otherwise socket_uring_new() fails with ENOSYS); fds with a transport are rejected with -ENOTSUP */
+LIMD_GLUE_API socket_uring_t socket_uring_new(unsigned int entries);
+LIMD_GLUE_API void socket_uring_free(socket_uring_t ring);
+LIMD_GLUE_API int socket_uring_get_fd(socket_uring_t ring);
+LIMD_GLUE_API int socket_submit_recv(socket_uring_t ring, int fd, void *data, size_t length, int flags, socket_uring_cb_t callback, void *user_data);
+LIMD_GLUE_API int socket_submit_send(socket_uring_t ring, int fd, const void *data, size_t length, socket_uring_cb_t callback, void *user_data);
+LIMD_GLUE_API int socket_uring_submit(socket_uring_t ring);
+LIMD_GLUE_API int socket_uring_wait(socket_uring_t ring, int timeout);
+
+/* thread-safe pool of idle connections per endpoint; max_idle is per endpoint, idle_ttl in ms (0 = no expiry) */
+LIMD_GLUE_API socket_pool_t socket_pool_new(unsigned int max_idle, unsigned int idle_ttl);
+LIMD_GLUE_API void socket_pool_free(socket_pool_t pool);
+LIMD_GLUE_API int socket_pool_connect(socket_pool_t pool, const char *addr, uint16_t port);
+#ifndef _WIN32
+LIMD_GLUE_API int socket_pool_connect_unix(socket_pool_t pool, const char *filename);
+#endif
+/* hand a connection back for reuse, or close it if it is broken */
+LIMD_GLUE_API int socket_pool_release(socket_pool_t pool, int fd);
+LIMD_GLUE_API int socket_pool_discard(socket_pool_t pool, int fd);
+
+/* buffered reader, fetching as much data as fits into its buffer with every receive; timeouts are overall deadlines, 0 waits forever */
+LIMD_GLUE_API socket_reader_t socket_reader_new(int fd, size_t capacity);
+LIMD_GLUE_API void socket_reader_free(socket_reader_t reader);
+LIMD_GLUE_API size_t socket_reader_available(socket_reader_t reader);
+LIMD_GLUE_API int socket_reader_fill(socket_reader_t reader, unsigned int timeout);
+LIMD_GLUE_API int socket_reader_read(socket_reader_t reader, void *data, size_t length, unsigned int timeout);
+LIMD_GLUE_API int socket_reader_read_exact(socket_reader_t reader, void *data, size_t length, unsigned int timeout);
+/* returns the number of bytes copied to data, including the delimiter */
+LIMD_GLUE_API int socket_reader_read_until(socket_reader_t reader, const void *delim, size_t delim_len, void *data, size_t max_length, unsigned int timeout);
+LIMD_GLUE_API int socket_reader_peek_u32be(socket_reader_t reader, uint32_t *value, unsigned int timeout);
+LIMD_GLUE_API int socket_reader_peek_u32le(socket_reader_t reader, uint32_t *value, unsigned int timeout);
+/* zero-copy access to the next length bytes, valid until the next call on the reader; does not consume them */
+LIMD_GLUE_API int socket_reader_borrow(socket_reader_t reader, size_t length, const void **data, unsigned int timeout);
+LIMD_GLUE_API int socket_reader_consume(socket_reader_t reader, size_t length);
+
+/* write coalescing: data is sent once capacity is reached, on flush, or when flush_delay ms (0 = never) have passed since the first buffered write */
+LIMD_GLUE_API socket_writer_t socket_writer_new(int fd, size_t capacity, unsigned int flush_delay);
+LIMD_GLUE_API void socket_writer_free(socket_writer_t writer);
+LIMD_GLUE_API size_t socket_writer_pending(socket_writer_t writer);
+LIMD_GLUE_API int socket_writer_write(socket_writer_t writer, const void *data, size_t length);
+LIMD_GLUE_API int socket_writer_writev(socket_writer_t writer, const struct iovec *iov, int iovcnt);
+LIMD_GLUE_API int socket_writer_flush(socket_writer_t writer);
+/* flushes if the delay has expired; next_timeout receives the ms until the next deadline or -1 if none, usable as poll() timeout */
+LIMD_GLUE_API int socket_writer_flush_if_due(socket_writer_t writer, int *next_timeout);
+
+/* installing a transport routes socket_send*()/socket_receive*() through it; NULL removes it.
+ * Such sockets must be closed with socket_close() so the transport is released with the fd. */
+LIMD_GLUE_API int socket_set_transport(int fd, const struct socket_transport *transport, void *ctx);
+LIMD_GLUE_API const struct socket_transport* socket_get_transport(int fd, void **ctx);
+/* single non-waiting receive()/send() on the fd itself for use by transports; returns bytes or a negative errno */
+LIMD_GLUE_API int socket_receive_raw(int fd, void *data, size_t length, int flags);
+LIMD_GLUE_API int socket_send_raw(int fd, const void *data, size_t length, int flags);
+/* hands record encryption to the kernel after the handshake (Linux), tx or rx may be NULL; returns 0 or a negative errno */
+LIMD_GLUE_API int socket_enable_ktls(int fd, const struct socket_ktls_crypto *tx, const struct socket_ktls_crypto *rx);
+
+/* connected pair of stream sockets (socketpair(), loopback TCP on Windows); returns 0 or a negative errno */
+LIMD_GLUE_API int socket_pair(int fds[2]);
+
+/* relays data both ways until both sides closed, propagating half-closes with socket_shutdown(); zero-copy with splice() on Linux */
+LIMD_GLUE_API void socket_relay_options_init(struct socket_relay_options *ropts);
+LIMD_GLUE_API int socket_relay(int fd_a, int fd_b, const struct socket_relay_options *ropts, struct socket_relay_stats *stats);
+
+/* multi-threaded listening server; passing NULL server options uses socket_server_options_init() defaults */
+LIMD_GLUE_API void socket_server_options_init(struct socket_server_options *sopts);
+LIMD_GLUE_API socket_server_t socket_server_new(const char *addr, uint16_t port, const struct socket_server_options *sopts, const struct socket_options *opts, socket_server_cb_t callback, void *user_data);
+LIMD_GLUE_API int socket_server_start(socket_server_t server);
+LIMD_GLUE_API void socket_server_stop(socket_server_t server);
+LIMD_GLUE_API void socket_server_free(socket_server_t server);
+LIMD_GLUE_API int socket_server_get_fd(socket_server_t server, unsigned int index);
+/* 0 while all listeners accept, otherwise the negative errno that made one of them stop */
+LIMD_GLUE_API int socket_server_get_error(socket_server_t server);
 
 #ifdef __cplusplus
 }
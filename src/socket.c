@@ -19,6 +19,9 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
@@ -27,6 +30,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
 #ifndef _MSC_VER
 #include <unistd.h>
 #include <sys/time.h>
@@ -36,6 +41,8 @@
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #include <windows.h>
+#include <io.h>
+#include <fcntl.h>
 #ifndef HAVE_GETIFADDRS
 #include <iphlpapi.h>
 #endif
@@ -61,19 +68,100 @@
 #endif
 #ifdef __linux__
 #include <netpacket/packet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #endif
 #endif
 #endif
 #include "common.h"
 #include "libimobiledevice-glue/socket.h"
+#include "libimobiledevice-glue/thread.h"
+#include "libimobiledevice-glue/collection.h"
+#include "endianness.h"
 #ifdef HAVE_POLL
 #include <sys/poll.h>
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#if defined(__linux__) && defined(HAVE_LINUX_IO_URING_H)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+// the ring is driven through the raw syscalls, which older libc/arch headers might not define
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_IO_URING 1
+#endif
+#endif
+#if defined(__linux__) && defined(HAVE_LINUX_TLS_H)
+#include <linux/tls.h>
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#define HAVE_KTLS 1
+#endif
 
+/* built-in defaults, see socket_set_default_timeouts() */
 #define RECV_TIMEOUT 20000
 #define SEND_TIMEOUT 10000
 #define CONNECT_TIMEOUT 5000
 
+/* RFC 8305 "Connection Attempt Delay" */
+#define HAPPY_EYEBALLS_DELAY 250
+
+/* default buffer size of socket_reader_t */
+#define SOCKET_READER_DEFAULT_SIZE 0x10000
+
+/* how often socket_server_t worker threads check for a stop request */
+#define SOCKET_SERVER_POLL_INTERVAL 250
+
+/* how long a socket_server_t acceptor waits before retrying after a transient error (e.g. EMFILE) */
+#define SOCKET_SERVER_RETRY_INTERVAL 100
+
+/* default buffer size (and flush threshold) of socket_writer_t */
+#define SOCKET_WRITER_DEFAULT_SIZE 0x4000
+
+/* lifetime of the cached interface list where no change notifications are available */
+#define SOCKET_IFADDRS_TTL 5000
+
+/* resolver cache and background lookup threads */
+#define SOCKET_RESOLVER_DEFAULT_TTL 60000
+#define SOCKET_RESOLVER_MAX_ENTRIES 64
+#define SOCKET_RESOLVER_MAX_THREADS 4
+#define SOCKET_RESOLVER_IDLE_TIMEOUT 10000
+
+/* connections socket_pair() accepts on its loopback listener (Windows) before giving up on foreign ones */
+#define SOCKET_PAIR_MAX_ACCEPTS 16
+
+/* default per-direction buffer (or pipe) size of socket_relay() */
+#define SOCKET_RELAY_DEFAULT_SIZE 0x10000
+
+/* max number of file descriptors passed with one socket_send_fds()/socket_receive_fds() call */
+#define SOCKET_MAX_PASS_FDS 64
+
+/* max number of iovecs handed to the kernel per call by the vectored I/O functions */
+#define SOCKET_IOV_CHUNK 64
+
+/* max number of datagrams handled per recvmmsg/sendmmsg call */
+#define SOCKET_BATCH_CHUNK 32
+
+/* max bytes per sendfile() call, and buffer size for the read/send fallback */
+#define SOCKET_SENDFILE_CHUNK 0x100000
+#define SOCKET_FILE_BUFFER_SIZE 0x10000
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 #ifndef EAFNOSUPPORT
 #define EAFNOSUPPORT 102
 #endif
@@ -90,13 +178,145 @@
 
 static int verbose = 0;
 
+static unsigned int socket_recv_timeout = RECV_TIMEOUT;
+static unsigned int socket_send_timeout = SEND_TIMEOUT;
+static unsigned int socket_connect_timeout = CONNECT_TIMEOUT;
+
+#ifdef _MSC_VER
+#define ALWAYS_INLINE __forceinline
+#else
+#define ALWAYS_INLINE __inline__ __attribute__((__always_inline__))
+#endif
+
 #define SOCKET_ERR(level, msg, ...) \
 	if (verbose >= level) { \
 		fprintf(stderr, "[socket] " msg , ## __VA_ARGS__); \
 	}
 
+#if defined(__GNUC__) || defined(__clang__)
+#define ATOMIC_LOAD_PTR(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE_PTR(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define ATOMIC_LOAD_RELAXED(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define ATOMIC_STORE_RELAXED(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+#define ATOMIC_ADD_RELAXED(p, v) __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+#else
+#define ATOMIC_LOAD_PTR(p) (*(p))
+#define ATOMIC_STORE_PTR(p, v) (*(p) = (v))
+#define ATOMIC_LOAD_RELAXED(p) (*(p))
+#define ATOMIC_STORE_RELAXED(p, v) (*(p) = (v))
+#define ATOMIC_ADD_RELAXED(p, v) (*(p) += (v))
+#endif
+
+#define SOCKET_RECV_TIMEOUT ATOMIC_LOAD_RELAXED(&socket_recv_timeout)
+#define SOCKET_SEND_TIMEOUT ATOMIC_LOAD_RELAXED(&socket_send_timeout)
+
+// connect timeout as poll() timeout, 0 (no limit) becomes -1
+static ALWAYS_INLINE int socket_connect_poll_timeout(void)
+{
+	unsigned int timeout = ATOMIC_LOAD_RELAXED(&socket_connect_timeout);
+	return (timeout > 0 && timeout <= INT_MAX) ? (int)timeout : -1;
+}
+
+/*
+ * Per-fd state is kept in a two-level table indexed by the fd number.
+ * Pages are allocated on demand and never freed, so lookups on the I/O
+ * path don't need to take a lock. The same goes for a slot's statistics
+ * block, which is only zeroed when the fd is closed. fds beyond the table
+ * size simply get the default behavior.
+ */
+#define SOCKET_FD_PAGE_BITS 8
+#define SOCKET_FD_PAGE_SIZE (1 << SOCKET_FD_PAGE_BITS)
+#define SOCKET_FD_MAX_PAGES 4096
+
+struct socket_fd_info {
+	unsigned int io_flags;
+	struct socket_stats *stats;
+	const struct socket_transport *transport;
+	void *transport_ctx;
+};
+
+static struct socket_fd_info *socket_fd_table[SOCKET_FD_MAX_PAGES];
+static mutex_t socket_fd_table_mutex;
+
+/* interface list cache shared by get_primary_mac_address() and the IPv6 scope id lookup */
+static mutex_t socket_ifaddrs_mutex;
+
+static mutex_t socket_resolver_mutex;
+static cond_t socket_resolver_cond;
+
+static struct socket_fd_info* socket_fd_info_get(int fd, int create)
+{
+	if (fd < 0 || (fd >> SOCKET_FD_PAGE_BITS) >= SOCKET_FD_MAX_PAGES) {
+		return NULL;
+	}
+	struct socket_fd_info **slot = &socket_fd_table[fd >> SOCKET_FD_PAGE_BITS];
+	struct socket_fd_info *page = ATOMIC_LOAD_PTR(slot);
+	if (!page) {
+		if (!create) {
+			return NULL;
+		}
+		mutex_lock(&socket_fd_table_mutex);
+		page = *slot;
+		if (!page) {
+			page = (struct socket_fd_info*)calloc(SOCKET_FD_PAGE_SIZE, sizeof(struct socket_fd_info));
+			if (page) {
+				ATOMIC_STORE_PTR(slot, page);
+			}
+		}
+		mutex_unlock(&socket_fd_table_mutex);
+		if (!page) {
+			return NULL;
+		}
+	}
+	return &page[fd & (SOCKET_FD_PAGE_SIZE - 1)];
+}
+
+static ALWAYS_INLINE unsigned int socket_fd_io_flags(int fd)
+{
+	struct socket_fd_info *info = socket_fd_info_get(fd, 0);
+	return (info) ? ATOMIC_LOAD_RELAXED(&info->io_flags) : 0;
+}
+
+static ALWAYS_INLINE const struct socket_transport* socket_fd_transport(int fd, void **ctx)
+{
+	struct socket_fd_info *info = socket_fd_info_get(fd, 0);
+	const struct socket_transport *transport = (info) ? ATOMIC_LOAD_PTR(&info->transport) : NULL;
+	if (transport && ctx) {
+		*ctx = info->transport_ctx;
+	}
+	return transport;
+}
+
+static void socket_stats_zero(struct socket_stats *st)
+{
+	size_t i;
+	// all members are uint64_t counters
+	for (i = 0; i < sizeof(struct socket_stats) / sizeof(uint64_t); i++) {
+		ATOMIC_STORE_RELAXED(&((uint64_t*)st)[i], 0);
+	}
+}
+
+static void socket_fd_info_reset(int fd)
+{
+	struct socket_fd_info *info = socket_fd_info_get(fd, 0);
+	if (info) {
+		struct socket_stats *st = ATOMIC_LOAD_PTR(&info->stats);
+		ATOMIC_STORE_RELAXED(&info->io_flags, 0);
+		ATOMIC_STORE_PTR(&info->transport, NULL);
+		info->transport_ctx = NULL;
+		// other threads might still be reading or updating the stats, so keep the block
+		if (st) {
+			socket_stats_zero(st);
+		}
+	}
+}
+
 void socket_init(void)
 {
+	mutex_init(&socket_fd_table_mutex);
+	mutex_init(&socket_ifaddrs_mutex);
+	mutex_init(&socket_resolver_mutex);
+	cond_init(&socket_resolver_cond);
 #ifdef _WIN32
 	WSADATA wsa_data;
 	if (WSAStartup(MAKEWORD(2,2), &wsa_data) != ERROR_SUCCESS) {
@@ -115,6 +335,26 @@ void socket_set_verbose(int level)
 	verbose = level;
 }
 
+void socket_set_default_timeouts(unsigned int recv_timeout, unsigned int send_timeout, unsigned int connect_timeout)
+{
+	ATOMIC_STORE_RELAXED(&socket_recv_timeout, recv_timeout);
+	ATOMIC_STORE_RELAXED(&socket_send_timeout, send_timeout);
+	ATOMIC_STORE_RELAXED(&socket_connect_timeout, connect_timeout);
+}
+
+void socket_get_default_timeouts(unsigned int *recv_timeout, unsigned int *send_timeout, unsigned int *connect_timeout)
+{
+	if (recv_timeout) {
+		*recv_timeout = ATOMIC_LOAD_RELAXED(&socket_recv_timeout);
+	}
+	if (send_timeout) {
+		*send_timeout = ATOMIC_LOAD_RELAXED(&socket_send_timeout);
+	}
+	if (connect_timeout) {
+		*connect_timeout = ATOMIC_LOAD_RELAXED(&socket_connect_timeout);
+	}
+}
+
 const char *socket_addr_to_string(struct sockaddr *addr, char *addr_out, size_t addr_out_size)
 {
 #if defined(_WIN32) && ( _WIN32_WINNT < 0x0600 )
@@ -160,6 +400,66 @@ const char *socket_addr_to_string(struct sockaddr *addr, char *addr_out, size_t
 	return NULL;
 }
 
+const char *socket_addr_format(const struct sockaddr *addr, char *addr_out, size_t addr_out_size)
+{
+	char host[INET6_ADDRSTRLEN + 16];
+	int len;
+
+	if (!addr || !addr_out || addr_out_size == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (addr->sa_family == AF_INET) {
+		struct sockaddr_in sin;
+		memcpy(&sin, addr, sizeof(sin));
+		// WSAAddressToString() would include a non-zero port
+		sin.sin_port = 0;
+		if (!socket_addr_to_string((struct sockaddr*)&sin, host, sizeof(host))) {
+			return NULL;
+		}
+		len = snprintf(addr_out, addr_out_size, "%s:%u", host, ntohs(((const struct sockaddr_in*)addr)->sin_port));
+	}
+#ifdef AF_INET6
+	else if (addr->sa_family == AF_INET6) {
+		struct sockaddr_in6 sin6;
+		memcpy(&sin6, addr, sizeof(sin6));
+		sin6.sin6_port = 0;
+		sin6.sin6_scope_id = 0;
+		if (!socket_addr_to_string((struct sockaddr*)&sin6, host, sizeof(host))) {
+			return NULL;
+		}
+		sin6.sin6_scope_id = ((const struct sockaddr_in6*)addr)->sin6_scope_id;
+		if (sin6.sin6_scope_id != 0) {
+			len = snprintf(addr_out, addr_out_size, "[%s%%%u]:%u", host, (unsigned int)sin6.sin6_scope_id, ntohs(((const struct sockaddr_in6*)addr)->sin6_port));
+		} else {
+			len = snprintf(addr_out, addr_out_size, "[%s]:%u", host, ntohs(((const struct sockaddr_in6*)addr)->sin6_port));
+		}
+	}
+#endif
+#ifndef _WIN32
+	else if (addr->sa_family == AF_UNIX) {
+		const struct sockaddr_un *saddr_un = (const struct sockaddr_un*)addr;
+		if (saddr_un->sun_path[0] == '\0' && saddr_un->sun_path[1] != '\0') {
+			// abstract namespace
+			len = snprintf(addr_out, addr_out_size, "unix:@%.*s", (int)sizeof(saddr_un->sun_path) - 1, saddr_un->sun_path + 1);
+		} else {
+			len = snprintf(addr_out, addr_out_size, "unix:%.*s", (int)sizeof(saddr_un->sun_path), saddr_un->sun_path);
+		}
+	}
+#endif
+	else {
+		errno = EAFNOSUPPORT;
+		return NULL;
+	}
+
+	if (len < 0 || (size_t)len >= addr_out_size) {
+		errno = ENOSPC;
+		return NULL;
+	}
+	return addr_out;
+}
+
 enum poll_status
 {
 	poll_status_success,
@@ -167,12 +467,6 @@ enum poll_status
 	poll_status_error
 };
 
-#ifdef _MSC_VER
-#define ALWAYS_INLINE __forceinline
-#else
-#define ALWAYS_INLINE __inline__ __attribute__((__always_inline__))
-#endif
-
 #ifdef _WIN32
 static ALWAYS_INLINE int WSAError_to_errno(int wsaerr)
 {
@@ -218,8 +512,126 @@ static ALWAYS_INLINE int WSAError_to_errno(int wsaerr)
 }
 #endif
 
+// monotonic time in microseconds
+static uint64_t socket_time_us(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq = { 0 };
+	LARGE_INTEGER now;
+	if (freq.QuadPart == 0) {
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&now);
+	return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000 + (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#elif defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+#endif
+}
+
+/*
+ * I/O statistics. Collection is off by default; when enabled, every
+ * instrumented call updates the global counters and, if SOCKET_IO_STATS is
+ * set on the fd, the per-fd counters too. All updates are relaxed atomic
+ * adds so they don't serialize concurrent I/O.
+ */
+static int socket_stats_enabled = 0;
+static struct socket_stats socket_stats_global;
+
+#define SOCKET_STATS_BEGIN() (ATOMIC_LOAD_RELAXED(&socket_stats_enabled) ? socket_time_us() : 0)
+#define SOCKET_STATS_IO(fd, is_send, result, bytes, start) \
+	do { \
+		if (start) { \
+			socket_stats_io(fd, is_send, (int64_t)(result), (uint64_t)(bytes), start); \
+		} \
+	} while (0)
+
+static ALWAYS_INLINE unsigned int socket_stats_bucket(uint64_t us)
+{
+	unsigned int n = 0;
+	while (us > 0 && n < SOCKET_STATS_HISTOGRAM_BUCKETS - 1) {
+		us >>= 1;
+		n++;
+	}
+	return n;
+}
+
+static ALWAYS_INLINE struct socket_stats* socket_stats_for_fd(int fd)
+{
+	struct socket_fd_info *info = socket_fd_info_get(fd, 0);
+	if (!info || !(ATOMIC_LOAD_RELAXED(&info->io_flags) & SOCKET_IO_STATS)) {
+		return NULL;
+	}
+	return ATOMIC_LOAD_PTR(&info->stats);
+}
+
+static void socket_stats_io_apply(struct socket_stats *st, int is_send, int64_t result, uint64_t bytes, int err, uint64_t elapsed)
+{
+	if (is_send) {
+		ATOMIC_ADD_RELAXED(&st->send_calls, 1);
+		ATOMIC_ADD_RELAXED(&st->bytes_sent, bytes);
+	} else {
+		ATOMIC_ADD_RELAXED(&st->receive_calls, 1);
+		ATOMIC_ADD_RELAXED(&st->bytes_received, bytes);
+	}
+	if (result < 0) {
+		if (err == EAGAIN || err == EWOULDBLOCK) {
+			ATOMIC_ADD_RELAXED(&st->eagain, 1);
+		} else if (err == ECONNRESET || err == EPIPE) {
+			ATOMIC_ADD_RELAXED(&st->resets, 1);
+		} else if (err != EINTR) {
+			ATOMIC_ADD_RELAXED(&st->errors, 1);
+		}
+	} else if (result == 0 && !is_send) {
+		// orderly shutdown by the peer, reported as ECONNRESET to the caller
+		ATOMIC_ADD_RELAXED(&st->resets, 1);
+	}
+	ATOMIC_ADD_RELAXED(&st->io_us, elapsed);
+	ATOMIC_ADD_RELAXED(&st->io_histogram[socket_stats_bucket(elapsed)], 1);
+}
+
+// must be called right after the system call as it evaluates errno
+static void socket_stats_io(int fd, int is_send, int64_t result, uint64_t bytes, uint64_t start)
+{
+	struct socket_stats *st;
+	uint64_t elapsed;
+	int err = 0;
+
+	if (result < 0) {
+#ifdef _WIN32
+		err = WSAError_to_errno(WSAGetLastError());
+#else
+		err = errno;
+#endif
+	}
+	elapsed = socket_time_us() - start;
+	socket_stats_io_apply(&socket_stats_global, is_send, result, bytes, err, elapsed);
+	st = socket_stats_for_fd(fd);
+	if (st) {
+		socket_stats_io_apply(st, is_send, result, bytes, err, elapsed);
+	}
+}
+
+static void socket_stats_poll_apply(struct socket_stats *st, enum poll_status status, int timeout, uint64_t elapsed)
+{
+	ATOMIC_ADD_RELAXED(&st->poll_calls, 1);
+	ATOMIC_ADD_RELAXED(&st->poll_wait_us, elapsed);
+	ATOMIC_ADD_RELAXED(&st->poll_histogram[socket_stats_bucket(elapsed)], 1);
+	if (status == poll_status_timeout && timeout != 0) {
+		// a zero timeout is just a readiness probe
+		ATOMIC_ADD_RELAXED(&st->timeouts, 1);
+	} else if (status == poll_status_error) {
+		ATOMIC_ADD_RELAXED(&st->errors, 1);
+	}
+}
+
 // timeout of -1 means infinity
-static ALWAYS_INLINE enum poll_status poll_wrapper(int fd, fd_mode mode, int timeout)
+static ALWAYS_INLINE enum poll_status poll_wrapper_raw(int fd, fd_mode mode, int timeout)
 {
 #ifdef HAVE_POLL
 	// https://man7.org/linux/man-pages/man2/select.2.html
@@ -288,7 +700,7 @@ static ALWAYS_INLINE enum poll_status poll_wrapper(int fd, fd_mode mode, int tim
 	sret = poll_status_error;
 
 	do {
-		if (timeout > 0) {
+		if (timeout >= 0) {
 			to.tv_sec = (time_t) (timeout / 1000);
 			to.tv_usec = (time_t) ((timeout - (to.tv_sec * 1000)) * 1000);
 			pto = &to;
@@ -339,500 +751,1401 @@ static ALWAYS_INLINE enum poll_status poll_wrapper(int fd, fd_mode mode, int tim
 #endif
 }
 
-#ifndef _WIN32
-int socket_create_unix(const char *filename)
+static ALWAYS_INLINE enum poll_status poll_wrapper(int fd, fd_mode mode, int timeout)
 {
-	struct sockaddr_un name;
-	int sock;
-#ifdef SO_NOSIGPIPE
-	int yes = 1;
-#endif
-
-	// remove if still present
-	unlink(filename);
-
-	/* Create the socket. */
-	sock = socket(PF_UNIX, SOCK_STREAM, 0);
-	if (sock < 0) {
-		SOCKET_ERR(1, "socket(): %s\n", strerror(errno));
-		return -1;
-	}
-
-#ifdef SO_NOSIGPIPE
-	if (setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, (void*)&yes, sizeof(int)) == -1) {
-		SOCKET_ERR(1, "setsockopt(): %s\n", strerror(errno));
-		return -1;
+	uint64_t start = SOCKET_STATS_BEGIN();
+	enum poll_status status = poll_wrapper_raw(fd, mode, timeout);
+	if (start) {
+		uint64_t elapsed = socket_time_us() - start;
+		struct socket_stats *st = socket_stats_for_fd(fd);
+		socket_stats_poll_apply(&socket_stats_global, status, timeout, elapsed);
+		if (st) {
+			socket_stats_poll_apply(st, status, timeout, elapsed);
+		}
 	}
-#endif
-
-	/* Bind a name to the socket. */
-	name.sun_family = AF_UNIX;
-	strncpy(name.sun_path, filename, sizeof(name.sun_path));
-	name.sun_path[sizeof(name.sun_path) - 1] = '\0';
+	return status;
+}
 
-	if (bind(sock, (struct sockaddr*)&name, sizeof(name)) < 0) {
-		SOCKET_ERR(1, "bind(): %s\n", strerror(errno));
-		socket_close(sock);
-		return -1;
+#ifdef HAVE_POLL
+static short socket_events_to_poll(int events)
+{
+	short ev = 0;
+	if (events & SOCKET_EVENT_READ) {
+		ev |= POLLIN | POLLPRI;
 	}
-
-	if (listen(sock, 100) < 0) {
-		SOCKET_ERR(1, "listen(): %s\n", strerror(errno));
-		socket_close(sock);
-		return -1;
+	if (events & SOCKET_EVENT_WRITE) {
+		ev |= POLLOUT;
 	}
-
-	return sock;
+	return ev;
 }
 
-int socket_connect_unix(const char *filename)
+static int socket_events_from_poll(short ev)
 {
-	struct sockaddr_un name;
-	int sfd = -1;
-	struct stat fst;
-#ifdef SO_NOSIGPIPE
-	int yes = 1;
-#endif
-	int bufsize = 0x20000;
-
-	// check if socket file exists...
-	if (stat(filename, &fst) != 0) {
-		SOCKET_ERR(2, "%s: stat '%s': %s\n", __func__, filename, strerror(errno));
-		return -1;
+	int events = 0;
+	if (ev & (POLLIN | POLLPRI)) {
+		events |= SOCKET_EVENT_READ;
 	}
-	// ... and if it is a unix domain socket
-	if (!S_ISSOCK(fst.st_mode)) {
-		SOCKET_ERR(2, "%s: File '%s' is not a socket!\n", __func__, filename);
-		return -1;
+	if (ev & POLLOUT) {
+		events |= SOCKET_EVENT_WRITE;
 	}
-	// make a new socket
-	if ((sfd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0) {
-		SOCKET_ERR(2, "%s: socket: %s\n", __func__, strerror(errno));
-		return -1;
+	if (ev & (POLLERR | POLLNVAL)) {
+		events |= SOCKET_EVENT_ERROR;
 	}
-
-	if (setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, (void*)&bufsize, sizeof(int)) == -1) {
-		SOCKET_ERR(1, "Could not set send buffer for socket: %s\n", strerror(errno));
+	if (ev & POLLHUP) {
+		events |= SOCKET_EVENT_HUP;
 	}
+	return events;
+}
+#endif
 
-	if (setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, (void*)&bufsize, sizeof(int)) == -1) {
-		SOCKET_ERR(1, "Could not set receive buffer for socket: %s\n", strerror(errno));
+// like poll_wrapper() but for multiple fds with SOCKET_EVENT_* masks, returns the number of ready fds
+static int poll_wrapper_multi(struct socket_poll_entry *entries, unsigned int count, int timeout)
+{
+	unsigned int i;
+	int res;
+#ifdef HAVE_POLL
+	struct pollfd spfds[16];
+	struct pollfd *pfds = spfds;
+	if (count > sizeof(spfds) / sizeof(spfds[0])) {
+		pfds = (struct pollfd*)malloc(sizeof(struct pollfd) * count);
+		if (!pfds) {
+			return -ENOMEM;
+		}
 	}
-
-#ifdef SO_NOSIGPIPE
-	if (setsockopt(sfd, SOL_SOCKET, SO_NOSIGPIPE, (void*)&yes, sizeof(int)) == -1) {
-		SOCKET_ERR(1, "setsockopt(): %s\n", strerror(errno));
-		socket_close(sfd);
-		return -1;
+	for (i = 0; i < count; i++) {
+		pfds[i].fd = entries[i].fd;
+		pfds[i].events = socket_events_to_poll(entries[i].events);
+		pfds[i].revents = 0;
 	}
-#endif
-	// and connect to 'filename'
-	name.sun_family = AF_UNIX;
-	strncpy(name.sun_path, filename, sizeof(name.sun_path));
-	name.sun_path[sizeof(name.sun_path) - 1] = 0;
-
-	int flags = fcntl(sfd, F_GETFL, 0);
-	fcntl(sfd, F_SETFL, flags | O_NONBLOCK);
-
 	do {
-		if (connect(sfd, (struct sockaddr*)&name, sizeof(name)) != -1) {
-			break;
+		res = poll(pfds, count, timeout);
+	} while (res < 0 && errno == EINTR);
+	if (res < 0) {
+		res = -errno;
+		SOCKET_ERR(2, "%s: poll failed: %s\n", __func__, strerror(-res));
+	} else {
+		for (i = 0; i < count; i++) {
+			entries[i].revents = socket_events_from_poll(pfds[i].revents);
 		}
-		if (errno == EINPROGRESS) {
-			if (poll_wrapper(sfd, FDM_WRITE, CONNECT_TIMEOUT) == poll_status_success) {
-				int so_error;
-				socklen_t len = sizeof(so_error);
-				getsockopt(sfd, SOL_SOCKET, SO_ERROR, (void*)&so_error, &len);
-				if (so_error == 0) {
-					errno = 0;
-					break;
+	}
+	if (pfds != spfds) {
+		free(pfds);
+	}
+	return res;
+#else
+	fd_set rfds, wfds, efds;
+	struct timeval to;
+	struct timeval *pto = NULL;
+	int maxfd = -1;
+	if (count > FD_SETSIZE) {
+#if defined(_WIN32) && (_WIN32_WINNT >= 0x0600)
+		// WSAPoll() has no FD_SETSIZE limit, but it is only used here since it misses failed connects on older Windows versions
+		WSAPOLLFD *pfds = (WSAPOLLFD*)malloc(sizeof(WSAPOLLFD) * count);
+		if (!pfds) {
+			return -ENOMEM;
+		}
+		for (i = 0; i < count; i++) {
+			pfds[i].fd = (entries[i].fd < 0) ? INVALID_SOCKET : (SOCKET)entries[i].fd;
+			pfds[i].events = ((entries[i].events & SOCKET_EVENT_READ) ? POLLRDNORM : 0) | ((entries[i].events & SOCKET_EVENT_WRITE) ? POLLWRNORM : 0);
+			pfds[i].revents = 0;
+		}
+		res = WSAPoll(pfds, count, timeout);
+		if (res < 0) {
+			res = -WSAError_to_errno(WSAGetLastError());
+			SOCKET_ERR(2, "%s: WSAPoll failed: %s\n", __func__, strerror(-res));
+		} else {
+			for (i = 0; i < count; i++) {
+				entries[i].revents = 0;
+				if (pfds[i].revents & POLLRDNORM) {
+					entries[i].revents |= SOCKET_EVENT_READ;
 				}
-				errno = so_error;
-			} else {
-				int so_error = 0;
-				socklen_t len = sizeof(so_error);
-				getsockopt(sfd, SOL_SOCKET, SO_ERROR, (void*)&so_error, &len);
-				if (so_error != 0) {
-					errno = so_error;
+				if (pfds[i].revents & POLLWRNORM) {
+					entries[i].revents |= SOCKET_EVENT_WRITE;
+				}
+				if (pfds[i].revents & (POLLERR | POLLNVAL)) {
+					entries[i].revents |= SOCKET_EVENT_ERROR;
+				}
+				if (pfds[i].revents & POLLHUP) {
+					entries[i].revents |= SOCKET_EVENT_HUP;
 				}
 			}
 		}
-		socket_close(sfd);
-		sfd = -1;
-	} while (0);
-
-	if (sfd < 0) {
-		SOCKET_ERR(2, "%s: connect: %s\n", __func__, strerror(errno));
-		return -1;
+		free(pfds);
+		return res;
+#else
+		return -EINVAL;
+#endif
 	}
-
-	return sfd;
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+	FD_ZERO(&efds);
+	for (i = 0; i < count; i++) {
+		entries[i].revents = 0;
+		if (entries[i].fd < 0) {
+			continue;
+		}
+		if (entries[i].events & SOCKET_EVENT_READ) {
+			FD_SET(entries[i].fd, &rfds);
+		}
+		if (entries[i].events & SOCKET_EVENT_WRITE) {
+			FD_SET(entries[i].fd, &wfds);
+		}
+		FD_SET(entries[i].fd, &efds);
+		if (entries[i].fd > maxfd) {
+			maxfd = entries[i].fd;
+		}
+	}
+	if (timeout >= 0) {
+		to.tv_sec = (time_t)(timeout / 1000);
+		to.tv_usec = (time_t)((timeout % 1000) * 1000);
+		pto = &to;
+	}
+	do {
+		res = select(maxfd + 1, &rfds, &wfds, &efds, pto);
+#ifdef _WIN32
+		if (res < 0) {
+			errno = WSAError_to_errno(WSAGetLastError());
+		}
+#endif
+	} while (res < 0 && errno == EINTR);
+	if (res < 0) {
+		res = -errno;
+		SOCKET_ERR(2, "%s: select failed: %s\n", __func__, strerror(-res));
+		return res;
+	}
+	res = 0;
+	for (i = 0; i < count; i++) {
+		if (entries[i].fd < 0) {
+			continue;
+		}
+		if (FD_ISSET(entries[i].fd, &rfds)) {
+			entries[i].revents |= SOCKET_EVENT_READ;
+		}
+		if (FD_ISSET(entries[i].fd, &wfds)) {
+			entries[i].revents |= SOCKET_EVENT_WRITE;
+		}
+		if (FD_ISSET(entries[i].fd, &efds)) {
+			entries[i].revents |= SOCKET_EVENT_ERROR;
+		}
+		if (entries[i].revents) {
+			res++;
+		}
+	}
+	return res;
+#endif
 }
+
+// monotonic time in milliseconds
+static uint64_t socket_time_ms(void)
+{
+#ifdef _WIN32
+	return (uint64_t)GetTickCount64();
+#elif defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_usec / 1000;
 #endif
+}
 
-int socket_create(const char* addr, uint16_t port)
+void socket_options_init(struct socket_options *opts)
 {
-	int sfd = -1;
-	int yes = 1;
-	int no = 0;
-	struct addrinfo hints;
-	struct addrinfo *result, *rp;
-	char portstr[8];
-	int res;
+	if (!opts) {
+		return;
+	}
+	memset(opts, 0, sizeof(struct socket_options));
+	opts->send_buffer_size = 0x20000;
+	opts->receive_buffer_size = 0x20000;
+	opts->nodelay = 1;
+}
 
-	memset(&hints, '\0', sizeof(struct addrinfo));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
-	hints.ai_protocol = IPPROTO_TCP;
+static int socket_setsockopt_int(int fd, int level, int name, int value, const char *desc)
+{
+	if (setsockopt(fd, level, name, (void*)&value, sizeof(int)) == -1) {
+#ifdef _WIN32
+		errno = WSAError_to_errno(WSAGetLastError());
+#endif
+		SOCKET_ERR(1, "Could not set %s on socket: %s\n", desc, strerror(errno));
+		return -errno;
+	}
+	return 0;
+}
 
-	snprintf(portstr, 8, "%d", port);
+// tcp selects whether the TCP level options apply to this socket
+static int socket_apply_options(int fd, const struct socket_options *opts, int tcp)
+{
+	int res = 0;
+	int r;
 
-	res = getaddrinfo(addr, portstr, &hints, &result);
-	if (res != 0) {
-		SOCKET_ERR(1, "%s: getaddrinfo: %s\n", __func__, gai_strerror(res));
-		return -1;
+	if (opts->send_buffer_size > 0) {
+		r = socket_setsockopt_int(fd, SOL_SOCKET, SO_SNDBUF, opts->send_buffer_size, "send buffer");
+		if (r < 0) {
+			res = r;
+		}
 	}
-
-	for (rp = result; rp != NULL; rp = rp->ai_next) {
-		sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-		if (sfd == -1) {
-			continue;
+	if (opts->receive_buffer_size > 0) {
+		r = socket_setsockopt_int(fd, SOL_SOCKET, SO_RCVBUF, opts->receive_buffer_size, "receive buffer");
+		if (r < 0) {
+			res = r;
+		}
+	}
+#ifdef SO_BUSY_POLL
+	if (opts->busy_poll > 0) {
+		r = socket_setsockopt_int(fd, SOL_SOCKET, SO_BUSY_POLL, opts->busy_poll, "SO_BUSY_POLL");
+		if (r < 0) {
+			res = r;
 		}
+	}
+#endif
+	if (!tcp) {
+		return res;
+	}
 
-		if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void*)&yes, sizeof(int)) == -1) {
-#ifdef _WIN32
-			errno = WSAError_to_errno(WSAGetLastError());
+	r = socket_setsockopt_int(fd, IPPROTO_TCP, TCP_NODELAY, (opts->nodelay) ? 1 : 0, "TCP_NODELAY");
+	if (r < 0) {
+		res = r;
+	}
+#ifdef TCP_QUICKACK
+	if (opts->quickack) {
+		r = socket_setsockopt_int(fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+		if (r < 0) {
+			res = r;
+		}
+	}
 #endif
-			SOCKET_ERR(1, "setsockopt() SO_REUSEADDR: %s\n", strerror(errno));
-			socket_close(sfd);
-			continue;
+	if (opts->cork) {
+#if defined(TCP_CORK)
+		r = socket_setsockopt_int(fd, IPPROTO_TCP, TCP_CORK, 1, "TCP_CORK");
+		if (r < 0) {
+			res = r;
 		}
-
-#ifdef SO_NOSIGPIPE
-		if (setsockopt(sfd, SOL_SOCKET, SO_NOSIGPIPE, (void*)&yes, sizeof(int)) == -1) {
-			SOCKET_ERR(1, "setsockopt() SO_NOSIGPIPE: %s\n", strerror(errno));
-			socket_close(sfd);
-			continue;
+#elif defined(TCP_NOPUSH)
+		r = socket_setsockopt_int(fd, IPPROTO_TCP, TCP_NOPUSH, 1, "TCP_NOPUSH");
+		if (r < 0) {
+			res = r;
 		}
 #endif
-
-#if defined(AF_INET6) && defined(IPV6_V6ONLY)
-		if (rp->ai_family == AF_INET6) {
-			if (setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, (addr) ? (void*)&yes : (void*)&no, sizeof(int)) == -1) {
-#ifdef _WIN32
-				errno = WSAError_to_errno(WSAGetLastError());
+	}
+	if (opts->keepalive) {
+		r = socket_setsockopt_int(fd, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+		if (r < 0) {
+			res = r;
+		}
+#if defined(TCP_KEEPIDLE)
+		if (opts->keepalive_idle > 0) {
+			r = socket_setsockopt_int(fd, IPPROTO_TCP, TCP_KEEPIDLE, opts->keepalive_idle, "TCP_KEEPIDLE");
+			if (r < 0) {
+				res = r;
+			}
+		}
+#elif defined(TCP_KEEPALIVE)
+		if (opts->keepalive_idle > 0) {
+			r = socket_setsockopt_int(fd, IPPROTO_TCP, TCP_KEEPALIVE, opts->keepalive_idle, "TCP_KEEPALIVE");
+			if (r < 0) {
+				res = r;
+			}
+		}
 #endif
-				SOCKET_ERR(1, "setsockopt() IPV6_V6ONLY: %s\n", strerror(errno));
+#ifdef TCP_KEEPINTVL
+		if (opts->keepalive_interval > 0) {
+			r = socket_setsockopt_int(fd, IPPROTO_TCP, TCP_KEEPINTVL, opts->keepalive_interval, "TCP_KEEPINTVL");
+			if (r < 0) {
+				res = r;
 			}
 		}
 #endif
-
-		if (bind(sfd, rp->ai_addr, rp->ai_addrlen) < 0) {
-#ifdef _WIN32
-			errno = WSAError_to_errno(WSAGetLastError());
+#ifdef TCP_KEEPCNT
+		if (opts->keepalive_count > 0) {
+			r = socket_setsockopt_int(fd, IPPROTO_TCP, TCP_KEEPCNT, opts->keepalive_count, "TCP_KEEPCNT");
+			if (r < 0) {
+				res = r;
+			}
+		}
 #endif
-			SOCKET_ERR(1, "bind(): %s\n", strerror(errno));
-			socket_close(sfd);
-			continue;
+	}
+#ifdef TCP_USER_TIMEOUT
+	if (opts->user_timeout > 0) {
+		r = socket_setsockopt_int(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, (int)opts->user_timeout, "TCP_USER_TIMEOUT");
+		if (r < 0) {
+			res = r;
 		}
+	}
+#endif
+
+	return res;
+}
+
+int socket_set_options(int fd, const struct socket_options *opts)
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+	int type = 0;
+	socklen_t type_len = sizeof(type);
 
-		if (listen(sfd, 100) < 0) {
+	if (fd < 0 || !opts) {
+		return -EINVAL;
+	}
+	memset(&addr, 0, sizeof(addr));
+	if (getsockname(fd, (struct sockaddr*)&addr, &addr_len) < 0 || getsockopt(fd, SOL_SOCKET, SO_TYPE, (void*)&type, &type_len) < 0) {
 #ifdef _WIN32
-			errno = WSAError_to_errno(WSAGetLastError());
+		errno = WSAError_to_errno(WSAGetLastError());
 #endif
-			SOCKET_ERR(1, "listen(): %s\n", strerror(errno));
-			socket_close(sfd);
-			continue;
-		}
-		break;
+		return -errno;
 	}
+	int tcp = (type == SOCK_STREAM) && (addr.ss_family == AF_INET
+#ifdef AF_INET6
+		|| addr.ss_family == AF_INET6
+#endif
+		);
+	return socket_apply_options(fd, opts, tcp);
+}
 
-	freeaddrinfo(result);
+#ifndef _WIN32
+// fills addr for a filesystem path or, with SOCKET_UNIX_ABSTRACT, a Linux abstract namespace name
+static int socket_unix_addr(const char *name, int flags, struct sockaddr_un *addr, socklen_t *addr_len)
+{
+	size_t len;
 
-	if (rp == NULL) {
-		return -1;
+	if (!name) {
+		return -EINVAL;
 	}
-
-	return sfd;
+	len = strlen(name);
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	if (flags & SOCKET_UNIX_ABSTRACT) {
+#ifdef __linux__
+		// leading NUL byte, the name is not NUL-terminated and its length is part of the address
+		if (len + 1 > sizeof(addr->sun_path)) {
+			return -ENAMETOOLONG;
+		}
+		memcpy(addr->sun_path + 1, name, len);
+		*addr_len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + len);
+		return 0;
+#else
+		return -ENOTSUP;
+#endif
+	}
+	if (len >= sizeof(addr->sun_path)) {
+		return -ENAMETOOLONG;
+	}
+	memcpy(addr->sun_path, name, len);
+	*addr_len = (socklen_t)sizeof(struct sockaddr_un);
+	return 0;
 }
 
-#ifdef AF_INET6
-static uint32_t _in6_addr_scope(struct in6_addr* addr)
+static int socket_create_unix_internal(const struct sockaddr_un *addr, socklen_t addr_len, int type)
 {
-	uint32_t scope = 0;
+	int sock;
+#ifdef SO_NOSIGPIPE
+	int yes = 1;
+#endif
 
-	if (IN6_IS_ADDR_MULTICAST(addr)) {
-		if (IN6_IS_ADDR_MC_NODELOCAL(addr)) {
-			scope = 1;
-		} else if (IN6_IS_ADDR_MC_LINKLOCAL(addr)) {
-			scope = 2;
-		} else if (IN6_IS_ADDR_MC_SITELOCAL(addr)) {
-			scope = 5;
-		}
+	/* Create the socket. */
+	sock = socket(PF_UNIX, type, 0);
+	if (sock < 0) {
+		SOCKET_ERR(1, "socket(): %s\n", strerror(errno));
+		return -1;
+	}
+	socket_fd_info_reset(sock);
 
-		return scope;
+#ifdef SO_NOSIGPIPE
+	if (setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, (void*)&yes, sizeof(int)) == -1) {
+		SOCKET_ERR(1, "setsockopt(): %s\n", strerror(errno));
+		socket_close(sock);
+		return -1;
 	}
+#endif
 
-	if (IN6_IS_ADDR_LINKLOCAL(addr)) {
-		scope = 2;
-	} else if (IN6_IS_ADDR_LOOPBACK(addr)) {
-		scope = 2;
-	} else if (IN6_IS_ADDR_SITELOCAL(addr)) {
-		scope = 5;
-	} else if (IN6_IS_ADDR_UNSPECIFIED(addr)) {
-		scope = 0;
+	/* Bind a name to the socket. */
+	if (bind(sock, (const struct sockaddr*)addr, addr_len) < 0) {
+		int err = errno;
+		SOCKET_ERR(1, "bind(): %s\n", strerror(err));
+		socket_close(sock);
+		errno = err;
+		return -1;
 	}
 
-	return scope;
+	if (type != SOCK_DGRAM && listen(sock, 100) < 0) {
+		int err = errno;
+		SOCKET_ERR(1, "listen(): %s\n", strerror(err));
+		socket_close(sock);
+		errno = err;
+		return -1;
+	}
+
+	return sock;
 }
 
-#ifndef HAVE_GETIFADDRS
-#ifdef _WIN32
+int socket_create_unix(const char *filename)
+{
+	struct sockaddr_un name;
 
-struct ifaddrs {
-	struct ifaddrs  *ifa_next;    /* Next item in list */
-	char            *ifa_name;    /* Name of interface */
-	unsigned int     ifa_flags;   /* Flags from SIOCGIFFLAGS */
-	struct sockaddr *ifa_addr;    /* Address of interface */
-	struct sockaddr *ifa_netmask; /* Netmask of interface */
-	union {
-		struct sockaddr *ifu_broadaddr; /* Broadcast address of interface */
-		struct sockaddr *ifu_dstaddr;   /* Point-to-point destination address */
-	} ifa_ifu;
-#define                  ifa_broadaddr ifa_ifu.ifu_broadaddr
-#define                  ifa_dstaddr   ifa_ifu.ifu_dstaddr
-	void            *ifa_data;    /* Address-specific data */
-};
+	// remove if still present
+	unlink(filename);
 
-#define WORKING_BUFFER_SIZE 15000
-#define MAX_TRIES 3
+	name.sun_family = AF_UNIX;
+	strncpy(name.sun_path, filename, sizeof(name.sun_path));
+	name.sun_path[sizeof(name.sun_path) - 1] = '\0';
 
-static void freeifaddrs(struct ifaddrs *ifa)
-{
-	if (!ifa) {
-		return;
-	}
-	free(ifa->ifa_name);
-	free(ifa->ifa_addr);
-	free(ifa->ifa_netmask);
-	free(ifa->ifa_dstaddr);
-	free(ifa->ifa_data);
-	freeifaddrs(ifa->ifa_next);
-	free(ifa);
+	return socket_create_unix_internal(&name, sizeof(name), SOCK_STREAM);
 }
 
-/*
- * getifaddrs() reference implementation for win32.
- * Heavily based on openpgm's implementation found here:
- * https://github.com/steve-o/openpgm/blob/master/openpgm/pgm/getifaddrs.c
- */
-static int getifaddrs(struct ifaddrs** ifap)
+int socket_create_unix_type(const char *name, int type, int flags)
 {
-	struct ifaddrs* ifa = NULL;
-
-	DWORD dwRetVal = 0;
+	struct sockaddr_un addr;
+	socklen_t addr_len = 0;
+	int res;
 
-	PIP_ADAPTER_ADDRESSES pAddresses = NULL;
-	ULONG outBufLen = 0;
-	ULONG Iterations = 0;
+	if (type != SOCK_STREAM && type != SOCK_SEQPACKET && type != SOCK_DGRAM) {
+		errno = EINVAL;
+		return -1;
+	}
+	res = socket_unix_addr(name, flags, &addr, &addr_len);
+	if (res < 0) {
+		SOCKET_ERR(1, "%s: invalid socket name '%s': %s\n", __func__, (name) ? name : "(null)", strerror(-res));
+		errno = -res;
+		return -1;
+	}
+	if (!(flags & (SOCKET_UNIX_ABSTRACT | SOCKET_UNIX_NO_UNLINK))) {
+		// remove if still present
+		unlink(name);
+	}
+	return socket_create_unix_internal(&addr, addr_len, type);
+}
 
-	ULONG flags = GAA_FLAG_INCLUDE_PREFIX |
-		GAA_FLAG_SKIP_ANYCAST |
-		GAA_FLAG_SKIP_DNS_SERVER |
-		GAA_FLAG_SKIP_FRIENDLY_NAME |
-		GAA_FLAG_SKIP_MULTICAST;
+int socket_connect_unix(const char *filename)
+{
+	return socket_connect_unix_ex(filename, NULL);
+}
 
-	PIP_ADAPTER_ADDRESSES adapter = NULL;
+static int socket_connect_unix_internal(const struct sockaddr_un *addr, socklen_t addr_len, int type, const struct socket_options *opts)
+{
+	int sfd = -1;
+#ifdef SO_NOSIGPIPE
+	int yes = 1;
+#endif
+	struct socket_options defopts;
 
-	if (!ifap) {
-		errno = EINVAL;
+	if (!opts) {
+		socket_options_init(&defopts);
+		opts = &defopts;
+	}
+
+	// make a new socket
+	if ((sfd = socket(PF_UNIX, type, 0)) < 0) {
+		SOCKET_ERR(2, "%s: socket: %s\n", __func__, strerror(errno));
 		return -1;
 	}
-	*ifap = NULL;
+	socket_fd_info_reset(sfd);
 
-	outBufLen = WORKING_BUFFER_SIZE;
-	do {
-		pAddresses = (IP_ADAPTER_ADDRESSES*)malloc(outBufLen);
-		if (pAddresses == NULL) {
-			SOCKET_ERR(1, "Memory allocation failed for IP_ADAPTER_ADDRESSES struct\n");
-			return -1;
-		}
-		dwRetVal = GetAdaptersAddresses(AF_UNSPEC, flags, NULL, pAddresses, &outBufLen);
-		if (dwRetVal == ERROR_BUFFER_OVERFLOW) {
-			free(pAddresses);
-			pAddresses = NULL;
-		} else {
-			break;
-		}
-		Iterations++;
-	} while ((dwRetVal == ERROR_BUFFER_OVERFLOW) && (Iterations < MAX_TRIES));
+	socket_apply_options(sfd, opts, 0);
 
-	if (dwRetVal != NO_ERROR) {
-		free(pAddresses);
+#ifdef SO_NOSIGPIPE
+	if (setsockopt(sfd, SOL_SOCKET, SO_NOSIGPIPE, (void*)&yes, sizeof(int)) == -1) {
+		SOCKET_ERR(1, "setsockopt(): %s\n", strerror(errno));
+		socket_close(sfd);
 		return -1;
 	}
+#endif
 
-	for (adapter = pAddresses; adapter; adapter = adapter->Next) {
-		int unicastIndex = 0;
-		for (IP_ADAPTER_UNICAST_ADDRESS *unicast = adapter->FirstUnicastAddress; unicast; unicast = unicast->Next, ++unicastIndex) {
-			/* ensure IP adapter */
-			if (AF_INET != unicast->Address.lpSockaddr->sa_family && AF_INET6 != unicast->Address.lpSockaddr->sa_family) {
-				continue;
-			}
+	int flags = fcntl(sfd, F_GETFL, 0);
+	fcntl(sfd, F_SETFL, flags | O_NONBLOCK);
 
-			if (!ifa) {
-				ifa = calloc(1, sizeof(struct ifaddrs));
-				if (!ifa) {
-					errno = ENOMEM;
-					free(pAddresses);
-					return -1;
+	do {
+		if (connect(sfd, (const struct sockaddr*)addr, addr_len) != -1) {
+			break;
+		}
+		if (errno == EINPROGRESS) {
+			if (poll_wrapper(sfd, FDM_WRITE, socket_connect_poll_timeout()) == poll_status_success) {
+				int so_error;
+				socklen_t len = sizeof(so_error);
+				getsockopt(sfd, SOL_SOCKET, SO_ERROR, (void*)&so_error, &len);
+				if (so_error == 0) {
+					errno = 0;
+					break;
 				}
-				*ifap = ifa;
-				ifa->ifa_next = NULL;
+				errno = so_error;
 			} else {
-				struct ifaddrs* ifanew = calloc(1, sizeof(struct ifaddrs));
-				if (!ifanew) {
-					freeifaddrs(*ifap);
-					free(pAddresses);
-					errno = ENOMEM;
-					return -1;
+				int so_error = 0;
+				socklen_t len = sizeof(so_error);
+				getsockopt(sfd, SOL_SOCKET, SO_ERROR, (void*)&so_error, &len);
+				if (so_error != 0) {
+					errno = so_error;
 				}
-				ifa->ifa_next = ifanew;
-				ifa = ifanew;
-				ifa->ifa_next = NULL;
 			}
-			ifa->ifa_data = NULL;
+		}
+		int err = errno;
+		socket_close(sfd);
+		errno = err;
+		sfd = -1;
+	} while (0);
 
-			/* name */
-			ifa->ifa_name = strdup(adapter->AdapterName);
+	if (sfd < 0) {
+		SOCKET_ERR(2, "%s: connect: %s\n", __func__, strerror(errno));
+		return -1;
+	}
 
-			/* flags */
-			ifa->ifa_flags = 0;
-			if (IfOperStatusUp == adapter->OperStatus)
-				ifa->ifa_flags |= IFF_UP;
-			if (IF_TYPE_SOFTWARE_LOOPBACK == adapter->IfType)
-				ifa->ifa_flags |= IFF_LOOPBACK;
-			if (!(adapter->Flags & IP_ADAPTER_NO_MULTICAST))
-				ifa->ifa_flags |= IFF_MULTICAST;
+	return sfd;
+}
 
-			/* address */
-			ifa->ifa_addr = (struct sockaddr*)malloc(sizeof(struct sockaddr_storage));
-			memcpy(ifa->ifa_addr, unicast->Address.lpSockaddr, unicast->Address.iSockaddrLength);
+int socket_connect_unix_ex(const char *filename, const struct socket_options *opts)
+{
+	struct sockaddr_un name;
+	struct stat fst;
 
-			/* netmask */
-			ifa->ifa_netmask = (struct sockaddr*)calloc(1, sizeof(struct sockaddr_storage));
+	// check if socket file exists...
+	if (stat(filename, &fst) != 0) {
+		SOCKET_ERR(2, "%s: stat '%s': %s\n", __func__, filename, strerror(errno));
+		return -1;
+	}
+	// ... and if it is a unix domain socket
+	if (!S_ISSOCK(fst.st_mode)) {
+		SOCKET_ERR(2, "%s: File '%s' is not a socket!\n", __func__, filename);
+		return -1;
+	}
+	// and connect to 'filename'
+	name.sun_family = AF_UNIX;
+	strncpy(name.sun_path, filename, sizeof(name.sun_path));
+	name.sun_path[sizeof(name.sun_path) - 1] = 0;
 
-			/* store mac address */
-			if (adapter->PhysicalAddressLength == 6) {
-				ifa->ifa_data = malloc(6);
-				memcpy(ifa->ifa_data, adapter->PhysicalAddress, 6);
-			}
+	return socket_connect_unix_internal(&name, sizeof(name), SOCK_STREAM, opts);
+}
 
-/* pre-Vista must hunt for matching prefix in linked list, otherwise use
- * OnLinkPrefixLength from IP_ADAPTER_UNICAST_ADDRESS structure.
- * FirstPrefix requires Windows XP SP1, from SP1 to pre-Vista provides a
- * single adapter prefix for each IP address.  Vista and later provides
- * host IP address prefix, subnet IP address, and subnet broadcast IP
- * address.  In addition there is a multicast and broadcast address prefix.
- */
-			ULONG prefixLength = 0;
+int socket_connect_unix_type(const char *name, int type, int flags, const struct socket_options *opts)
+{
+	struct sockaddr_un addr;
+	socklen_t addr_len = 0;
+	int res;
 
-#if defined( _WIN32 ) && ( _WIN32_WINNT >= 0x0600 )
-/* For a unicast IPv4 address, any value greater than 32 is an illegal
- * value. For a unicast IPv6 address, any value greater than 128 is an
- * illegal value. A value of 255 is commonly used to represent an illegal
- * value.
- *
- * Windows 7 SP1 returns 64 for Teredo links which is incorrect.
- */
+	if (type != SOCK_STREAM && type != SOCK_SEQPACKET && type != SOCK_DGRAM) {
+		errno = EINVAL;
+		return -1;
+	}
+	res = socket_unix_addr(name, flags, &addr, &addr_len);
+	if (res < 0) {
+		SOCKET_ERR(1, "%s: invalid socket name '%s': %s\n", __func__, (name) ? name : "(null)", strerror(-res));
+		errno = -res;
+		return -1;
+	}
+	return socket_connect_unix_internal(&addr, addr_len, type, opts);
+}
 
-#define IN6_IS_ADDR_TEREDO(addr) \
-	(((const uint32_t *)(addr))[0] == ntohl (0x20010000))
+int socket_send_fds(int fd, const void *data, size_t length, const int *fds, unsigned int num_fds)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char *control;
+	size_t control_len;
+	char dummy = 0;
+	int flags = 0;
+	int res;
 
-			if (AF_INET6 == unicast->Address.lpSockaddr->sa_family &&
-/* TunnelType only applies to one interface on the adapter and no
- * convenient method is provided to determine which.
- */
-				TUNNEL_TYPE_TEREDO == adapter->TunnelType &&
-/* Test the interface with the known Teredo network prefix.
- */
-				IN6_IS_ADDR_TEREDO( &((struct sockaddr_in6*)(unicast->Address.lpSockaddr))->sin6_addr) &&
-/* Test that this version is actually wrong, subsequent releases from Microsoft
- * may resolve the issue.
- */
-				32 != unicast->OnLinkPrefixLength)
-			{
-				prefixLength = 32;
-			}
-			else
-				prefixLength = unicast->OnLinkPrefixLength;
-#else
-/* The order of linked IP_ADAPTER_UNICAST_ADDRESS structures pointed to by
- * the FirstUnicastAddress member does not have any relationship with the
- * order of linked IP_ADAPTER_PREFIX structures pointed to by the FirstPrefix
- * member.
- *
- * Example enumeration:
- *    [ no subnet ]
- *   ::1/128            - address
- *   ff00::%1/8         - multicast (no IPv6 broadcast)
- *   127.0.0.0/8        - subnet
- *   127.0.0.1/32       - address
- *   127.255.255.255/32 - subnet broadcast
- *   224.0.0.0/4        - multicast
- *   255.255.255.255/32 - broadcast
- *
- * Which differs from most adapters listing three IPv6:
- *   fe80::%10/64       - subnet
- *   fe80::51e9:5fe5:4202:325a%10/128 - address
- *   ff00::%10/8        - multicast
- *
- * !IfOperStatusUp IPv4 addresses are skipped:
- *   fe80::%13/64       - subnet
- *   fe80::d530:946d:e8df:8c91%13/128 - address
- *   ff00::%13/8        - multicast
- *    [ no subnet  ]
- *    [ no address ]
- *   224.0.0.0/4        - multicast
- *   255.255.255.255/32 - broadcast
- *
- * On PTP links no multicast or broadcast addresses are returned:
- *    [ no subnet ]
- *   fe80::5efe:10.203.9.30/128 - address
- *    [ no multicast ]
- *    [ no multicast ]
- *    [ no broadcast ]
- *
- * Active primary IPv6 interfaces are a bit overloaded:
- *   ::/0               - default route
- *   2001::/32          - global subnet
- *   2001:0:4137:9e76:2443:d6:ba87:1a2a/128 - global address
- *   fe80::/64          - link-local subnet
- *   fe80::2443:d6:ba87:1a2a/128 - link-local address
- *   ff00::/8           - multicast
- */
+	if (fd < 0 || !fds || num_fds == 0 || num_fds > SOCKET_MAX_PASS_FDS) {
+		return -EINVAL;
+	}
+	if (!data || length == 0) {
+		// ancillary data needs at least one byte of payload on stream sockets
+		data = &dummy;
+		length = 1;
+	}
+	control_len = CMSG_SPACE(sizeof(int) * num_fds);
+	control = (char*)calloc(1, control_len);
+	if (!control) {
+		return -ENOMEM;
+	}
 
-#define IN_LINKLOCAL(a)	((((uint32_t) (a)) & 0xaffff0000) == 0xa9fe0000)
+	iov.iov_base = (void*)data;
+	iov.iov_len = length;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = control_len;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
 
-			for (IP_ADAPTER_PREFIX *prefix = adapter->FirstPrefix; prefix; prefix = prefix->Next) {
-				LPSOCKADDR lpSockaddr = prefix->Address.lpSockaddr;
-				if (lpSockaddr->sa_family != unicast->Address.lpSockaddr->sa_family)
-					continue;
-/* special cases */
-/* RFC2863: IPv4 interface not up */
-				if (AF_INET == lpSockaddr->sa_family && adapter->OperStatus != IfOperStatusUp) {
-/* RFC3927: link-local IPv4 always has 16-bit CIDR */
-					if (IN_LINKLOCAL( ntohl (((struct sockaddr_in*)(unicast->Address.lpSockaddr))->sin_addr.s_addr))) {
-						prefixLength = 16;
-					}
-					break;
-				}
-/* default IPv6 route */
-				if (AF_INET6 == lpSockaddr->sa_family && 0 == prefix->PrefixLength && IN6_IS_ADDR_UNSPECIFIED( &((struct sockaddr_in6*)(lpSockaddr))->sin6_addr)) {
-					continue;
-				}
-/* Assume unicast address for first prefix of operational adapter */
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+	res = socket_check_fd(fd, FDM_WRITE, SOCKET_SEND_TIMEOUT);
+	if (res > 0) {
+		uint64_t stats_start = SOCKET_STATS_BEGIN();
+		ssize_t s;
+		do {
+			s = sendmsg(fd, &msg, flags);
+		} while (s < 0 && errno == EINTR);
+		SOCKET_STATS_IO(fd, 1, s, (s > 0) ? s : 0, stats_start);
+		res = (s < 0) ? -errno : (int)s;
+	}
+	free(control);
+	return res;
+}
+
+int socket_receive_fds(int fd, void *data, size_t length, int *fds, unsigned int *num_fds, unsigned int timeout)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char *control;
+	size_t control_len;
+	unsigned int max_fds;
+	unsigned int count = 0;
+	int flags = 0;
+	int res;
+
+	if (fd < 0 || !data || length == 0 || !fds || !num_fds || *num_fds == 0) {
+		return -EINVAL;
+	}
+	max_fds = (*num_fds > SOCKET_MAX_PASS_FDS) ? SOCKET_MAX_PASS_FDS : *num_fds;
+	*num_fds = 0;
+	control_len = CMSG_SPACE(sizeof(int) * max_fds);
+	control = (char*)calloc(1, control_len);
+	if (!control) {
+		return -ENOMEM;
+	}
+
+	iov.iov_base = data;
+	iov.iov_len = length;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = control_len;
+#ifdef MSG_CMSG_CLOEXEC
+	flags |= MSG_CMSG_CLOEXEC;
+#endif
+
+	res = socket_check_fd(fd, FDM_READ, timeout);
+	if (res <= 0) {
+		free(control);
+		return res;
+	}
+	uint64_t stats_start = SOCKET_STATS_BEGIN();
+	ssize_t r;
+	do {
+		r = recvmsg(fd, &msg, flags);
+	} while (r < 0 && errno == EINTR);
+	SOCKET_STATS_IO(fd, 0, r, (r > 0) ? r : 0, stats_start);
+	if (r < 0) {
+		res = -errno;
+		free(control);
+		return res;
+	}
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		unsigned int n = (unsigned int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+		unsigned int i;
+		for (i = 0; i < n; i++) {
+			int rfd;
+			memcpy(&rfd, CMSG_DATA(cmsg) + sizeof(int) * i, sizeof(int));
+			if (count < max_fds) {
+				socket_fd_info_reset(rfd);
+				fds[count++] = rfd;
+			} else {
+				close(rfd);
+			}
+		}
+	}
+	free(control);
+	*num_fds = count;
+	if (msg.msg_flags & MSG_CTRUNC) {
+		SOCKET_ERR(2, "%s: fd=%d more file descriptors were sent than requested, the rest got closed\n", __func__, fd);
+	}
+	if (r == 0) {
+		// the connection was closed, unless descriptors arrived with an empty datagram
+		if (count == 0) {
+			SOCKET_ERR(3, "%s: fd=%d recvmsg returned 0\n", __func__, fd);
+			return -ECONNRESET;
+		}
+	}
+	return (int)r;
+}
+#endif
+
+struct socket_resolve_entry {
+	struct socket_resolve_entry *next;
+	char *host;
+	uint16_t port;
+	int socktype;
+	int protocol;
+	int flags;
+	struct addrinfo *result;
+	uint64_t expires;
+	unsigned int refcount;
+};
+
+struct socket_resolve_req {
+	struct socket_resolve_req *next;
+	char *host;
+	uint16_t port;
+	socket_resolve_cb_t callback;
+	void *user_data;
+};
+
+static struct socket_resolve_entry *socket_resolver_cache = NULL;
+static unsigned int socket_resolver_cache_count = 0;
+static unsigned int socket_resolver_ttl = SOCKET_RESOLVER_DEFAULT_TTL;
+static struct socket_resolve_req *socket_resolver_queue_head = NULL;
+static struct socket_resolve_req *socket_resolver_queue_tail = NULL;
+static unsigned int socket_resolver_threads = 0;
+static unsigned int socket_resolver_idle_threads = 0;
+
+static int socket_resolver_key_equal(struct socket_resolve_entry *entry, const char *host, uint16_t port, int socktype, int protocol, int flags)
+{
+	if (entry->port != port || entry->socktype != socktype || entry->protocol != protocol || entry->flags != flags) {
+		return 0;
+	}
+	if (!entry->host || !host) {
+		return entry->host == host;
+	}
+	return strcmp(entry->host, host) == 0;
+}
+
+// must be called with the resolver mutex held
+static void socket_resolver_unref(struct socket_resolve_entry *entry)
+{
+	if (--entry->refcount == 0) {
+		freeaddrinfo(entry->result);
+		free(entry->host);
+		free(entry);
+	}
+}
+
+// must be called with the resolver mutex held
+static void socket_resolver_unlink(struct socket_resolve_entry *entry)
+{
+	struct socket_resolve_entry **pp = &socket_resolver_cache;
+	while (*pp) {
+		if (*pp == entry) {
+			*pp = entry->next;
+			entry->next = NULL;
+			socket_resolver_cache_count--;
+			socket_resolver_unref(entry);
+			return;
+		}
+		pp = &(*pp)->next;
+	}
+}
+
+static void socket_resolver_release(struct socket_resolve_entry *entry)
+{
+	mutex_lock(&socket_resolver_mutex);
+	socket_resolver_unref(entry);
+	mutex_unlock(&socket_resolver_mutex);
+}
+
+static void socket_resolver_evict(struct socket_resolve_entry *entry)
+{
+	mutex_lock(&socket_resolver_mutex);
+	socket_resolver_unlink(entry);
+	mutex_unlock(&socket_resolver_mutex);
+}
+
+/*
+ * Returns a referenced entry holding the getaddrinfo() result for the given
+ * parameters, served from the cache if possible. Release it with
+ * socket_resolver_release(). On failure, gai_error receives the
+ * getaddrinfo() error code.
+ */
+static struct socket_resolve_entry* socket_resolver_get(const char *host, uint16_t port, int socktype, int protocol, int flags, int *gai_error)
+{
+	struct socket_resolve_entry *entry, **pp;
+	struct addrinfo hints;
+	struct addrinfo *result = NULL;
+	char portstr[8];
+	uint64_t now = socket_time_ms();
+	int res;
+
+	mutex_lock(&socket_resolver_mutex);
+	pp = &socket_resolver_cache;
+	while ((entry = *pp) != NULL) {
+		if (now >= entry->expires) {
+			*pp = entry->next;
+			socket_resolver_cache_count--;
+			socket_resolver_unref(entry);
+			continue;
+		}
+		if (socket_resolver_key_equal(entry, host, port, socktype, protocol, flags)) {
+			// move to the front so the least recently used entries get trimmed first
+			*pp = entry->next;
+			entry->next = socket_resolver_cache;
+			socket_resolver_cache = entry;
+			entry->refcount++;
+			mutex_unlock(&socket_resolver_mutex);
+			return entry;
+		}
+		pp = &entry->next;
+	}
+	mutex_unlock(&socket_resolver_mutex);
+
+	memset(&hints, '\0', sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = socktype;
+	hints.ai_flags = flags;
+	hints.ai_protocol = protocol;
+
+	snprintf(portstr, 8, "%d", port);
+
+	res = getaddrinfo(host, portstr, &hints, &result);
+	if (res != 0) {
+		*gai_error = res;
+		return NULL;
+	}
+
+	entry = (struct socket_resolve_entry*)calloc(1, sizeof(struct socket_resolve_entry));
+	if (!entry) {
+		freeaddrinfo(result);
+		*gai_error = EAI_MEMORY;
+		return NULL;
+	}
+	if (host) {
+		entry->host = strdup(host);
+		if (!entry->host) {
+			free(entry);
+			freeaddrinfo(result);
+			*gai_error = EAI_MEMORY;
+			return NULL;
+		}
+	}
+	entry->port = port;
+	entry->socktype = socktype;
+	entry->protocol = protocol;
+	entry->flags = flags;
+	entry->result = result;
+	entry->refcount = 1;
+
+	mutex_lock(&socket_resolver_mutex);
+	if (socket_resolver_ttl > 0) {
+		// another thread might have resolved the same key in the meantime
+		for (pp = &socket_resolver_cache; *pp; pp = &(*pp)->next) {
+			if (socket_resolver_key_equal(*pp, host, port, socktype, protocol, flags)) {
+				socket_resolver_unlink(*pp);
+				break;
+			}
+		}
+		entry->expires = now + socket_resolver_ttl;
+		entry->next = socket_resolver_cache;
+		socket_resolver_cache = entry;
+		socket_resolver_cache_count++;
+		entry->refcount++;
+		if (socket_resolver_cache_count > SOCKET_RESOLVER_MAX_ENTRIES) {
+			pp = &socket_resolver_cache;
+			while ((*pp)->next) {
+				pp = &(*pp)->next;
+			}
+			socket_resolver_unlink(*pp);
+		}
+	}
+	mutex_unlock(&socket_resolver_mutex);
+
+	return entry;
+}
+
+// must be called with mutex held, returns with it held
+static void socket_cond_wait_timeout(cond_t *cond, mutex_t *mutex, unsigned int timeout)
+{
+	cond_wait_timeout(cond, mutex, timeout);
+#ifdef _WIN32
+	// the win32 implementation returns with the mutex unlocked
+	mutex_lock(mutex);
+#endif
+}
+
+static void* socket_resolver_worker(void *data)
+{
+	mutex_lock(&socket_resolver_mutex);
+	while (1) {
+		struct socket_resolve_req *req = socket_resolver_queue_head;
+		if (!req) {
+			uint64_t idle_start = socket_time_ms();
+			socket_resolver_idle_threads++;
+			socket_cond_wait_timeout(&socket_resolver_cond, &socket_resolver_mutex, SOCKET_RESOLVER_IDLE_TIMEOUT);
+			socket_resolver_idle_threads--;
+			if (!socket_resolver_queue_head && socket_time_ms() - idle_start >= SOCKET_RESOLVER_IDLE_TIMEOUT) {
+				break;
+			}
+			continue;
+		}
+		socket_resolver_queue_head = req->next;
+		if (!socket_resolver_queue_head) {
+			socket_resolver_queue_tail = NULL;
+		}
+		mutex_unlock(&socket_resolver_mutex);
+
+		int gai_error = 0;
+		struct socket_resolve_entry *entry = socket_resolver_get(req->host, req->port, SOCK_STREAM, IPPROTO_TCP, AI_NUMERICSERV, &gai_error);
+		if (entry) {
+			req->callback(req->host, req->port, 0, entry->result, req->user_data);
+			socket_resolver_release(entry);
+		} else {
+			SOCKET_ERR(2, "%s: getaddrinfo(%s): %s\n", __func__, req->host, gai_strerror(gai_error));
+			req->callback(req->host, req->port, gai_error, NULL, req->user_data);
+		}
+		free(req->host);
+		free(req);
+
+		mutex_lock(&socket_resolver_mutex);
+	}
+	socket_resolver_threads--;
+	mutex_unlock(&socket_resolver_mutex);
+
+	return NULL;
+}
+
+int socket_resolve_async(const char *host, uint16_t port, socket_resolve_cb_t callback, void *user_data)
+{
+	struct socket_resolve_req *req;
+
+	if (!host || !callback) {
+		return -EINVAL;
+	}
+	req = (struct socket_resolve_req*)calloc(1, sizeof(struct socket_resolve_req));
+	if (!req) {
+		return -ENOMEM;
+	}
+	req->host = strdup(host);
+	if (!req->host) {
+		free(req);
+		return -ENOMEM;
+	}
+	req->port = port;
+	req->callback = callback;
+	req->user_data = user_data;
+
+	mutex_lock(&socket_resolver_mutex);
+	if (socket_resolver_idle_threads == 0 && socket_resolver_threads < SOCKET_RESOLVER_MAX_THREADS) {
+		THREAD_T thread;
+		if (thread_new(&thread, socket_resolver_worker, NULL) == 0) {
+			thread_detach(thread);
+			socket_resolver_threads++;
+		} else if (socket_resolver_threads == 0) {
+			mutex_unlock(&socket_resolver_mutex);
+			SOCKET_ERR(1, "%s: Could not start resolver thread\n", __func__);
+			free(req->host);
+			free(req);
+			return -EAGAIN;
+		}
+	}
+	if (socket_resolver_queue_tail) {
+		socket_resolver_queue_tail->next = req;
+	} else {
+		socket_resolver_queue_head = req;
+	}
+	socket_resolver_queue_tail = req;
+	cond_signal(&socket_resolver_cond);
+	mutex_unlock(&socket_resolver_mutex);
+
+	return 0;
+}
+
+void socket_set_resolver_ttl(unsigned int ttl)
+{
+	mutex_lock(&socket_resolver_mutex);
+	socket_resolver_ttl = ttl;
+	mutex_unlock(&socket_resolver_mutex);
+	if (ttl == 0) {
+		socket_flush_resolver_cache();
+	}
+}
+
+void socket_flush_resolver_cache(void)
+{
+	mutex_lock(&socket_resolver_mutex);
+	while (socket_resolver_cache) {
+		socket_resolver_unlink(socket_resolver_cache);
+	}
+	mutex_unlock(&socket_resolver_mutex);
+}
+
+int socket_create(const char* addr, uint16_t port)
+{
+	return socket_create_ex(addr, port, NULL);
+}
+
+// creates a listening TCP socket, optionally sharing the port with other SO_REUSEPORT listeners
+static int socket_create_listener(const char* addr, uint16_t port, const struct socket_options *opts, int backlog, int reuseport)
+{
+	int sfd = -1;
+	int yes = 1;
+	int no = 0;
+	struct socket_resolve_entry *entry = NULL;
+	struct addrinfo *result, *rp;
+	int res;
+
+	entry = socket_resolver_get(addr, port, SOCK_STREAM, IPPROTO_TCP, AI_PASSIVE | AI_NUMERICSERV, &res);
+	if (!entry) {
+		SOCKET_ERR(1, "%s: getaddrinfo: %s\n", __func__, gai_strerror(res));
+		return -1;
+	}
+	result = entry->result;
+
+	for (rp = result; rp != NULL; rp = rp->ai_next) {
+		sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		if (sfd == -1) {
+			continue;
+		}
+		socket_fd_info_reset(sfd);
+
+		if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void*)&yes, sizeof(int)) == -1) {
+#ifdef _WIN32
+			errno = WSAError_to_errno(WSAGetLastError());
+#endif
+			SOCKET_ERR(1, "setsockopt() SO_REUSEADDR: %s\n", strerror(errno));
+			socket_close(sfd);
+			continue;
+		}
+
+#ifdef SO_NOSIGPIPE
+		if (setsockopt(sfd, SOL_SOCKET, SO_NOSIGPIPE, (void*)&yes, sizeof(int)) == -1) {
+			SOCKET_ERR(1, "setsockopt() SO_NOSIGPIPE: %s\n", strerror(errno));
+			socket_close(sfd);
+			continue;
+		}
+#endif
+
+#if defined(AF_INET6) && defined(IPV6_V6ONLY)
+		if (rp->ai_family == AF_INET6) {
+			if (setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, (addr) ? (void*)&yes : (void*)&no, sizeof(int)) == -1) {
+#ifdef _WIN32
+				errno = WSAError_to_errno(WSAGetLastError());
+#endif
+				SOCKET_ERR(1, "setsockopt() IPV6_V6ONLY: %s\n", strerror(errno));
+			}
+		}
+#endif
+
+#ifdef SO_REUSEPORT
+		if (reuseport && setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void*)&yes, sizeof(int)) == -1) {
+			SOCKET_ERR(1, "setsockopt() SO_REUSEPORT: %s\n", strerror(errno));
+			socket_close(sfd);
+			continue;
+		}
+#endif
+
+		// accepted sockets inherit these from the listening socket
+		if (opts) {
+			socket_apply_options(sfd, opts, 1);
+		}
+
+		if (bind(sfd, rp->ai_addr, rp->ai_addrlen) < 0) {
+#ifdef _WIN32
+			errno = WSAError_to_errno(WSAGetLastError());
+#endif
+			SOCKET_ERR(1, "bind(): %s\n", strerror(errno));
+			socket_close(sfd);
+			continue;
+		}
+
+		if (listen(sfd, backlog) < 0) {
+#ifdef _WIN32
+			errno = WSAError_to_errno(WSAGetLastError());
+#endif
+			SOCKET_ERR(1, "listen(): %s\n", strerror(errno));
+			socket_close(sfd);
+			continue;
+		}
+		break;
+	}
+
+	socket_resolver_release(entry);
+
+	if (rp == NULL) {
+		return -1;
+	}
+
+	return sfd;
+}
+
+int socket_create_ex(const char* addr, uint16_t port, const struct socket_options *opts)
+{
+	return socket_create_listener(addr, port, opts, 100, 0);
+}
+
+#ifdef AF_INET6
+static uint32_t _in6_addr_scope(struct in6_addr* addr)
+{
+	uint32_t scope = 0;
+
+	if (IN6_IS_ADDR_MULTICAST(addr)) {
+		if (IN6_IS_ADDR_MC_NODELOCAL(addr)) {
+			scope = 1;
+		} else if (IN6_IS_ADDR_MC_LINKLOCAL(addr)) {
+			scope = 2;
+		} else if (IN6_IS_ADDR_MC_SITELOCAL(addr)) {
+			scope = 5;
+		}
+
+		return scope;
+	}
+
+	if (IN6_IS_ADDR_LINKLOCAL(addr)) {
+		scope = 2;
+	} else if (IN6_IS_ADDR_LOOPBACK(addr)) {
+		scope = 2;
+	} else if (IN6_IS_ADDR_SITELOCAL(addr)) {
+		scope = 5;
+	} else if (IN6_IS_ADDR_UNSPECIFIED(addr)) {
+		scope = 0;
+	}
+
+	return scope;
+}
+
+#ifndef HAVE_GETIFADDRS
+#ifdef _WIN32
+
+struct ifaddrs {
+	struct ifaddrs  *ifa_next;    /* Next item in list */
+	char            *ifa_name;    /* Name of interface */
+	unsigned int     ifa_flags;   /* Flags from SIOCGIFFLAGS */
+	struct sockaddr *ifa_addr;    /* Address of interface */
+	struct sockaddr *ifa_netmask; /* Netmask of interface */
+	union {
+		struct sockaddr *ifu_broadaddr; /* Broadcast address of interface */
+		struct sockaddr *ifu_dstaddr;   /* Point-to-point destination address */
+	} ifa_ifu;
+#define                  ifa_broadaddr ifa_ifu.ifu_broadaddr
+#define                  ifa_dstaddr   ifa_ifu.ifu_dstaddr
+	void            *ifa_data;    /* Address-specific data */
+};
+
+#define WORKING_BUFFER_SIZE 15000
+#define MAX_TRIES 3
+
+static void freeifaddrs(struct ifaddrs *ifa)
+{
+	if (!ifa) {
+		return;
+	}
+	free(ifa->ifa_name);
+	free(ifa->ifa_addr);
+	free(ifa->ifa_netmask);
+	free(ifa->ifa_dstaddr);
+	free(ifa->ifa_data);
+	freeifaddrs(ifa->ifa_next);
+	free(ifa);
+}
+
+/*
+ * getifaddrs() reference implementation for win32.
+ * Heavily based on openpgm's implementation found here:
+ * https://github.com/steve-o/openpgm/blob/master/openpgm/pgm/getifaddrs.c
+ */
+static int getifaddrs(struct ifaddrs** ifap)
+{
+	struct ifaddrs* ifa = NULL;
+
+	DWORD dwRetVal = 0;
+
+	PIP_ADAPTER_ADDRESSES pAddresses = NULL;
+	ULONG outBufLen = 0;
+	ULONG Iterations = 0;
+
+	ULONG flags = GAA_FLAG_INCLUDE_PREFIX |
+		GAA_FLAG_SKIP_ANYCAST |
+		GAA_FLAG_SKIP_DNS_SERVER |
+		GAA_FLAG_SKIP_FRIENDLY_NAME |
+		GAA_FLAG_SKIP_MULTICAST;
+
+	PIP_ADAPTER_ADDRESSES adapter = NULL;
+
+	if (!ifap) {
+		errno = EINVAL;
+		return -1;
+	}
+	*ifap = NULL;
+
+	outBufLen = WORKING_BUFFER_SIZE;
+	do {
+		pAddresses = (IP_ADAPTER_ADDRESSES*)malloc(outBufLen);
+		if (pAddresses == NULL) {
+			SOCKET_ERR(1, "Memory allocation failed for IP_ADAPTER_ADDRESSES struct\n");
+			return -1;
+		}
+		dwRetVal = GetAdaptersAddresses(AF_UNSPEC, flags, NULL, pAddresses, &outBufLen);
+		if (dwRetVal == ERROR_BUFFER_OVERFLOW) {
+			free(pAddresses);
+			pAddresses = NULL;
+		} else {
+			break;
+		}
+		Iterations++;
+	} while ((dwRetVal == ERROR_BUFFER_OVERFLOW) && (Iterations < MAX_TRIES));
+
+	if (dwRetVal != NO_ERROR) {
+		free(pAddresses);
+		return -1;
+	}
+
+	for (adapter = pAddresses; adapter; adapter = adapter->Next) {
+		int unicastIndex = 0;
+		for (IP_ADAPTER_UNICAST_ADDRESS *unicast = adapter->FirstUnicastAddress; unicast; unicast = unicast->Next, ++unicastIndex) {
+			/* ensure IP adapter */
+			if (AF_INET != unicast->Address.lpSockaddr->sa_family && AF_INET6 != unicast->Address.lpSockaddr->sa_family) {
+				continue;
+			}
+
+			if (!ifa) {
+				ifa = calloc(1, sizeof(struct ifaddrs));
+				if (!ifa) {
+					errno = ENOMEM;
+					free(pAddresses);
+					return -1;
+				}
+				*ifap = ifa;
+				ifa->ifa_next = NULL;
+			} else {
+				struct ifaddrs* ifanew = calloc(1, sizeof(struct ifaddrs));
+				if (!ifanew) {
+					freeifaddrs(*ifap);
+					free(pAddresses);
+					errno = ENOMEM;
+					return -1;
+				}
+				ifa->ifa_next = ifanew;
+				ifa = ifanew;
+				ifa->ifa_next = NULL;
+			}
+			ifa->ifa_data = NULL;
+
+			/* name */
+			ifa->ifa_name = strdup(adapter->AdapterName);
+
+			/* flags */
+			ifa->ifa_flags = 0;
+			if (IfOperStatusUp == adapter->OperStatus)
+				ifa->ifa_flags |= IFF_UP;
+			if (IF_TYPE_SOFTWARE_LOOPBACK == adapter->IfType)
+				ifa->ifa_flags |= IFF_LOOPBACK;
+			if (!(adapter->Flags & IP_ADAPTER_NO_MULTICAST))
+				ifa->ifa_flags |= IFF_MULTICAST;
+
+			/* address */
+			ifa->ifa_addr = (struct sockaddr*)malloc(sizeof(struct sockaddr_storage));
+			memcpy(ifa->ifa_addr, unicast->Address.lpSockaddr, unicast->Address.iSockaddrLength);
+
+			/* netmask */
+			ifa->ifa_netmask = (struct sockaddr*)calloc(1, sizeof(struct sockaddr_storage));
+
+			/* store mac address */
+			if (adapter->PhysicalAddressLength == 6) {
+				ifa->ifa_data = malloc(6);
+				memcpy(ifa->ifa_data, adapter->PhysicalAddress, 6);
+			}
+
+/* pre-Vista must hunt for matching prefix in linked list, otherwise use
+ * OnLinkPrefixLength from IP_ADAPTER_UNICAST_ADDRESS structure.
+ * FirstPrefix requires Windows XP SP1, from SP1 to pre-Vista provides a
+ * single adapter prefix for each IP address.  Vista and later provides
+ * host IP address prefix, subnet IP address, and subnet broadcast IP
+ * address.  In addition there is a multicast and broadcast address prefix.
+ */
+			ULONG prefixLength = 0;
+
+#if defined( _WIN32 ) && ( _WIN32_WINNT >= 0x0600 )
+/* For a unicast IPv4 address, any value greater than 32 is an illegal
+ * value. For a unicast IPv6 address, any value greater than 128 is an
+ * illegal value. A value of 255 is commonly used to represent an illegal
+ * value.
+ *
+ * Windows 7 SP1 returns 64 for Teredo links which is incorrect.
+ */
+
+#define IN6_IS_ADDR_TEREDO(addr) \
+	(((const uint32_t *)(addr))[0] == ntohl (0x20010000))
+
+			if (AF_INET6 == unicast->Address.lpSockaddr->sa_family &&
+/* TunnelType only applies to one interface on the adapter and no
+ * convenient method is provided to determine which.
+ */
+				TUNNEL_TYPE_TEREDO == adapter->TunnelType &&
+/* Test the interface with the known Teredo network prefix.
+ */
+				IN6_IS_ADDR_TEREDO( &((struct sockaddr_in6*)(unicast->Address.lpSockaddr))->sin6_addr) &&
+/* Test that this version is actually wrong, subsequent releases from Microsoft
+ * may resolve the issue.
+ */
+				32 != unicast->OnLinkPrefixLength)
+			{
+				prefixLength = 32;
+			}
+			else
+				prefixLength = unicast->OnLinkPrefixLength;
+#else
+/* The order of linked IP_ADAPTER_UNICAST_ADDRESS structures pointed to by
+ * the FirstUnicastAddress member does not have any relationship with the
+ * order of linked IP_ADAPTER_PREFIX structures pointed to by the FirstPrefix
+ * member.
+ *
+ * Example enumeration:
+ *    [ no subnet ]
+ *   ::1/128            - address
+ *   ff00::%1/8         - multicast (no IPv6 broadcast)
+ *   127.0.0.0/8        - subnet
+ *   127.0.0.1/32       - address
+ *   127.255.255.255/32 - subnet broadcast
+ *   224.0.0.0/4        - multicast
+ *   255.255.255.255/32 - broadcast
+ *
+ * Which differs from most adapters listing three IPv6:
+ *   fe80::%10/64       - subnet
+ *   fe80::51e9:5fe5:4202:325a%10/128 - address
+ *   ff00::%10/8        - multicast
+ *
+ * !IfOperStatusUp IPv4 addresses are skipped:
+ *   fe80::%13/64       - subnet
+ *   fe80::d530:946d:e8df:8c91%13/128 - address
+ *   ff00::%13/8        - multicast
+ *    [ no subnet  ]
+ *    [ no address ]
+ *   224.0.0.0/4        - multicast
+ *   255.255.255.255/32 - broadcast
+ *
+ * On PTP links no multicast or broadcast addresses are returned:
+ *    [ no subnet ]
+ *   fe80::5efe:10.203.9.30/128 - address
+ *    [ no multicast ]
+ *    [ no multicast ]
+ *    [ no broadcast ]
+ *
+ * Active primary IPv6 interfaces are a bit overloaded:
+ *   ::/0               - default route
+ *   2001::/32          - global subnet
+ *   2001:0:4137:9e76:2443:d6:ba87:1a2a/128 - global address
+ *   fe80::/64          - link-local subnet
+ *   fe80::2443:d6:ba87:1a2a/128 - link-local address
+ *   ff00::/8           - multicast
+ */
+
+#define IN_LINKLOCAL(a)	((((uint32_t) (a)) & 0xaffff0000) == 0xa9fe0000)
+
+			for (IP_ADAPTER_PREFIX *prefix = adapter->FirstPrefix; prefix; prefix = prefix->Next) {
+				LPSOCKADDR lpSockaddr = prefix->Address.lpSockaddr;
+				if (lpSockaddr->sa_family != unicast->Address.lpSockaddr->sa_family)
+					continue;
+/* special cases */
+/* RFC2863: IPv4 interface not up */
+				if (AF_INET == lpSockaddr->sa_family && adapter->OperStatus != IfOperStatusUp) {
+/* RFC3927: link-local IPv4 always has 16-bit CIDR */
+					if (IN_LINKLOCAL( ntohl (((struct sockaddr_in*)(unicast->Address.lpSockaddr))->sin_addr.s_addr))) {
+						prefixLength = 16;
+					}
+					break;
+				}
+/* default IPv6 route */
+				if (AF_INET6 == lpSockaddr->sa_family && 0 == prefix->PrefixLength && IN6_IS_ADDR_UNSPECIFIED( &((struct sockaddr_in6*)(lpSockaddr))->sin6_addr)) {
+					continue;
+				}
+/* Assume unicast address for first prefix of operational adapter */
 				if (AF_INET == lpSockaddr->sa_family)
 					if (IN_MULTICAST( ntohl (((struct sockaddr_in*)(lpSockaddr))->sin_addr.s_addr))) {
 						SOCKET_ERR(1, "FATAL: first prefix is non a unicast address\n");
@@ -845,613 +2158,5353 @@ static int getifaddrs(struct ifaddrs** ifap)
 					}
 /* Assume subnet or host IP address for XP backward compatibility */
 
-				prefixLength = prefix->PrefixLength;
-				break;
-			}
-#endif /* defined( _WIN32 ) && ( _WIN32_WINNT >= 0x0600 ) */
+				prefixLength = prefix->PrefixLength;
+				break;
+			}
+#endif /* defined( _WIN32 ) && ( _WIN32_WINNT >= 0x0600 ) */
+
+/* map prefix to netmask */
+			ifa->ifa_netmask->sa_family = unicast->Address.lpSockaddr->sa_family;
+			switch (unicast->Address.lpSockaddr->sa_family) {
+			case AF_INET:
+				if (0 == prefixLength || prefixLength > 32) {
+					prefixLength = 32;
+				}
+#if defined( _WIN32) && ( _WIN32_WINNT >= 0x0600 )
+/* Added in Vista, but no IPv6 equivalent. */
+				{
+				ULONG Mask;
+				ConvertLengthToIpv4Mask (prefixLength, &Mask);
+				((struct sockaddr_in*)ifa->ifa_netmask)->sin_addr.s_addr = Mask;	/* network order */
+				}
+#else
+/* NB: left-shift of full bit-width is undefined in C standard. */
+				((struct sockaddr_in*)ifa->ifa_netmask)->sin_addr.s_addr = htonl( 0xffffffffU << ( 32 - prefixLength ) );
+#endif
+				break;
+
+			case AF_INET6:
+				if (0 == prefixLength || prefixLength > 128) {
+					prefixLength = 128;
+				}
+				for (LONG i = prefixLength, j = 0; i > 0; i -= 8, ++j) {
+					((struct sockaddr_in6*)ifa->ifa_netmask)->sin6_addr.s6_addr[ j ] = i >= 8 ? 0xff : (ULONG)(( 0xffU << ( 8 - i ) ) & 0xffU );
+				}
+				break;
+			default:
+				break;
+			}
+		}
+	}
+	free(pAddresses);
+
+	return 0;
+}
+#else
+#error No reference implementation for getifaddrs available for this platform.
+#endif
+#endif
+
+static struct ifaddrs *socket_ifaddrs_cache = NULL;
+static uint64_t socket_ifaddrs_expiry = 0;
+#ifdef __linux__
+static int socket_ifaddrs_nl = -2; // -2: not opened yet, -1: netlink not available
+
+static int socket_ifaddrs_netlink_open(void)
+{
+	struct sockaddr_nl snl;
+	int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0) {
+		SOCKET_ERR(2, "%s: netlink socket(): %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	memset(&snl, 0, sizeof(snl));
+	snl.nl_family = AF_NETLINK;
+	snl.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+	if (bind(fd, (struct sockaddr*)&snl, sizeof(snl)) < 0) {
+		SOCKET_ERR(2, "%s: netlink bind(): %s\n", __func__, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// drains pending notifications, returns 1 if links or addresses changed since the last call
+static int socket_ifaddrs_netlink_changed(int fd)
+{
+	char buf[8192];
+	int changed = 0;
+	while (1) {
+		ssize_t n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == ENOBUFS) {
+				// notifications were dropped, assume the worst
+				changed = 1;
+				continue;
+			}
+			break;
+		}
+		if (n == 0) {
+			break;
+		}
+		int len = (int)n;
+		struct nlmsghdr *nh;
+		for (nh = (struct nlmsghdr*)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+			switch (nh->nlmsg_type) {
+			case RTM_NEWADDR:
+			case RTM_DELADDR:
+			case RTM_NEWLINK:
+			case RTM_DELLINK:
+				changed = 1;
+				break;
+			default:
+				break;
+			}
+		}
+	}
+	return changed;
+}
+#endif
+
+/*
+ * Returns the cached interface list and keeps it locked until
+ * socket_ifaddrs_release() is called. On Linux the cache is invalidated
+ * by netlink address/link notifications, elsewhere it expires after
+ * SOCKET_IFADDRS_TTL ms.
+ */
+static struct ifaddrs* socket_ifaddrs_acquire(void)
+{
+	int stale;
+	uint64_t now;
+
+	mutex_lock(&socket_ifaddrs_mutex);
+	now = socket_time_ms();
+	stale = (socket_ifaddrs_cache == NULL);
+#ifdef __linux__
+	if (socket_ifaddrs_nl == -2) {
+		// subscribe before taking the first snapshot so no change is missed
+		socket_ifaddrs_nl = socket_ifaddrs_netlink_open();
+	}
+	if (socket_ifaddrs_nl >= 0) {
+		if (socket_ifaddrs_netlink_changed(socket_ifaddrs_nl)) {
+			stale = 1;
+		}
+	} else
+#endif
+	if (now >= socket_ifaddrs_expiry) {
+		stale = 1;
+	}
+
+	if (stale) {
+		if (socket_ifaddrs_cache) {
+			freeifaddrs(socket_ifaddrs_cache);
+			socket_ifaddrs_cache = NULL;
+		}
+		if (getifaddrs(&socket_ifaddrs_cache) == -1) {
+#ifdef _WIN32
+			errno = WSAError_to_errno(WSAGetLastError());
+#endif
+			SOCKET_ERR(1, "getifaddrs(): %s\n", strerror(errno));
+			socket_ifaddrs_cache = NULL;
+			mutex_unlock(&socket_ifaddrs_mutex);
+			return NULL;
+		}
+		socket_ifaddrs_expiry = now + SOCKET_IFADDRS_TTL;
+	}
+
+	return socket_ifaddrs_cache;
+}
+
+static void socket_ifaddrs_release(void)
+{
+	mutex_unlock(&socket_ifaddrs_mutex);
+}
+
+void socket_flush_interface_cache(void)
+{
+	mutex_lock(&socket_ifaddrs_mutex);
+	if (socket_ifaddrs_cache) {
+		freeifaddrs(socket_ifaddrs_cache);
+		socket_ifaddrs_cache = NULL;
+	}
+	mutex_unlock(&socket_ifaddrs_mutex);
+}
+
+int get_primary_mac_address(unsigned char mac_addr_buf[6])
+{
+	int result = -1;
+	struct ifaddrs *ifaddr = NULL, *ifa = NULL;
+	ifaddr = socket_ifaddrs_acquire();
+	if (ifaddr) {
+		for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+			if (ifa->ifa_addr == NULL) {
+				continue;
+			}
+			if ((ifa->ifa_flags & IFF_UP) == 0) {
+				continue;
+			}
+			if (ifa->ifa_flags & IFF_LOOPBACK) {
+				continue;
+			}
+#if defined(__APPLE__) || defined (__FreeBSD__) || defined (__HAIKU__)
+			if (ifa->ifa_addr->sa_family != AF_LINK) {
+				continue;
+			}
+#if defined (__APPLE__)
+			if (!strcmp(ifa->ifa_name, "en0")) {
+#elif defined (__FreeBSD__) || defined (__HAIKU__)
+			{
+#endif
+				memcpy(mac_addr_buf, (unsigned char *)LLADDR((struct sockaddr_dl *)(ifa)->ifa_addr), 6);
+				result = 0;
+				break;
+			}
+#elif defined (__linux__)
+			if (ifa->ifa_addr->sa_family != AF_PACKET) {
+				continue;
+			}
+			if (strcmp(ifa->ifa_name, "lo") != 0) {
+				memcpy(mac_addr_buf, ((struct sockaddr_ll*)ifa->ifa_addr)->sll_addr, 6);
+				result = 0;
+				break;
+			}
+#elif defined (WIN32)
+			if (ifa->ifa_data) {
+				memcpy(mac_addr_buf, ifa->ifa_data, 6);
+				result = 0;
+				break;
+			}
+#elif defined(__CYGWIN__)
+			if (ifa->ifa_data) {
+				memcpy(mac_addr_buf, ((struct ifaddrs_hwdata *)ifa->ifa_data)->ifa_hwaddr.sa_data, 6);
+				result = 0;
+				break;
+			}
+#else
+#error get_primary_mac_address is not supported on this platform.
+#endif
+		}
+		socket_ifaddrs_release();
+	}
+	return result;
+}
+
+static int32_t _sockaddr_in6_scope_id(struct sockaddr_in6* addr)
+{
+	int32_t res = -1;
+	struct ifaddrs *ifaddr = NULL, *ifa = NULL;
+	uint32_t addr_scope;
+
+	/* get scope for requested address */
+	addr_scope = _in6_addr_scope(&addr->sin6_addr);
+	if (addr_scope == 0) {
+		/* global scope doesn't need a specific scope id */
+		return addr_scope;
+	}
+
+	/* get interfaces */
+	ifaddr = socket_ifaddrs_acquire();
+	if (!ifaddr) {
+		return res;
+	}
+
+	/* loop over interfaces */
+	for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+		/* skip if no address is available */
+		if (ifa->ifa_addr == NULL) {
+			continue;
+		}
+
+		/* skip if wrong family */
+		if (ifa->ifa_addr->sa_family != AF_INET6) {
+			continue;
+		}
+
+		/* skip if not up */
+		if ((ifa->ifa_flags & IFF_UP) == 0) {
+			continue;
+		}
+
+#ifndef __HAIKU__
+		/* skip if not running */
+		if ((ifa->ifa_flags & IFF_RUNNING) == 0) {
+			continue;
+		}
+#endif
+
+		struct sockaddr_in6* addr_in = (struct sockaddr_in6*)ifa->ifa_addr;
+
+		/* skip if scopes do not match */
+		if (_in6_addr_scope(&addr_in->sin6_addr) != addr_scope) {
+			continue;
+		}
+
+		/* use if address is equal */
+		if (memcmp(&addr->sin6_addr.s6_addr, &addr_in->sin6_addr.s6_addr, sizeof(addr_in->sin6_addr.s6_addr)) == 0) {
+			/* if scope id equals the requested one then assume it was valid */
+			if (addr->sin6_scope_id == addr_in->sin6_scope_id) {
+				res = addr_in->sin6_scope_id;
+				break;
+			}
+			res = addr_in->sin6_scope_id;
+			continue;
+		}
+
+		/* skip loopback interface if not already matched exactly above */
+		if ((ifa->ifa_flags & IFF_LOOPBACK) != 0) {
+			continue;
+		}
+
+		res = addr_in->sin6_scope_id;
+
+		/* if scope id equals the requested one then assume it was valid */
+		if (addr->sin6_scope_id == addr_in->sin6_scope_id) {
+			/* set the scope id of this interface as most likely candidate */
+			break;
+		}
+	}
+
+	socket_ifaddrs_release();
+
+	return res;
+}
+#endif
+
+int socket_connect_addr(struct sockaddr* addr, uint16_t port)
+{
+	return socket_connect_addr_ex(addr, port, NULL);
+}
+
+// sets port (and scope id) in addr and determines its length
+static int socket_connect_addr_prepare(struct sockaddr* addr, uint16_t port, socklen_t *addrlen)
+{
+	if (addr->sa_family == AF_INET) {
+		struct sockaddr_in* addr_in = (struct sockaddr_in*)addr;
+		addr_in->sin_port = htons(port);
+		*addrlen = sizeof(struct sockaddr_in);
+	}
+#ifdef AF_INET6
+	else if (addr->sa_family == AF_INET6) {
+		struct sockaddr_in6* addr_in = (struct sockaddr_in6*)addr;
+		addr_in->sin6_port = htons(port);
+
+		/*
+		 * IPv6 Routing Magic:
+		 *
+		 * If the scope of the address is a link-local one, IPv6 requires the
+		 * scope id set to an interface number to allow proper routing. However,
+		 * as the provided sockaddr might contain a wrong scope id, we must find
+		 * a scope id from a suitable interface on this system or routing might
+		 * fail. An IPv6 guru should have another look though...
+		 */
+		addr_in->sin6_scope_id = _sockaddr_in6_scope_id(addr_in);
+
+		*addrlen = sizeof(struct sockaddr_in6);
+	}
+#endif
+	else {
+		SOCKET_ERR(1, "ERROR: Unsupported address family\n");
+		errno = EAFNOSUPPORT;
+		return -1;
+	}
+	return 0;
+}
+
+// creates a non-blocking TCP socket and initiates the connection
+static int socket_connect_start(const struct sockaddr* addr, socklen_t addrlen, const struct socket_options *opts, int *in_progress)
+{
+	int sfd = -1;
+	int yes = 1;
+#ifdef _WIN32
+	u_long l_yes = 1;
+#endif
+
+	*in_progress = 0;
+
+	sfd = socket(addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
+	if (sfd == -1) {
+#ifdef _WIN32
+		errno = WSAError_to_errno(WSAGetLastError());
+#endif
+		SOCKET_ERR(1, "socket(): %s\n", strerror(errno));
+		return -1;
+	}
+	socket_fd_info_reset(sfd);
+
+#ifdef SO_NOSIGPIPE
+	if (setsockopt(sfd, SOL_SOCKET, SO_NOSIGPIPE, (void*)&yes, sizeof(int)) == -1) {
+		SOCKET_ERR(1, "setsockopt() SO_NOSIGPIPE: %s\n", strerror(errno));
+		socket_close(sfd);
+		return -1;
+	}
+#endif
+
+	if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void*)&yes, sizeof(int)) == -1) {
+#ifdef _WIN32
+		errno = WSAError_to_errno(WSAGetLastError());
+#endif
+		SOCKET_ERR(1, "setsockopt() SO_REUSEADDR: %s\n", strerror(errno));
+		socket_close(sfd);
+		return -1;
+	}
+
+	// buffer sizes must be set before connecting to affect the TCP window scale
+	socket_apply_options(sfd, opts, 1);
+
+#ifdef _WIN32
+	ioctlsocket(sfd, FIONBIO, &l_yes);
+#else
+	int flags = fcntl(sfd, F_GETFL, 0);
+	fcntl(sfd, F_SETFL, flags | O_NONBLOCK);
+#endif
+
+	if (connect(sfd, addr, addrlen) != -1) {
+		return sfd;
+	}
+#ifdef _WIN32
+	if (WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+	if (errno == EINPROGRESS)
+#endif
+	{
+		*in_progress = 1;
+		return sfd;
+	}
+#ifdef _WIN32
+	errno = WSAError_to_errno(WSAGetLastError());
+#endif
+	int err = errno;
+	socket_close(sfd);
+	errno = err;
+	return -1;
+}
+
+int socket_connect_addr_ex(struct sockaddr* addr, uint16_t port, const struct socket_options *opts)
+{
+	int sfd = -1;
+	socklen_t addrlen = 0;
+	int in_progress = 0;
+	struct socket_options defopts;
+
+	if (!opts) {
+		socket_options_init(&defopts);
+		opts = &defopts;
+	}
+
+	if (socket_connect_addr_prepare(addr, port, &addrlen) < 0) {
+		return -1;
+	}
+
+	sfd = socket_connect_start(addr, addrlen, opts, &in_progress);
+	if (sfd >= 0 && in_progress) {
+		if (poll_wrapper(sfd, FDM_WRITE, socket_connect_poll_timeout()) == poll_status_success) {
+			int so_error;
+			socklen_t len = sizeof(so_error);
+			getsockopt(sfd, SOL_SOCKET, SO_ERROR, (void*)&so_error, &len);
+			if (so_error == 0) {
+				errno = 0;
+			} else {
+#ifdef _WIN32
+				so_error = WSAError_to_errno(so_error);
+#endif
+				errno = so_error;
+				socket_close(sfd);
+				sfd = -1;
+			}
+		} else {
+			int so_error = 0;
+			socklen_t len = sizeof(so_error);
+			getsockopt(sfd, SOL_SOCKET, SO_ERROR, (void*)&so_error, &len);
+			if (so_error != 0) {
+#ifdef _WIN32
+				so_error = WSAError_to_errno(so_error);
+#endif
+				errno = so_error;
+			}
+			socket_close(sfd);
+			sfd = -1;
+		}
+	}
+
+	if (sfd < 0) {
+		if (verbose >= 2) {
+			char addrtxt[48];
+			socket_addr_to_string(addr, addrtxt, sizeof(addrtxt));
+			SOCKET_ERR(2, "%s: Could not connect to %s port %d\n", __func__, addrtxt, port);
+		}
+		return -1;
+	}
+
+	return sfd;
+}
+
+int socket_connect_addr_start(struct sockaddr* addr, uint16_t port, const struct socket_options *opts)
+{
+	socklen_t addrlen = 0;
+	int in_progress = 0;
+	struct socket_options defopts;
+
+	if (!opts) {
+		socket_options_init(&defopts);
+		opts = &defopts;
+	}
+
+	if (socket_connect_addr_prepare(addr, port, &addrlen) < 0) {
+		return -1;
+	}
+
+	return socket_connect_start(addr, addrlen, opts, &in_progress);
+}
+
+int socket_connect_finish(int fd)
+{
+	int so_error = 0;
+	socklen_t len = sizeof(so_error);
+	struct sockaddr_storage peer;
+	socklen_t peer_len = sizeof(peer);
+
+	if (fd < 0) {
+		return -EINVAL;
+	}
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (void*)&so_error, &len) < 0) {
+#ifdef _WIN32
+		errno = WSAError_to_errno(WSAGetLastError());
+#endif
+		return -errno;
+	}
+	if (so_error != 0) {
+#ifdef _WIN32
+		so_error = WSAError_to_errno(so_error);
+#endif
+		return -so_error;
+	}
+	if (getpeername(fd, (struct sockaddr*)&peer, &peer_len) < 0) {
+#ifdef _WIN32
+		errno = WSAError_to_errno(WSAGetLastError());
+#endif
+		if (errno == ENOTCONN) {
+			return -EINPROGRESS;
+		}
+		return -errno;
+	}
+	return 0;
+}
+
+int socket_connect(const char *addr, uint16_t port)
+{
+	return socket_connect_ex(addr, port, NULL);
+}
+
+int socket_connect_ex(const char *addr, uint16_t port, const struct socket_options *opts)
+{
+	int sfd = -1;
+	int yes = 1;
+	struct socket_options defopts;
+	struct socket_resolve_entry *entry = NULL;
+	struct addrinfo *result, *rp;
+	int res;
+#ifdef _WIN32
+	u_long l_yes = 1;
+#else
+	int flags = 0;
+#endif
+
+	if (!opts) {
+		socket_options_init(&defopts);
+		opts = &defopts;
+	}
+
+	entry = socket_resolver_get(addr, port, SOCK_STREAM, IPPROTO_TCP, AI_NUMERICSERV, &res);
+	if (!entry) {
+		SOCKET_ERR(1, "%s: getaddrinfo: %s\n", __func__, gai_strerror(res));
+		return -1;
+	}
+	result = entry->result;
+
+	for (rp = result; rp != NULL; rp = rp->ai_next) {
+		sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		if (sfd == -1) {
+			continue;
+		}
+		socket_fd_info_reset(sfd);
+
+#ifdef SO_NOSIGPIPE
+		if (setsockopt(sfd, SOL_SOCKET, SO_NOSIGPIPE, (void*)&yes, sizeof(int)) == -1) {
+			SOCKET_ERR(1, "setsockopt() SO_NOSIGPIPE: %s\n", strerror(errno));
+			socket_close(sfd);
+			continue;
+		}
+#endif
+
+		if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void*)&yes, sizeof(int)) == -1) {
+#ifdef _WIN32
+			errno = WSAError_to_errno(WSAGetLastError());
+#endif
+			SOCKET_ERR(1, "setsockopt() SO_REUSEADDR: %s\n", strerror(errno));
+			socket_close(sfd);
+			continue;
+		}
+
+		// buffer sizes must be set before connecting to affect the TCP window scale
+		socket_apply_options(sfd, opts, 1);
+
+#ifdef _WIN32
+		ioctlsocket(sfd, FIONBIO, &l_yes);
+#else
+		flags = fcntl(sfd, F_GETFL, 0);
+		fcntl(sfd, F_SETFL, flags | O_NONBLOCK);
+#endif
+
+		if (connect(sfd, rp->ai_addr, rp->ai_addrlen) != -1) {
+			break;
+		}
+#ifdef _WIN32
+		if (WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+		if (errno == EINPROGRESS)
+#endif
+		{
+			if (poll_wrapper(sfd, FDM_WRITE, socket_connect_poll_timeout()) == poll_status_success) {
+				int so_error;
+				socklen_t len = sizeof(so_error);
+				getsockopt(sfd, SOL_SOCKET, SO_ERROR, (void*)&so_error, &len);
+				if (so_error == 0) {
+					errno = 0;
+					break;
+				}
+#ifdef _WIN32
+				so_error = WSAError_to_errno(so_error);
+#endif
+				errno = so_error;
+			} else {
+				int so_error = 0;
+				socklen_t len = sizeof(so_error);
+				getsockopt(sfd, SOL_SOCKET, SO_ERROR, (void*)&so_error, &len);
+				if (so_error != 0) {
+#ifdef _WIN32
+					so_error = WSAError_to_errno(so_error);
+#endif
+					errno = so_error;
+				}
+			}
+		}
+		socket_close(sfd);
+	}
+
+	if (rp == NULL) {
+		// drop the cached result in case the host moved
+		socket_resolver_evict(entry);
+	}
+	socket_resolver_release(entry);
+
+	if (rp == NULL) {
+		SOCKET_ERR(2, "%s: Could not connect to %s:%d\n", __func__, addr, port);
+		return -1;
+	}
+
+	return sfd;
+}
+
+static int socket_connect_happy_eyeballs_internal(const char *addr, uint16_t port, const struct socket_options *opts, unsigned int timeout, socket_cancel_t cancel)
+{
+	int sfd = -1;
+	struct socket_options defopts;
+	struct socket_resolve_entry *entry = NULL;
+	struct addrinfo *result, *rp;
+	struct addrinfo **order = NULL;
+	struct socket_poll_entry *pending = NULL;
+	unsigned int num_addrs = 0;
+	unsigned int num_pending = 0;
+	unsigned int next = 0;
+	unsigned int i;
+	int res;
+	int err = ETIMEDOUT;
+
+	if (!opts) {
+		socket_options_init(&defopts);
+		opts = &defopts;
+	}
+
+	entry = socket_resolver_get(addr, port, SOCK_STREAM, IPPROTO_TCP, AI_NUMERICSERV, &res);
+	if (!entry) {
+		SOCKET_ERR(1, "%s: getaddrinfo: %s\n", __func__, gai_strerror(res));
+		return -1;
+	}
+	result = entry->result;
+
+	for (rp = result; rp != NULL; rp = rp->ai_next) {
+		num_addrs++;
+	}
+	order = (struct addrinfo**)malloc(sizeof(struct addrinfo*) * num_addrs);
+	// one more for the cancellation fd
+	pending = (struct socket_poll_entry*)malloc(sizeof(struct socket_poll_entry) * (num_addrs + 1));
+	if (!order || !pending) {
+		free(order);
+		free(pending);
+		socket_resolver_release(entry);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	// RFC 8305 section 4: interleave address families, starting with the preferred one
+	{
+		int first_family = result->ai_family;
+		struct addrinfo *a = result;
+		struct addrinfo *b = result;
+		unsigned int n = 0;
+		while (n < num_addrs) {
+			while (a && a->ai_family != first_family) {
+				a = a->ai_next;
+			}
+			if (a) {
+				order[n++] = a;
+				a = a->ai_next;
+			}
+			while (b && b->ai_family == first_family) {
+				b = b->ai_next;
+			}
+			if (b) {
+				order[n++] = b;
+				b = b->ai_next;
+			}
+		}
+	}
+
+	uint64_t now = socket_time_ms();
+	if (timeout == 0) {
+		int connect_timeout = socket_connect_poll_timeout();
+		timeout = (connect_timeout > 0) ? (unsigned int)connect_timeout : INT_MAX;
+	}
+	uint64_t deadline = now + timeout;
+	uint64_t next_start = now;
+
+	while (sfd < 0) {
+		now = socket_time_ms();
+		if (now >= deadline) {
+			err = ETIMEDOUT;
+			break;
+		}
+		if (socket_cancel_is_set(cancel)) {
+			err = ECANCELED;
+			break;
+		}
+
+		if (next < num_addrs && now >= next_start) {
+			int in_progress = 0;
+			int fd = socket_connect_start(order[next]->ai_addr, (socklen_t)order[next]->ai_addrlen, opts, &in_progress);
+			next++;
+			if (fd < 0) {
+				// failed right away, go on with the next address immediately
+				err = errno;
+				continue;
+			}
+			if (!in_progress) {
+				sfd = fd;
+				break;
+			}
+			pending[num_pending].fd = fd;
+			pending[num_pending].events = SOCKET_EVENT_WRITE;
+			pending[num_pending].revents = 0;
+			num_pending++;
+			next_start = now + HAPPY_EYEBALLS_DELAY;
+		}
+
+		if (num_pending == 0) {
+			if (next >= num_addrs) {
+				break;
+			}
+			continue;
+		}
+
+		uint64_t wait_until = deadline;
+		if (next < num_addrs && next_start < wait_until) {
+			wait_until = next_start;
+		}
+		if (cancel) {
+			pending[num_pending].fd = socket_cancel_get_fd(cancel);
+			pending[num_pending].events = SOCKET_EVENT_READ;
+			pending[num_pending].revents = 0;
+		}
+		res = poll_wrapper_multi(pending, num_pending + ((cancel) ? 1 : 0), (wait_until > now) ? (int)(wait_until - now) : 0);
+		if (res < 0) {
+			err = -res;
+			break;
+		}
+		if (cancel && pending[num_pending].revents) {
+			err = ECANCELED;
+			break;
+		}
+
+		i = num_pending;
+		while (i-- > 0) {
+			if (pending[i].revents == 0) {
+				continue;
+			}
+			res = socket_connect_finish(pending[i].fd);
+			if (res == -EINPROGRESS) {
+				continue;
+			}
+			if (res == 0) {
+				sfd = pending[i].fd;
+			} else {
+				err = -res;
+				socket_close(pending[i].fd);
+				// an attempt failed, start the next one without further delay
+				next_start = now;
+			}
+			pending[i] = pending[--num_pending];
+			if (sfd >= 0) {
+				break;
+			}
+		}
+	}
+
+	for (i = 0; i < num_pending; i++) {
+		socket_close(pending[i].fd);
+	}
+	free(pending);
+	free(order);
+	if (sfd < 0) {
+		socket_resolver_evict(entry);
+	}
+	socket_resolver_release(entry);
+
+	if (sfd < 0) {
+		SOCKET_ERR(2, "%s: Could not connect to %s:%d: %s\n", __func__, addr, port, strerror(err));
+		errno = err;
+		return -1;
+	}
+	errno = 0;
+
+	return sfd;
+}
+
+int socket_connect_happy_eyeballs(const char *addr, uint16_t port, const struct socket_options *opts, unsigned int timeout)
+{
+	return socket_connect_happy_eyeballs_internal(addr, port, opts, timeout, NULL);
+}
+
+int socket_connect_cancellable(const char *addr, uint16_t port, const struct socket_options *opts, unsigned int timeout, socket_cancel_t cancel)
+{
+	return socket_connect_happy_eyeballs_internal(addr, port, opts, timeout, cancel);
+}
+
+int socket_create_dgram(const char *addr, uint16_t port)
+{
+	int sfd = -1;
+	int yes = 1;
+	int no = 0;
+	struct socket_resolve_entry *entry = NULL;
+	struct addrinfo *result, *rp;
+	int res;
+
+	entry = socket_resolver_get(addr, port, SOCK_DGRAM, IPPROTO_UDP, AI_PASSIVE | AI_NUMERICSERV, &res);
+	if (!entry) {
+		SOCKET_ERR(1, "%s: getaddrinfo: %s\n", __func__, gai_strerror(res));
+		return -1;
+	}
+	result = entry->result;
+
+	for (rp = result; rp != NULL; rp = rp->ai_next) {
+		sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		if (sfd == -1) {
+			continue;
+		}
+		socket_fd_info_reset(sfd);
+
+		if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void*)&yes, sizeof(int)) == -1) {
+#ifdef _WIN32
+			errno = WSAError_to_errno(WSAGetLastError());
+#endif
+			SOCKET_ERR(1, "setsockopt() SO_REUSEADDR: %s\n", strerror(errno));
+			socket_close(sfd);
+			continue;
+		}
+
+#if defined(AF_INET6) && defined(IPV6_V6ONLY)
+		if (rp->ai_family == AF_INET6) {
+			if (setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, (addr) ? (void*)&yes : (void*)&no, sizeof(int)) == -1) {
+#ifdef _WIN32
+				errno = WSAError_to_errno(WSAGetLastError());
+#endif
+				SOCKET_ERR(1, "setsockopt() IPV6_V6ONLY: %s\n", strerror(errno));
+			}
+		}
+#endif
+
+		if (bind(sfd, rp->ai_addr, rp->ai_addrlen) < 0) {
+#ifdef _WIN32
+			errno = WSAError_to_errno(WSAGetLastError());
+#endif
+			SOCKET_ERR(1, "bind(): %s\n", strerror(errno));
+			socket_close(sfd);
+			continue;
+		}
+		break;
+	}
+
+	socket_resolver_release(entry);
+
+	if (rp == NULL) {
+		return -1;
+	}
+
+	return sfd;
+}
+
+int socket_connect_dgram(const char *addr, uint16_t port)
+{
+	int sfd = -1;
+	struct socket_resolve_entry *entry = NULL;
+	struct addrinfo *result, *rp;
+	int res;
+
+	entry = socket_resolver_get(addr, port, SOCK_DGRAM, IPPROTO_UDP, AI_NUMERICSERV, &res);
+	if (!entry) {
+		SOCKET_ERR(1, "%s: getaddrinfo: %s\n", __func__, gai_strerror(res));
+		return -1;
+	}
+	result = entry->result;
+
+	for (rp = result; rp != NULL; rp = rp->ai_next) {
+		sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		if (sfd == -1) {
+			continue;
+		}
+		socket_fd_info_reset(sfd);
+		// for datagram sockets this only sets the default destination
+		if (connect(sfd, rp->ai_addr, rp->ai_addrlen) == 0) {
+			break;
+		}
+#ifdef _WIN32
+		errno = WSAError_to_errno(WSAGetLastError());
+#endif
+		SOCKET_ERR(2, "%s: connect: %s\n", __func__, strerror(errno));
+		socket_close(sfd);
+	}
+
+	socket_resolver_release(entry);
+
+	if (rp == NULL) {
+		SOCKET_ERR(2, "%s: Could not connect to %s:%d\n", __func__, addr, port);
+		return -1;
+	}
+
+	return sfd;
+}
+
+int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout)
+{
+	if (fd < 0) {
+		SOCKET_ERR(2, "ERROR: invalid fd in check_fd %d\n", fd);
+		return -EINVAL;
+	}
+
+	int timeout_ms;
+	if (timeout > 0) {
+		timeout_ms = (int)timeout;
+		if (timeout_ms <= 0)
+			timeout_ms = -1;
+	} else {
+		timeout_ms = -1;
+	}
+
+	switch (poll_wrapper(fd, fdm, timeout_ms)) {
+		case poll_status_success:
+			return 1;
+		case poll_status_timeout:
+			return -ETIMEDOUT;
+		case poll_status_error:
+		default:
+			SOCKET_ERR(2, "%s: poll_wrapper failed\n", __func__);
+			return -ECONNRESET;
+	}
+
+	return -ECONNRESET;
+}
+
+int socket_check_fds(struct socket_poll_entry *entries, unsigned int count, unsigned int timeout)
+{
+	int timeout_ms = (timeout > 0 && timeout <= INT_MAX) ? (int)timeout : -1;
+	int res;
+
+	if (!entries || count == 0) {
+		return -EINVAL;
+	}
+	res = poll_wrapper_multi(entries, count, timeout_ms);
+	if (res == 0) {
+		return -ETIMEDOUT;
+	}
+	return res;
+}
+
+struct socket_wakeup {
+	int rfd;
+	int wfd;
+};
+
+socket_wakeup_t socket_wakeup_new(void)
+{
+	socket_wakeup_t wakeup = (socket_wakeup_t)malloc(sizeof(struct socket_wakeup));
+	if (!wakeup) {
+		return NULL;
+	}
+#if defined(HAVE_SYS_EVENTFD_H)
+	wakeup->rfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeup->rfd < 0) {
+		SOCKET_ERR(1, "%s: eventfd: %s\n", __func__, strerror(errno));
+		free(wakeup);
+		return NULL;
+	}
+	wakeup->wfd = wakeup->rfd;
+#elif defined(_WIN32)
+	// select() and WSAPoll() only take sockets
+	int fds[2];
+	int res = socket_pair(fds);
+	if (res < 0) {
+		free(wakeup);
+		errno = -res;
+		return NULL;
+	}
+	u_long l_yes = 1;
+	ioctlsocket(fds[0], FIONBIO, &l_yes);
+	ioctlsocket(fds[1], FIONBIO, &l_yes);
+	wakeup->rfd = fds[0];
+	wakeup->wfd = fds[1];
+#else
+	int fds[2];
+	if (pipe(fds) != 0) {
+		SOCKET_ERR(1, "%s: pipe: %s\n", __func__, strerror(errno));
+		free(wakeup);
+		return NULL;
+	}
+	int i;
+	for (i = 0; i < 2; i++) {
+		fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL, 0) | O_NONBLOCK);
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	wakeup->rfd = fds[0];
+	wakeup->wfd = fds[1];
+#endif
+	return wakeup;
+}
+
+void socket_wakeup_free(socket_wakeup_t wakeup)
+{
+	if (!wakeup) {
+		return;
+	}
+#ifdef _WIN32
+	socket_close(wakeup->rfd);
+	socket_close(wakeup->wfd);
+#else
+	close(wakeup->rfd);
+	if (wakeup->wfd != wakeup->rfd) {
+		close(wakeup->wfd);
+	}
+#endif
+	free(wakeup);
+}
+
+int socket_wakeup_get_fd(socket_wakeup_t wakeup)
+{
+	return (wakeup) ? wakeup->rfd : -EINVAL;
+}
+
+int socket_wakeup_signal(socket_wakeup_t wakeup)
+{
+	if (!wakeup) {
+		return -EINVAL;
+	}
+#if defined(HAVE_SYS_EVENTFD_H)
+	uint64_t one = 1;
+	if (write(wakeup->wfd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		return -errno;
+	}
+#elif defined(_WIN32)
+	if (send(wakeup->wfd, "", 1, 0) < 0) {
+		int err = WSAError_to_errno(WSAGetLastError());
+		// a full buffer means there is a wakeup pending already
+		if (err != EAGAIN && err != EWOULDBLOCK) {
+			return -err;
+		}
+	}
+#else
+	if (write(wakeup->wfd, "", 1) < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+		return -errno;
+	}
+#endif
+	return 0;
+}
+
+int socket_wakeup_clear(socket_wakeup_t wakeup)
+{
+	if (!wakeup) {
+		return -EINVAL;
+	}
+#if defined(HAVE_SYS_EVENTFD_H)
+	uint64_t value;
+	if (read(wakeup->rfd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+		return -errno;
+	}
+#else
+	char buf[64];
+#ifdef _WIN32
+	while (recv(wakeup->rfd, buf, sizeof(buf), 0) > 0);
+#else
+	while (read(wakeup->rfd, buf, sizeof(buf)) > 0);
+#endif
+#endif
+	return 0;
+}
+
+struct socket_cancel {
+	socket_wakeup_t wakeup;
+	int cancelled;
+};
+
+socket_cancel_t socket_cancel_new(void)
+{
+	socket_cancel_t cancel = (socket_cancel_t)calloc(1, sizeof(struct socket_cancel));
+	if (!cancel) {
+		return NULL;
+	}
+	cancel->wakeup = socket_wakeup_new();
+	if (!cancel->wakeup) {
+		free(cancel);
+		return NULL;
+	}
+	return cancel;
+}
+
+void socket_cancel_free(socket_cancel_t cancel)
+{
+	if (!cancel) {
+		return;
+	}
+	socket_wakeup_free(cancel->wakeup);
+	free(cancel);
+}
+
+int socket_cancel_signal(socket_cancel_t cancel)
+{
+	if (!cancel) {
+		return -EINVAL;
+	}
+	ATOMIC_STORE_RELAXED(&cancel->cancelled, 1);
+	return socket_wakeup_signal(cancel->wakeup);
+}
+
+int socket_cancel_reset(socket_cancel_t cancel)
+{
+	if (!cancel) {
+		return -EINVAL;
+	}
+	ATOMIC_STORE_RELAXED(&cancel->cancelled, 0);
+	return socket_wakeup_clear(cancel->wakeup);
+}
+
+int socket_cancel_is_set(socket_cancel_t cancel)
+{
+	return (cancel) ? ATOMIC_LOAD_RELAXED(&cancel->cancelled) : 0;
+}
+
+int socket_cancel_get_fd(socket_cancel_t cancel)
+{
+	return (cancel) ? socket_wakeup_get_fd(cancel->wakeup) : -EINVAL;
+}
+
+int socket_accept(int fd, uint16_t port)
+{
+	return socket_accept_ex(fd, NULL, 0);
+}
+
+int socket_accept_ex(int fd, struct sockaddr_storage *peer, int flags)
+{
+#ifdef _WIN32
+	int addr_len;
+#else
+	socklen_t addr_len;
+#endif
+	int result;
+	struct sockaddr_storage addr;
+
+	if (!peer) {
+		peer = &addr;
+	}
+	addr_len = sizeof(struct sockaddr_storage);
+
+#if defined(HAVE_ACCEPT4) && defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+	int aflags = 0;
+	if (flags & SOCKET_ACCEPT_NONBLOCK) {
+		aflags |= SOCK_NONBLOCK;
+	}
+	if (flags & SOCKET_ACCEPT_CLOEXEC) {
+		aflags |= SOCK_CLOEXEC;
+	}
+	result = accept4(fd, (struct sockaddr*)peer, &addr_len, aflags);
+#else
+	result = accept(fd, (struct sockaddr*)peer, &addr_len);
+	if (result >= 0) {
+#ifdef _WIN32
+		if (flags & SOCKET_ACCEPT_NONBLOCK) {
+			u_long l_yes = 1;
+			ioctlsocket(result, FIONBIO, &l_yes);
+		}
+#else
+		if (flags & SOCKET_ACCEPT_NONBLOCK) {
+			fcntl(result, F_SETFL, fcntl(result, F_GETFL, 0) | O_NONBLOCK);
+		}
+		if (flags & SOCKET_ACCEPT_CLOEXEC) {
+			fcntl(result, F_SETFD, FD_CLOEXEC);
+		}
+#endif
+	}
+#endif
+	if (result >= 0) {
+		socket_fd_info_reset(result);
+	}
+#ifdef _WIN32
+	if (result < 0) {
+		errno = WSAError_to_errno(WSAGetLastError());
+	}
+#endif
+	return result;
+}
+
+int socket_shutdown(int fd, int how)
+{
+	int result = shutdown(fd, how);
+#ifdef _WIN32
+	if (result < 0) {
+		errno = WSAError_to_errno(WSAGetLastError());
+	}
+#endif
+	return result;
+}
+
+int socket_pair(int fds[2])
+{
+	if (!fds) {
+		return -EINVAL;
+	}
+	fds[0] = fds[1] = -1;
+#ifdef _WIN32
+	// no socketpair() here, emulate it with a loopback TCP connection
+	struct sockaddr_in sin;
+	int len = sizeof(sin);
+	int err = 0;
+	SOCKET lfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (lfd == INVALID_SOCKET) {
+		return -WSAError_to_errno(WSAGetLastError());
+	}
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(lfd, (struct sockaddr*)&sin, sizeof(sin)) != 0
+	    || getsockname(lfd, (struct sockaddr*)&sin, &len) != 0
+	    || listen(lfd, 1) != 0) {
+		err = WSAError_to_errno(WSAGetLastError());
+		closesocket(lfd);
+		return -err;
+	}
+	SOCKET cfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (cfd == INVALID_SOCKET || connect(cfd, (struct sockaddr*)&sin, sizeof(sin)) != 0) {
+		err = WSAError_to_errno(WSAGetLastError());
+		if (cfd != INVALID_SOCKET) {
+			closesocket(cfd);
+		}
+		closesocket(lfd);
+		return -err;
+	}
+	// any local process could connect to the listener, only accept our own connection
+	struct sockaddr_in cname;
+	int clen = sizeof(cname);
+	if (getsockname(cfd, (struct sockaddr*)&cname, &clen) != 0) {
+		err = WSAError_to_errno(WSAGetLastError());
+		closesocket(cfd);
+		closesocket(lfd);
+		return -err;
+	}
+	SOCKET afd = INVALID_SOCKET;
+	int attempts;
+	for (attempts = 0; attempts < SOCKET_PAIR_MAX_ACCEPTS; attempts++) {
+		struct sockaddr_in peer;
+		int plen = sizeof(peer);
+		afd = accept(lfd, (struct sockaddr*)&peer, &plen);
+		if (afd == INVALID_SOCKET) {
+			break;
+		}
+		if (peer.sin_port == cname.sin_port && peer.sin_addr.s_addr == cname.sin_addr.s_addr) {
+			break;
+		}
+		SOCKET_ERR(2, "%s: dropping foreign connection to the pairing listener\n", __func__);
+		closesocket(afd);
+		afd = INVALID_SOCKET;
+		WSASetLastError(WSAECONNABORTED);
+	}
+	if (afd == INVALID_SOCKET) {
+		err = WSAError_to_errno(WSAGetLastError());
+		closesocket(cfd);
+		closesocket(lfd);
+		return -err;
+	}
+	closesocket(lfd);
+	fds[0] = (int)cfd;
+	fds[1] = (int)afd;
+	// stands in for a unix socketpair, which carries small messages without delay
+	socket_setsockopt_int(fds[0], IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+	socket_setsockopt_int(fds[1], IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+#else
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+		int err = errno;
+		SOCKET_ERR(1, "%s: socketpair(): %s\n", __func__, strerror(err));
+		fds[0] = fds[1] = -1;
+		return -err;
+	}
+#ifdef SO_NOSIGPIPE
+	int i;
+	int yes = 1;
+	for (i = 0; i < 2; i++) {
+		if (setsockopt(fds[i], SOL_SOCKET, SO_NOSIGPIPE, (void*)&yes, sizeof(int)) == -1) {
+			SOCKET_ERR(1, "setsockopt() SO_NOSIGPIPE: %s\n", strerror(errno));
+		}
+	}
+#endif
+#endif
+	socket_fd_info_reset(fds[0]);
+	socket_fd_info_reset(fds[1]);
+	return 0;
+}
+
+int socket_close(int fd)
+{
+	void *ctx = NULL;
+	const struct socket_transport *transport = socket_fd_transport(fd, &ctx);
+	if (transport && transport->close) {
+		transport->close(ctx, fd);
+	}
+	socket_fd_info_reset(fd);
+#ifdef _WIN32
+	int result = closesocket(fd);
+	if (result < 0) {
+		errno = WSAError_to_errno(WSAGetLastError());
+	}
+	return result;
+#else
+	return close(fd);
+#endif
+}
+
+// deadline for the functions using the default send timeout, 0 = none
+static uint64_t socket_send_deadline(void)
+{
+	unsigned int timeout = SOCKET_SEND_TIMEOUT;
+	return (timeout > 0) ? socket_time_ms() + timeout : 0;
+}
+
+// time left until deadline as timeout for socket_check_fd(), a deadline of 0 means none
+static int socket_deadline_remaining(uint64_t deadline, unsigned int *remaining)
+{
+	*remaining = 0;
+	if (deadline) {
+		uint64_t now = socket_time_ms();
+		if (now >= deadline) {
+			return -ETIMEDOUT;
+		}
+		*remaining = (unsigned int)(deadline - now);
+	}
+	return 0;
+}
+
+int socket_set_transport(int fd, const struct socket_transport *transport, void *ctx)
+{
+	struct socket_fd_info *info;
+
+	if (transport && (!transport->receive || !transport->send)) {
+		return -EINVAL;
+	}
+	info = socket_fd_info_get(fd, (transport != NULL));
+	if (!info) {
+		return (fd < 0) ? -EINVAL : (transport) ? -ENOMEM : 0;
+	}
+	info->transport_ctx = ctx;
+	ATOMIC_STORE_PTR(&info->transport, transport);
+	return 0;
+}
+
+const struct socket_transport* socket_get_transport(int fd, void **ctx)
+{
+	return socket_fd_transport(fd, ctx);
+}
+
+int socket_receive_raw(int fd, void *data, size_t length, int flags)
+{
+	uint64_t stats_start = SOCKET_STATS_BEGIN();
+	int result = (int)recv(fd, data, length, flags);
+	SOCKET_STATS_IO(fd, 0, result, (result > 0) ? result : 0, stats_start);
+	if (result < 0) {
+#ifdef _WIN32
+		errno = WSAError_to_errno(WSAGetLastError());
+#endif
+		return -errno;
+	}
+	return result;
+}
+
+int socket_send_raw(int fd, const void *data, size_t length, int flags)
+{
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+	uint64_t stats_start = SOCKET_STATS_BEGIN();
+	int s = (int)send(fd, data, length, flags);
+	SOCKET_STATS_IO(fd, 1, s, (s > 0) ? s : 0, stats_start);
+	if (s < 0) {
+#ifdef _WIN32
+		errno = WSAError_to_errno(WSAGetLastError());
+#endif
+		return -errno;
+	}
+	return s;
+}
+
+// like socket_check_fd() with a deadline, additionally returning -ECANCELED as soon as cancel is signaled
+static int socket_wait_cancellable(int fd, fd_mode fdm, uint64_t deadline, socket_cancel_t cancel)
+{
+	struct socket_poll_entry entries[2];
+	unsigned int remaining = 0;
+	int res;
+
+	res = socket_deadline_remaining(deadline, &remaining);
+	if (res < 0) {
+		return res;
+	}
+	if (!cancel) {
+		return socket_check_fd(fd, fdm, remaining);
+	}
+	if (socket_cancel_is_set(cancel)) {
+		return -ECANCELED;
+	}
+	entries[0].fd = fd;
+	entries[0].events = (fdm == FDM_WRITE) ? SOCKET_EVENT_WRITE : SOCKET_EVENT_READ;
+	entries[1].fd = socket_cancel_get_fd(cancel);
+	entries[1].events = SOCKET_EVENT_READ;
+	res = poll_wrapper_multi(entries, 2, (deadline) ? (int)remaining : -1);
+	if (res < 0) {
+		return res;
+	}
+	if (entries[1].revents) {
+		return -ECANCELED;
+	}
+	return (res == 0) ? -ETIMEDOUT : 1;
+}
+
+/*
+ * Runs one receive or send through the transport of fd, waiting for the
+ * socket to become ready until deadline (0 = no deadline). The transport
+ * returns -EAGAIN when it needs more data from the socket, e.g. for an
+ * incomplete TLS record.
+ */
+static int socket_transport_io(int fd, const struct socket_transport *transport, void *ctx, int is_send, void *data, size_t length, int flags, uint64_t deadline, socket_cancel_t cancel)
+{
+	int res;
+
+	while (1) {
+		if (is_send || !transport->pending || transport->pending(ctx, fd) <= 0) {
+			res = socket_wait_cancellable(fd, (is_send) ? FDM_WRITE : FDM_READ, deadline, cancel);
+			if (res <= 0) {
+				return res;
+			}
+		}
+		if (is_send) {
+			res = transport->send(ctx, fd, data, length);
+		} else {
+			res = transport->receive(ctx, fd, data, length, flags);
+			if (res == 0) {
+				SOCKET_ERR(3, "%s: fd=%d transport receive returned 0\n", __func__, fd);
+				return -ECONNRESET;
+			}
+		}
+		if (res != -EAGAIN && res != -EWOULDBLOCK && res != -EINTR) {
+			return res;
+		}
+	}
+}
+
+static int socket_transport_io_all(int fd, const struct socket_transport *transport, void *ctx, int is_send, void *data, size_t length, uint64_t deadline, size_t *done)
+{
+	size_t total = 0;
+	int res = 0;
+
+	while (total < length) {
+		size_t chunk = length - total;
+		if (chunk > INT_MAX) {
+			chunk = INT_MAX;
+		}
+		res = socket_transport_io(fd, transport, ctx, is_send, (unsigned char*)data + total, chunk, 0, deadline, NULL);
+		if (res < 0) {
+			break;
+		}
+		total += (size_t)res;
+		res = 0;
+	}
+	if (done) {
+		*done = total;
+	}
+	return res;
+}
+
+#ifdef HAVE_KTLS
+static int socket_ktls_set(int fd, int direction, const struct socket_ktls_crypto *crypto)
+{
+	union {
+		struct tls12_crypto_info_aes_gcm_128 aes128;
+		struct tls12_crypto_info_aes_gcm_256 aes256;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+		struct tls12_crypto_info_chacha20_poly1305 chacha;
+#endif
+	} info;
+	socklen_t len;
+
+	if (crypto->version != TLS_1_2_VERSION && crypto->version != TLS_1_3_VERSION) {
+		return -EINVAL;
+	}
+	memset(&info, 0, sizeof(info));
+	switch (crypto->cipher) {
+	case SOCKET_KTLS_AES_GCM_128:
+		info.aes128.info.version = crypto->version;
+		info.aes128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+		memcpy(info.aes128.key, crypto->key, TLS_CIPHER_AES_GCM_128_KEY_SIZE);
+		memcpy(info.aes128.iv, crypto->iv, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+		memcpy(info.aes128.salt, crypto->salt, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+		memcpy(info.aes128.rec_seq, crypto->rec_seq, TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
+		len = sizeof(info.aes128);
+		break;
+	case SOCKET_KTLS_AES_GCM_256:
+		info.aes256.info.version = crypto->version;
+		info.aes256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+		memcpy(info.aes256.key, crypto->key, TLS_CIPHER_AES_GCM_256_KEY_SIZE);
+		memcpy(info.aes256.iv, crypto->iv, TLS_CIPHER_AES_GCM_256_IV_SIZE);
+		memcpy(info.aes256.salt, crypto->salt, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+		memcpy(info.aes256.rec_seq, crypto->rec_seq, TLS_CIPHER_AES_GCM_256_REC_SEQ_SIZE);
+		len = sizeof(info.aes256);
+		break;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+	case SOCKET_KTLS_CHACHA20_POLY1305:
+		info.chacha.info.version = crypto->version;
+		info.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+		memcpy(info.chacha.key, crypto->key, TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE);
+		memcpy(info.chacha.iv, crypto->iv, TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE);
+		memcpy(info.chacha.rec_seq, crypto->rec_seq, TLS_CIPHER_CHACHA20_POLY1305_REC_SEQ_SIZE);
+		len = sizeof(info.chacha);
+		break;
+#endif
+	default:
+		return -ENOTSUP;
+	}
+	if (setsockopt(fd, SOL_TLS, direction, &info, len) < 0) {
+		int err = errno;
+		SOCKET_ERR(1, "%s: fd=%d setsockopt(%s): %s\n", __func__, fd, (direction == TLS_TX) ? "TLS_TX" : "TLS_RX", strerror(err));
+		return -err;
+	}
+	return 0;
+}
+#endif
+
+int socket_enable_ktls(int fd, const struct socket_ktls_crypto *tx, const struct socket_ktls_crypto *rx)
+{
+#ifdef HAVE_KTLS
+	int res;
+
+	if (fd < 0 || (!tx && !rx)) {
+		return -EINVAL;
+	}
+	if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) {
+		int err = errno;
+		// EEXIST: the tls ULP is already attached, e.g. when enabling rx after tx
+		if (err != EEXIST) {
+			SOCKET_ERR(1, "%s: fd=%d setsockopt(TCP_ULP): %s\n", __func__, fd, strerror(err));
+			return -err;
+		}
+	}
+	if (tx) {
+		res = socket_ktls_set(fd, TLS_TX, tx);
+		if (res < 0) {
+			return res;
+		}
+	}
+	if (rx) {
+		res = socket_ktls_set(fd, TLS_RX, rx);
+		if (res < 0) {
+			return res;
+		}
+	}
+	return 0;
+#else
+	(void)fd;
+	(void)tx;
+	(void)rx;
+	return -ENOTSUP;
+#endif
+}
+
+// one receive or send, waiting for readiness or cancellation first
+static int socket_io_cancellable(int fd, int is_send, void *data, size_t length, int flags, uint64_t deadline, socket_cancel_t cancel)
+{
+	void *ctx = NULL;
+	const struct socket_transport *transport = socket_fd_transport(fd, &ctx);
+	int res;
+
+	if (transport) {
+		return socket_transport_io(fd, transport, ctx, is_send, data, length, flags, deadline, cancel);
+	}
+#ifdef MSG_DONTWAIT
+	flags |= MSG_DONTWAIT;
+#endif
+	while (1) {
+		res = socket_wait_cancellable(fd, (is_send) ? FDM_WRITE : FDM_READ, deadline, cancel);
+		if (res <= 0) {
+			return res;
+		}
+		if (is_send) {
+			res = socket_send_raw(fd, data, length, flags);
+		} else {
+			res = socket_receive_raw(fd, data, length, flags);
+			if (res == 0) {
+				SOCKET_ERR(3, "%s: fd=%d recv returned 0\n", __func__, fd);
+				return -ECONNRESET;
+			}
+		}
+		if (res != -EAGAIN && res != -EWOULDBLOCK && res != -EINTR) {
+			return res;
+		}
+	}
+}
+
+static int socket_io_cancellable_all(int fd, int is_send, void *data, size_t length, unsigned int timeout, socket_cancel_t cancel, size_t *done)
+{
+	uint64_t deadline = (timeout > 0) ? socket_time_ms() + timeout : 0;
+	size_t total = 0;
+	int res = 0;
+
+	while (total < length) {
+		size_t chunk = length - total;
+		if (chunk > INT_MAX) {
+			chunk = INT_MAX;
+		}
+		res = socket_io_cancellable(fd, is_send, (unsigned char*)data + total, chunk, 0, deadline, cancel);
+		if (res < 0) {
+			break;
+		}
+		total += (size_t)res;
+		res = 0;
+	}
+	if (done) {
+		*done = total;
+	}
+	return res;
+}
+
+int socket_receive_cancellable(int fd, void *data, size_t length, int flags, unsigned int timeout, socket_cancel_t cancel)
+{
+	return socket_io_cancellable(fd, 0, data, length, flags, (timeout > 0) ? socket_time_ms() + timeout : 0, cancel);
+}
+
+int socket_send_cancellable(int fd, const void *data, size_t length, unsigned int timeout, socket_cancel_t cancel)
+{
+	return socket_io_cancellable(fd, 1, (void*)data, length, 0, (timeout > 0) ? socket_time_ms() + timeout : 0, cancel);
+}
+
+int socket_receive_all_cancellable(int fd, void *data, size_t length, unsigned int timeout, socket_cancel_t cancel, size_t *received)
+{
+	return socket_io_cancellable_all(fd, 0, data, length, timeout, cancel, received);
+}
+
+int socket_send_all_cancellable(int fd, const void *data, size_t length, unsigned int timeout, socket_cancel_t cancel, size_t *sent)
+{
+	return socket_io_cancellable_all(fd, 1, (void*)data, length, timeout, cancel, sent);
+}
+
+int socket_receive(int fd, void *data, size_t length)
+{
+	return socket_receive_timeout(fd, data, length, 0, SOCKET_RECV_TIMEOUT);
+}
+
+int socket_peek(int fd, void *data, size_t length)
+{
+	return socket_receive_timeout(fd, data, length, MSG_PEEK, SOCKET_RECV_TIMEOUT);
+}
+
+int socket_set_io_flags(int fd, unsigned int flags)
+{
+	struct socket_fd_info *info = socket_fd_info_get(fd, 1);
+	if (!info) {
+		return (fd < 0) ? -EINVAL : -ENOMEM;
+	}
+	if ((flags & SOCKET_IO_STATS) && !ATOMIC_LOAD_PTR(&info->stats)) {
+		mutex_lock(&socket_fd_table_mutex);
+		if (!info->stats) {
+			struct socket_stats *st = (struct socket_stats*)calloc(1, sizeof(struct socket_stats));
+			if (!st) {
+				mutex_unlock(&socket_fd_table_mutex);
+				return -ENOMEM;
+			}
+			ATOMIC_STORE_PTR(&info->stats, st);
+		}
+		mutex_unlock(&socket_fd_table_mutex);
+	}
+	ATOMIC_STORE_RELAXED(&info->io_flags, flags);
+	return 0;
+}
+
+unsigned int socket_get_io_flags(int fd)
+{
+	return socket_fd_io_flags(fd);
+}
+
+void socket_set_stats_enabled(int enabled)
+{
+	ATOMIC_STORE_RELAXED(&socket_stats_enabled, (enabled) ? 1 : 0);
+}
+
+static struct socket_stats* socket_stats_select(int fd)
+{
+	if (fd == -1) {
+		return &socket_stats_global;
+	}
+	// a closed fd keeps its (zeroed) stats block, don't report it unless collection is on
+	return socket_stats_for_fd(fd);
+}
+
+int socket_get_stats(int fd, struct socket_stats *stats)
+{
+	struct socket_stats *st;
+	size_t i;
+
+	if (!stats || fd < -1) {
+		return -EINVAL;
+	}
+	st = socket_stats_select(fd);
+	if (!st) {
+		return -ENOENT;
+	}
+	// all members are uint64_t counters
+	for (i = 0; i < sizeof(struct socket_stats) / sizeof(uint64_t); i++) {
+		((uint64_t*)stats)[i] = ATOMIC_LOAD_RELAXED(&((uint64_t*)st)[i]);
+	}
+	return 0;
+}
+
+int socket_reset_stats(int fd)
+{
+	struct socket_stats *st;
+
+	if (fd < -1) {
+		return -EINVAL;
+	}
+	st = socket_stats_select(fd);
+	if (!st) {
+		return -ENOENT;
+	}
+	socket_stats_zero(st);
+	return 0;
+}
+
+int socket_receive_timeout(int fd, void *data, size_t length, int flags, unsigned int timeout)
+{
+	int res;
+	int result;
+	uint64_t stats_start;
+	void *ctx = NULL;
+	const struct socket_transport *transport = socket_fd_transport(fd, &ctx);
+
+	if (transport) {
+		return socket_transport_io(fd, transport, ctx, 0, data, length, flags, (timeout > 0) ? socket_time_ms() + timeout : 0, NULL);
+	}
+
+#ifdef MSG_DONTWAIT
+	if (socket_fd_io_flags(fd) & SOCKET_IO_OPTIMISTIC) {
+		// try to read right away, only wait for data if there is none yet
+		stats_start = SOCKET_STATS_BEGIN();
+		result = recv(fd, data, length, flags | MSG_DONTWAIT);
+		SOCKET_STATS_IO(fd, 0, result, (result > 0) ? result : 0, stats_start);
+		if (result > 0) {
+			return result;
+		}
+		if (result == 0) {
+			SOCKET_ERR(3, "%s: fd=%d recv returned 0\n", __func__, fd);
+			return -ECONNRESET;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			return -errno;
+		}
+	}
+#endif
+
+	// check if data is available
+	res = socket_check_fd(fd, FDM_READ, timeout);
+	if (res <= 0) {
+		return res;
+	}
+	// if we get here, there _is_ data available
+	stats_start = SOCKET_STATS_BEGIN();
+	result = recv(fd, data, length, flags);
+	SOCKET_STATS_IO(fd, 0, result, (result > 0) ? result : 0, stats_start);
+	if (result == 0) {
+		// but this is an error condition
+		SOCKET_ERR(3, "%s: fd=%d recv returned 0\n", __func__, fd);
+		return -ECONNRESET;
+	}
+	if (result < 0) {
+#ifdef _WIN32
+		errno = WSAError_to_errno(WSAGetLastError());
+#endif
+		return -errno;
+	}
+	return result;
+}
+
+int socket_send(int fd, const void *data, size_t length)
+{
+	int flags = 0;
+	int s;
+	uint64_t stats_start;
+	void *ctx = NULL;
+	const struct socket_transport *transport = socket_fd_transport(fd, &ctx);
+
+	if (transport) {
+		return socket_transport_io(fd, transport, ctx, 1, (void*)data, length, 0, socket_send_deadline(), NULL);
+	}
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+#ifdef MSG_DONTWAIT
+	if (socket_fd_io_flags(fd) & SOCKET_IO_OPTIMISTIC) {
+		// try to send right away, only wait for buffer space if there is none
+		stats_start = SOCKET_STATS_BEGIN();
+		s = (int)send(fd, data, length, flags | MSG_DONTWAIT);
+		SOCKET_STATS_IO(fd, 1, s, (s > 0) ? s : 0, stats_start);
+		if (s >= 0) {
+			return s;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			return -errno;
+		}
+	}
+#endif
+	int res = socket_check_fd(fd, FDM_WRITE, SOCKET_SEND_TIMEOUT);
+	if (res <= 0) {
+		return res;
+	}
+	stats_start = SOCKET_STATS_BEGIN();
+	s = (int)send(fd, data, length, flags);
+	SOCKET_STATS_IO(fd, 1, s, (s > 0) ? s : 0, stats_start);
+	if (s < 0) {
+#ifdef _WIN32
+		errno = WSAError_to_errno(WSAGetLastError());
+#endif
+		return -errno;
+	}
+	return s;
+}
+
+static int socket_receivev_raw(int fd, struct iovec *iov, int iovcnt, int flags)
+{
+#ifdef _WIN32
+	int i;
+	WSABUF bufs[SOCKET_IOV_CHUNK];
+	DWORD received = 0;
+	DWORD wflags = (DWORD)flags;
+	if (iovcnt > SOCKET_IOV_CHUNK) {
+		iovcnt = SOCKET_IOV_CHUNK;
+	}
+	for (i = 0; i < iovcnt; i++) {
+		bufs[i].buf = (CHAR*)iov[i].iov_base;
+		bufs[i].len = (ULONG)iov[i].iov_len;
+	}
+	uint64_t stats_start = SOCKET_STATS_BEGIN();
+	int r = WSARecv(fd, bufs, (DWORD)iovcnt, &received, &wflags, NULL, NULL);
+	SOCKET_STATS_IO(fd, 0, (r == SOCKET_ERROR) ? -1 : (int)received, (r == SOCKET_ERROR) ? 0 : received, stats_start);
+	if (r == SOCKET_ERROR) {
+		errno = WSAError_to_errno(WSAGetLastError());
+		return -errno;
+	}
+	return (int)received;
+#else
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+#ifdef IOV_MAX
+	if (iovcnt > IOV_MAX) {
+		iovcnt = IOV_MAX;
+	}
+#endif
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	uint64_t stats_start = SOCKET_STATS_BEGIN();
+	ssize_t r = recvmsg(fd, &msg, flags);
+	SOCKET_STATS_IO(fd, 0, r, (r > 0) ? r : 0, stats_start);
+	if (r < 0) {
+		return -errno;
+	}
+	return (int)r;
+#endif
+}
+
+static int socket_sendv_raw(int fd, const struct iovec *iov, int iovcnt, int flags)
+{
+#ifdef _WIN32
+	int i;
+	WSABUF bufs[SOCKET_IOV_CHUNK];
+	DWORD sent = 0;
+	if (iovcnt > SOCKET_IOV_CHUNK) {
+		iovcnt = SOCKET_IOV_CHUNK;
+	}
+	for (i = 0; i < iovcnt; i++) {
+		bufs[i].buf = (CHAR*)iov[i].iov_base;
+		bufs[i].len = (ULONG)iov[i].iov_len;
+	}
+	uint64_t stats_start = SOCKET_STATS_BEGIN();
+	int r = WSASend(fd, bufs, (DWORD)iovcnt, &sent, 0, NULL, NULL);
+	SOCKET_STATS_IO(fd, 1, (r == SOCKET_ERROR) ? -1 : (int)sent, (r == SOCKET_ERROR) ? 0 : sent, stats_start);
+	if (r == SOCKET_ERROR) {
+		errno = WSAError_to_errno(WSAGetLastError());
+		return -errno;
+	}
+	return (int)sent;
+#else
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+#ifdef IOV_MAX
+	if (iovcnt > IOV_MAX) {
+		iovcnt = IOV_MAX;
+	}
+#endif
+	msg.msg_iov = (struct iovec*)iov;
+	msg.msg_iovlen = iovcnt;
+	uint64_t stats_start = SOCKET_STATS_BEGIN();
+	ssize_t s = sendmsg(fd, &msg, flags);
+	SOCKET_STATS_IO(fd, 1, s, (s > 0) ? s : 0, stats_start);
+	if (s < 0) {
+		return -errno;
+	}
+	return (int)s;
+#endif
+}
+
+int socket_receivev(int fd, struct iovec *iov, int iovcnt)
+{
+	return socket_receivev_timeout(fd, iov, iovcnt, 0, SOCKET_RECV_TIMEOUT);
+}
+
+// transports work on flat buffers, so vectored I/O only uses the first non-empty element
+static struct iovec* socket_iov_first(const struct iovec *iov, int iovcnt)
+{
+	int i;
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > 0) {
+			return (struct iovec*)&iov[i];
+		}
+	}
+	return NULL;
+}
+
+int socket_receivev_timeout(int fd, struct iovec *iov, int iovcnt, int flags, unsigned int timeout)
+{
+	int res;
+	int result;
+	void *ctx = NULL;
+	const struct socket_transport *transport = socket_fd_transport(fd, &ctx);
+
+	if (!iov || iovcnt <= 0) {
+		return -EINVAL;
+	}
+	if (transport) {
+		struct iovec *first = socket_iov_first(iov, iovcnt);
+		if (!first) {
+			return 0;
+		}
+		return socket_transport_io(fd, transport, ctx, 0, first->iov_base, first->iov_len, flags, (timeout > 0) ? socket_time_ms() + timeout : 0, NULL);
+	}
+
+#ifdef MSG_DONTWAIT
+	if (socket_fd_io_flags(fd) & SOCKET_IO_OPTIMISTIC) {
+		result = socket_receivev_raw(fd, iov, iovcnt, flags | MSG_DONTWAIT);
+		if (result > 0) {
+			return result;
+		}
+		if (result == 0) {
+			SOCKET_ERR(3, "%s: fd=%d recvmsg returned 0\n", __func__, fd);
+			return -ECONNRESET;
+		}
+		if (result != -EAGAIN && result != -EWOULDBLOCK && result != -EINTR) {
+			return result;
+		}
+	}
+#endif
+
+	res = socket_check_fd(fd, FDM_READ, timeout);
+	if (res <= 0) {
+		return res;
+	}
+	result = socket_receivev_raw(fd, iov, iovcnt, flags);
+	if (result == 0) {
+		SOCKET_ERR(3, "%s: fd=%d recvmsg returned 0\n", __func__, fd);
+		return -ECONNRESET;
+	}
+	return result;
+}
+
+int socket_sendv(int fd, const struct iovec *iov, int iovcnt)
+{
+	int flags = 0;
+	int s;
+	void *ctx = NULL;
+	const struct socket_transport *transport = socket_fd_transport(fd, &ctx);
+
+	if (!iov || iovcnt <= 0) {
+		return -EINVAL;
+	}
+	if (transport) {
+		struct iovec *first = socket_iov_first(iov, iovcnt);
+		if (!first) {
+			return 0;
+		}
+		return socket_transport_io(fd, transport, ctx, 1, first->iov_base, first->iov_len, 0, socket_send_deadline(), NULL);
+	}
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+#ifdef MSG_DONTWAIT
+	if (socket_fd_io_flags(fd) & SOCKET_IO_OPTIMISTIC) {
+		s = socket_sendv_raw(fd, iov, iovcnt, flags | MSG_DONTWAIT);
+		if (s >= 0 || (s != -EAGAIN && s != -EWOULDBLOCK && s != -EINTR)) {
+			return s;
+		}
+	}
+#endif
+	int res = socket_check_fd(fd, FDM_WRITE, SOCKET_SEND_TIMEOUT);
+	if (res <= 0) {
+		return res;
+	}
+	s = socket_sendv_raw(fd, iov, iovcnt, flags);
+	return s;
+}
+
+int socket_sendv_all(int fd, const struct iovec *iov, int iovcnt, unsigned int timeout, size_t *sent)
+{
+	struct iovec chunk[SOCKET_IOV_CHUNK];
+	size_t total = 0;
+	size_t offset = 0;
+	int idx = 0;
+	int flags = 0;
+	int res = 0;
+	uint64_t deadline = (timeout > 0) ? socket_time_ms() + timeout : 0;
+#ifdef MSG_DONTWAIT
+	// send right away and only wait for buffer space when the kernel is full
+	int always_poll = 0;
+	flags |= MSG_DONTWAIT;
+#else
+	int always_poll = 1;
+#endif
+	int need_poll = always_poll;
+	void *ctx = NULL;
+	const struct socket_transport *transport = socket_fd_transport(fd, &ctx);
+
+	if (sent) {
+		*sent = 0;
+	}
+	if (!iov || iovcnt < 0) {
+		return -EINVAL;
+	}
+	if (transport) {
+		for (idx = 0; idx < iovcnt && res == 0; idx++) {
+			size_t done = 0;
+			res = socket_transport_io_all(fd, transport, ctx, 1, iov[idx].iov_base, iov[idx].iov_len, deadline, &done);
+			total += done;
+		}
+		if (sent) {
+			*sent = total;
+		}
+		return res;
+	}
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+
+	while (1) {
+		// skip over what has been sent already
+		while (idx < iovcnt && offset >= iov[idx].iov_len) {
+			idx++;
+			offset = 0;
+		}
+		if (idx >= iovcnt) {
+			break;
+		}
+
+		int n = 1;
+		int i;
+		chunk[0].iov_base = (char*)iov[idx].iov_base + offset;
+		chunk[0].iov_len = iov[idx].iov_len - offset;
+		for (i = idx + 1; i < iovcnt && n < SOCKET_IOV_CHUNK; i++) {
+			chunk[n++] = iov[i];
+		}
+
+		if (need_poll) {
+			unsigned int remaining = 0;
+			res = socket_deadline_remaining(deadline, &remaining);
+			if (res < 0) {
+				break;
+			}
+			res = socket_check_fd(fd, FDM_WRITE, remaining);
+			if (res <= 0) {
+				break;
+			}
+			res = 0;
+		}
+
+		int s = socket_sendv_raw(fd, chunk, n, flags);
+		if (s < 0) {
+			if (s == -EAGAIN || s == -EWOULDBLOCK) {
+				need_poll = 1;
+				continue;
+			}
+			if (s == -EINTR) {
+				continue;
+			}
+			res = s;
+			break;
+		}
+		need_poll = always_poll;
+
+		total += (size_t)s;
+		size_t left = (size_t)s;
+		while (left > 0) {
+			size_t avail = iov[idx].iov_len - offset;
+			if (left >= avail) {
+				left -= avail;
+				idx++;
+				offset = 0;
+			} else {
+				offset += left;
+				left = 0;
+			}
+		}
+	}
+
+	if (sent) {
+		*sent = total;
+	}
+	return res;
+}
+
+int socket_send_all(int fd, const void *data, size_t length, unsigned int timeout, size_t *sent)
+{
+	struct iovec iov;
+	void *ctx = NULL;
+	const struct socket_transport *transport = socket_fd_transport(fd, &ctx);
+
+	if (transport) {
+		return socket_transport_io_all(fd, transport, ctx, 1, (void*)data, length, (timeout > 0) ? socket_time_ms() + timeout : 0, sent);
+	}
+	iov.iov_base = (void*)data;
+	iov.iov_len = length;
+	return socket_sendv_all(fd, &iov, 1, timeout, sent);
+}
+
+int socket_receive_all(int fd, void *data, size_t length, unsigned int timeout, size_t *received)
+{
+	size_t total = 0;
+	int flags = 0;
+	int res = 0;
+	uint64_t deadline = (timeout > 0) ? socket_time_ms() + timeout : 0;
+#ifdef MSG_DONTWAIT
+	// read what is there already and only wait when the kernel buffer is empty
+	int always_poll = 0;
+	flags |= MSG_DONTWAIT;
+#else
+	int always_poll = 1;
+#endif
+	int need_poll = always_poll;
+	void *ctx = NULL;
+	const struct socket_transport *transport = socket_fd_transport(fd, &ctx);
+
+	if (received) {
+		*received = 0;
+	}
+	if (!data && length > 0) {
+		return -EINVAL;
+	}
+	if (transport) {
+		return socket_transport_io_all(fd, transport, ctx, 0, data, length, deadline, received);
+	}
+
+	while (total < length) {
+		if (need_poll) {
+			unsigned int remaining = 0;
+			res = socket_deadline_remaining(deadline, &remaining);
+			if (res < 0) {
+				break;
+			}
+			res = socket_check_fd(fd, FDM_READ, remaining);
+			if (res <= 0) {
+				break;
+			}
+			res = 0;
+		}
+
+		size_t chunk = length - total;
+		if (chunk > INT_MAX) {
+			chunk = INT_MAX;
+		}
+		uint64_t stats_start = SOCKET_STATS_BEGIN();
+		int r = (int)recv(fd, (char*)data + total, chunk, flags);
+		SOCKET_STATS_IO(fd, 0, r, (r > 0) ? r : 0, stats_start);
+		if (r == 0) {
+			SOCKET_ERR(3, "%s: fd=%d recv returned 0\n", __func__, fd);
+			res = -ECONNRESET;
+			break;
+		}
+		if (r < 0) {
+#ifdef _WIN32
+			errno = WSAError_to_errno(WSAGetLastError());
+#endif
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				need_poll = 1;
+				continue;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			res = -errno;
+			break;
+		}
+		need_poll = always_poll;
+		total += (size_t)r;
+	}
+
+	if (received) {
+		*received = total;
+	}
+	return res;
+}
+
+static socklen_t socket_sockaddr_len(const struct sockaddr *addr)
+{
+	switch (addr->sa_family) {
+		case AF_INET:
+			return sizeof(struct sockaddr_in);
+#ifdef AF_INET6
+		case AF_INET6:
+			return sizeof(struct sockaddr_in6);
+#endif
+#ifndef _WIN32
+		case AF_UNIX:
+			return sizeof(struct sockaddr_un);
+#endif
+		default:
+			return sizeof(struct sockaddr_storage);
+	}
+}
+
+int socket_receive_batch(int fd, struct socket_msg *msgs, unsigned int count, unsigned int timeout)
+{
+	unsigned int done = 0;
+	uint64_t deadline = (timeout > 0) ? socket_time_ms() + timeout : 0;
+	int res;
+
+	if (!msgs || count == 0) {
+		return -EINVAL;
+	}
+
+	while (1) {
+		unsigned int remaining = 0;
+		res = socket_deadline_remaining(deadline, &remaining);
+		if (res < 0) {
+			return res;
+		}
+		res = socket_check_fd(fd, FDM_READ, remaining);
+		if (res <= 0) {
+			return res;
+		}
+
+		// fetch everything that is queued, without blocking
+		while (done < count) {
+#ifdef HAVE_RECVMMSG
+			struct mmsghdr hdrs[SOCKET_BATCH_CHUNK];
+			struct iovec iovs[SOCKET_BATCH_CHUNK];
+			unsigned int n = count - done;
+			unsigned int i;
+			if (n > SOCKET_BATCH_CHUNK) {
+				n = SOCKET_BATCH_CHUNK;
+			}
+			memset(hdrs, 0, sizeof(struct mmsghdr) * n);
+			for (i = 0; i < n; i++) {
+				struct socket_msg *msg = &msgs[done + i];
+				iovs[i].iov_base = msg->data;
+				iovs[i].iov_len = msg->length;
+				hdrs[i].msg_hdr.msg_iov = &iovs[i];
+				hdrs[i].msg_hdr.msg_iovlen = 1;
+				if (msg->addr) {
+					hdrs[i].msg_hdr.msg_name = msg->addr;
+					hdrs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+				}
+			}
+			uint64_t stats_start = SOCKET_STATS_BEGIN();
+			int r = recvmmsg(fd, hdrs, n, MSG_DONTWAIT, NULL);
+			if (stats_start) {
+				uint64_t bytes = 0;
+				for (i = 0; r > 0 && i < (unsigned int)r; i++) {
+					bytes += hdrs[i].msg_len;
+				}
+				socket_stats_io(fd, 0, r, bytes, stats_start);
+			}
+			if (r < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				if (errno == EAGAIN || errno == EWOULDBLOCK || done > 0) {
+					break;
+				}
+				return -errno;
+			}
+			for (i = 0; i < (unsigned int)r; i++) {
+				struct socket_msg *msg = &msgs[done + i];
+				msg->transferred = hdrs[i].msg_len;
+				msg->addr_len = (msg->addr) ? hdrs[i].msg_hdr.msg_namelen : 0;
+				msg->flags = hdrs[i].msg_hdr.msg_flags;
+			}
+			done += r;
+			if ((unsigned int)r < n) {
+				break;
+			}
+#else
+			struct socket_msg *msg = &msgs[done];
+			socklen_t addr_len = sizeof(struct sockaddr_storage);
+			int flags = 0;
+#ifdef MSG_DONTWAIT
+			flags |= MSG_DONTWAIT;
+#else
+			if (done > 0 && poll_wrapper(fd, FDM_READ, 0) != poll_status_success) {
+				break;
+			}
+#endif
+			uint64_t stats_start = SOCKET_STATS_BEGIN();
+#ifdef _WIN32
+			int msg_flags = 0;
+			int r = (int)recvfrom(fd, msg->data, msg->length, flags, (struct sockaddr*)msg->addr, (msg->addr) ? &addr_len : NULL);
+#else
+			struct msghdr mh;
+			struct iovec iov;
+			memset(&mh, 0, sizeof(mh));
+			iov.iov_base = msg->data;
+			iov.iov_len = msg->length;
+			mh.msg_iov = &iov;
+			mh.msg_iovlen = 1;
+			mh.msg_name = msg->addr;
+			mh.msg_namelen = (msg->addr) ? addr_len : 0;
+			int r = (int)recvmsg(fd, &mh, flags);
+			int msg_flags = mh.msg_flags;
+			addr_len = mh.msg_namelen;
+#endif
+			SOCKET_STATS_IO(fd, 0, r, (r > 0) ? r : 0, stats_start);
+			if (r < 0) {
+#ifdef _WIN32
+				errno = WSAError_to_errno(WSAGetLastError());
+				if (errno == EMSGSIZE) {
+					// the datagram was truncated to the buffer size
+					msg->transferred = msg->length;
+					msg->addr_len = (msg->addr) ? (unsigned int)addr_len : 0;
+					msg->flags = MSG_PARTIAL;
+					done++;
+					continue;
+				}
+#endif
+				if (errno == EINTR) {
+					continue;
+				}
+				if (errno == EAGAIN || errno == EWOULDBLOCK || done > 0) {
+					break;
+				}
+				return -errno;
+			}
+			msg->transferred = (size_t)r;
+			msg->addr_len = (msg->addr) ? (unsigned int)addr_len : 0;
+			msg->flags = msg_flags;
+			done++;
+#endif
+		}
+
+		if (done > 0) {
+			break;
+		}
+		// readiness was spurious, wait again
+	}
+
+	return (int)done;
+}
+
+int socket_send_batch(int fd, struct socket_msg *msgs, unsigned int count, unsigned int timeout)
+{
+	unsigned int done = 0;
+	uint64_t deadline = (timeout > 0) ? socket_time_ms() + timeout : 0;
+	int flags = 0;
+	int res;
+
+	if (!msgs || count == 0) {
+		return -EINVAL;
+	}
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+
+	while (done < count) {
+		unsigned int remaining = 0;
+		res = socket_deadline_remaining(deadline, &remaining);
+		if (res < 0) {
+			break;
+		}
+		res = socket_check_fd(fd, FDM_WRITE, remaining);
+		if (res <= 0) {
+			break;
+		}
+		res = 0;
+
+#ifdef HAVE_SENDMMSG
+		struct mmsghdr hdrs[SOCKET_BATCH_CHUNK];
+		struct iovec iovs[SOCKET_BATCH_CHUNK];
+		unsigned int n = count - done;
+		unsigned int i;
+		if (n > SOCKET_BATCH_CHUNK) {
+			n = SOCKET_BATCH_CHUNK;
+		}
+		memset(hdrs, 0, sizeof(struct mmsghdr) * n);
+		for (i = 0; i < n; i++) {
+			struct socket_msg *msg = &msgs[done + i];
+			iovs[i].iov_base = msg->data;
+			iovs[i].iov_len = msg->length;
+			hdrs[i].msg_hdr.msg_iov = &iovs[i];
+			hdrs[i].msg_hdr.msg_iovlen = 1;
+			if (msg->addr) {
+				hdrs[i].msg_hdr.msg_name = msg->addr;
+				hdrs[i].msg_hdr.msg_namelen = (msg->addr_len) ? msg->addr_len : socket_sockaddr_len((struct sockaddr*)msg->addr);
+			}
+		}
+		uint64_t stats_start = SOCKET_STATS_BEGIN();
+		int s = sendmmsg(fd, hdrs, n, flags | MSG_DONTWAIT);
+		if (stats_start) {
+			uint64_t bytes = 0;
+			for (i = 0; s > 0 && i < (unsigned int)s; i++) {
+				bytes += hdrs[i].msg_len;
+			}
+			socket_stats_io(fd, 1, s, bytes, stats_start);
+		}
+		if (s < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				continue;
+			}
+			res = -errno;
+			break;
+		}
+		for (i = 0; i < (unsigned int)s; i++) {
+			msgs[done + i].transferred = hdrs[i].msg_len;
+		}
+		done += s;
+#else
+		struct socket_msg *msg = &msgs[done];
+		socklen_t addr_len = 0;
+		if (msg->addr) {
+			addr_len = (msg->addr_len) ? (socklen_t)msg->addr_len : socket_sockaddr_len((struct sockaddr*)msg->addr);
+		}
+		uint64_t stats_start = SOCKET_STATS_BEGIN();
+		int s = (int)sendto(fd, msg->data, msg->length, flags, (struct sockaddr*)msg->addr, addr_len);
+		SOCKET_STATS_IO(fd, 1, s, (s > 0) ? s : 0, stats_start);
+		if (s < 0) {
+#ifdef _WIN32
+			errno = WSAError_to_errno(WSAGetLastError());
+#endif
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				continue;
+			}
+			res = -errno;
+			break;
+		}
+		msg->transferred = (size_t)s;
+		done++;
+#endif
+	}
+
+	if (done == 0 && res < 0) {
+		return res;
+	}
+	return (int)done;
+}
+
+static int64_t socket_file_read_at(int file_fd, void *buf, size_t length, uint64_t offset)
+{
+#ifdef _WIN32
+	if (_lseeki64(file_fd, (__int64)offset, SEEK_SET) < 0) {
+		return -errno;
+	}
+	int r = _read(file_fd, buf, (unsigned int)length);
+#else
+	ssize_t r = pread(file_fd, buf, length, (off_t)offset);
+#endif
+	if (r < 0) {
+		return -errno;
+	}
+	return r;
+}
+
+int socket_send_file(int fd, int file_fd, uint64_t offset, uint64_t length, unsigned int timeout, uint64_t *sent)
+{
+	uint64_t total = 0;
+	uint64_t deadline = (timeout > 0) ? socket_time_ms() + timeout : 0;
+	int res = 0;
+
+	if (sent) {
+		*sent = 0;
+	}
+	if (fd < 0 || file_fd < 0) {
+		return -EINVAL;
+	}
+
+	if (length == 0) {
+		// send until the end of the file
+		struct stat fst;
+		if (fstat(file_fd, &fst) != 0) {
+			return -errno;
+		}
+		if ((uint64_t)fst.st_size <= offset) {
+			return 0;
+		}
+		length = (uint64_t)fst.st_size - offset;
+	}
+
+#if defined(__linux__) && defined(HAVE_SYS_SENDFILE_H)
+	// let the kernel copy straight from the page cache to the socket, unless a transport
+	// is installed which has to see the data (use the read/send fallback below then)
+	int use_sendfile = (socket_fd_transport(fd, NULL) == NULL);
+	size_t max_chunk = SOCKET_SENDFILE_CHUNK;
+	if (use_sendfile && deadline) {
+		// on a blocking fd sendfile() waits until the whole chunk is queued, so keep chunks
+		// within what the send buffer can take (half of SO_SNDBUF, the rest is bookkeeping
+		// overhead) and wait for writability with the remaining time before each of them
+		int sndbuf = 0;
+		socklen_t optlen = sizeof(sndbuf);
+		if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, (void*)&sndbuf, &optlen) == 0 && sndbuf > 1 && (size_t)sndbuf / 2 < max_chunk) {
+			max_chunk = (size_t)sndbuf / 2;
+		}
+	}
+	while (use_sendfile && total < length) {
+		off_t off = (off_t)(offset + total);
+		size_t chunk = (length - total > max_chunk) ? max_chunk : (size_t)(length - total);
+		if (deadline) {
+			unsigned int remaining = 0;
+			res = socket_deadline_remaining(deadline, &remaining);
+			if (res < 0) {
+				break;
+			}
+			res = socket_check_fd(fd, FDM_WRITE, remaining);
+			if (res <= 0) {
+				break;
+			}
+			res = 0;
+		}
+		uint64_t stats_start = SOCKET_STATS_BEGIN();
+		ssize_t s = sendfile(fd, file_fd, &off, chunk);
+		SOCKET_STATS_IO(fd, 1, s, (s > 0) ? s : 0, stats_start);
+		if (s > 0) {
+			total += (uint64_t)s;
+			continue;
+		}
+		if (s == 0) {
+			SOCKET_ERR(2, "%s: unexpected end of file at offset %llu\n", __func__, (unsigned long long)(offset + total));
+			res = -EIO;
+			break;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			unsigned int remaining = 0;
+			res = socket_deadline_remaining(deadline, &remaining);
+			if (res < 0) {
+				break;
+			}
+			res = socket_check_fd(fd, FDM_WRITE, remaining);
+			if (res <= 0) {
+				break;
+			}
+			res = 0;
+			continue;
+		}
+		if (errno == EINVAL || errno == ENOSYS) {
+			// file type not supported by sendfile(), use the fallback below
+			SOCKET_ERR(3, "%s: sendfile: %s, falling back to read/send\n", __func__, strerror(errno));
+			break;
+		}
+		res = -errno;
+		break;
+	}
+	if (res < 0 || total >= length) {
+		if (sent) {
+			*sent = total;
+		}
+		return (res < 0) ? res : 0;
+	}
+#endif
+
+	unsigned char *buf = (unsigned char*)malloc(SOCKET_FILE_BUFFER_SIZE);
+	if (!buf) {
+		if (sent) {
+			*sent = total;
+		}
+		return -ENOMEM;
+	}
+	while (total < length) {
+		size_t chunk = (length - total > SOCKET_FILE_BUFFER_SIZE) ? SOCKET_FILE_BUFFER_SIZE : (size_t)(length - total);
+		int64_t r = socket_file_read_at(file_fd, buf, chunk, offset + total);
+		if (r < 0) {
+			if (r == -EINTR) {
+				continue;
+			}
+			res = (int)r;
+			break;
+		}
+		if (r == 0) {
+			SOCKET_ERR(2, "%s: unexpected end of file at offset %llu\n", __func__, (unsigned long long)(offset + total));
+			res = -EIO;
+			break;
+		}
+		unsigned int remaining = 0;
+		res = socket_deadline_remaining(deadline, &remaining);
+		if (res < 0) {
+			break;
+		}
+		size_t n = 0;
+		res = socket_send_all(fd, buf, (size_t)r, remaining, &n);
+		total += n;
+		if (res < 0) {
+			break;
+		}
+	}
+	free(buf);
+
+	if (sent) {
+		*sent = total;
+	}
+	return res;
+}
+
+int socket_send_file_path(int fd, const char *path, uint64_t offset, uint64_t length, unsigned int timeout, uint64_t *sent)
+{
+	if (sent) {
+		*sent = 0;
+	}
+	if (!path) {
+		return -EINVAL;
+	}
+	int file_fd = open(path, O_RDONLY | O_BINARY);
+	if (file_fd < 0) {
+		int err = errno;
+		SOCKET_ERR(2, "%s: open '%s': %s\n", __func__, path, strerror(err));
+		return -err;
+	}
+	int res = socket_send_file(fd, file_fd, offset, length, timeout, sent);
+	close(file_fd);
+	return res;
+}
+
+int socket_get_socket_port(int fd, uint16_t *port)
+{
+#ifdef _WIN32
+	int addr_len;
+#else
+	socklen_t addr_len;
+#endif
+	struct sockaddr_storage addr;
+
+	memset(&addr, 0, sizeof(addr));
+
+	addr_len = sizeof(addr);
+	if (0 > getsockname(fd, (struct sockaddr*)&addr, &addr_len)) {
+#ifdef _WIN32
+		errno = WSAError_to_errno(WSAGetLastError());
+#endif
+		return -1;
+	}
+
+	if (addr.ss_family == AF_INET) {
+		*port = ntohs(((struct sockaddr_in*)&addr)->sin_port);
+	}
+#ifdef AF_INET6
+	else if (addr.ss_family == AF_INET6) {
+		*port = ntohs(((struct sockaddr_in6*)&addr)->sin6_port);
+	}
+#endif
+	else {
+		errno = EAFNOSUPPORT;
+		return -1;
+	}
+	return 0;
+}
+
+static int socket_get_addr(int fd, int peer, struct sockaddr_storage *addr, unsigned int *addr_len)
+{
+#ifdef _WIN32
+	int len;
+#else
+	socklen_t len;
+#endif
+	int res;
+
+	if (fd < 0 || !addr) {
+		return -EINVAL;
+	}
+	memset(addr, 0, sizeof(struct sockaddr_storage));
+	len = sizeof(struct sockaddr_storage);
+	if (peer) {
+		res = getpeername(fd, (struct sockaddr*)addr, &len);
+	} else {
+		res = getsockname(fd, (struct sockaddr*)addr, &len);
+	}
+	if (res < 0) {
+#ifdef _WIN32
+		errno = WSAError_to_errno(WSAGetLastError());
+#endif
+		return -errno;
+	}
+	if (addr_len) {
+		*addr_len = (unsigned int)len;
+	}
+	return 0;
+}
+
+int socket_get_local_addr(int fd, struct sockaddr_storage *addr, unsigned int *addr_len)
+{
+	return socket_get_addr(fd, 0, addr, addr_len);
+}
+
+int socket_get_peer_addr(int fd, struct sockaddr_storage *addr, unsigned int *addr_len)
+{
+	return socket_get_addr(fd, 1, addr, addr_len);
+}
+
+/*
+ * Hierarchical timer wheel with 1ms ticks. The first level has one slot per
+ * tick for the next 256ms, every further level covers 64 slots of the whole
+ * previous level, so starting or stopping a timer is O(1) no matter how
+ * many are pending. Timers on the higher levels are moved down ("cascaded")
+ * when the lower level wraps around.
+ */
+#define SOCKET_TIMER_L0_BITS 8
+#define SOCKET_TIMER_LN_BITS 6
+#define SOCKET_TIMER_LEVELS 4
+#define SOCKET_TIMER_L0_SIZE (1 << SOCKET_TIMER_L0_BITS)
+#define SOCKET_TIMER_LN_SIZE (1 << SOCKET_TIMER_LN_BITS)
+#define SOCKET_TIMER_LN_MASK (SOCKET_TIMER_LN_SIZE - 1)
+#define SOCKET_TIMER_SHIFT(level) (SOCKET_TIMER_L0_BITS + ((level) - 1) * SOCKET_TIMER_LN_BITS)
+#define SOCKET_TIMER_MAX_DELTA ((1ULL << SOCKET_TIMER_SHIFT(SOCKET_TIMER_LEVELS)) - 1)
+
+struct socket_timer {
+	struct socket_timer *next;
+	struct socket_timer **pprev;
+	uint64_t expires;
+	socket_timer_wheel_t wheel;
+	socket_timer_cb_t callback;
+	void *user_data;
+};
+
+struct socket_timer_wheel {
+	uint64_t now;                /* next tick to process */
+	unsigned int count;
+	struct socket_timer *l0[SOCKET_TIMER_L0_SIZE];
+	struct socket_timer *ln[SOCKET_TIMER_LEVELS - 1][SOCKET_TIMER_LN_SIZE];
+};
+
+static void socket_timer_init(struct socket_timer *timer, socket_timer_wheel_t wheel, socket_timer_cb_t callback, void *user_data)
+{
+	memset(timer, 0, sizeof(struct socket_timer));
+	timer->wheel = wheel;
+	timer->callback = callback;
+	timer->user_data = user_data;
+}
+
+static void socket_timer_unlink(struct socket_timer *timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next) {
+		timer->next->pprev = timer->pprev;
+	}
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+static void socket_timer_link(socket_timer_wheel_t wheel, struct socket_timer *timer)
+{
+	struct socket_timer **slot;
+	uint64_t expires = timer->expires;
+	uint64_t delta;
+	int level;
+
+	if (expires < wheel->now) {
+		expires = wheel->now;
+	}
+	delta = expires - wheel->now;
+	if (delta < SOCKET_TIMER_L0_SIZE) {
+		slot = &wheel->l0[expires & (SOCKET_TIMER_L0_SIZE - 1)];
+	} else {
+		if (delta > SOCKET_TIMER_MAX_DELTA) {
+			// re-linked with its real expiry time when cascaded
+			expires = wheel->now + SOCKET_TIMER_MAX_DELTA;
+		}
+		for (level = 1; level < SOCKET_TIMER_LEVELS - 1; level++) {
+			if (delta < (1ULL << SOCKET_TIMER_SHIFT(level + 1))) {
+				break;
+			}
+		}
+		slot = &wheel->ln[level - 1][(expires >> SOCKET_TIMER_SHIFT(level)) & SOCKET_TIMER_LN_MASK];
+	}
+	timer->next = *slot;
+	if (timer->next) {
+		timer->next->pprev = &timer->next;
+	}
+	timer->pprev = slot;
+	*slot = timer;
+}
+
+// move the timers of the current slot of level one level down
+static int socket_timer_cascade(socket_timer_wheel_t wheel, int level)
+{
+	unsigned int index = (unsigned int)(wheel->now >> SOCKET_TIMER_SHIFT(level)) & SOCKET_TIMER_LN_MASK;
+	struct socket_timer *timer = wheel->ln[level - 1][index];
+	wheel->ln[level - 1][index] = NULL;
+	while (timer) {
+		struct socket_timer *next = timer->next;
+		socket_timer_link(wheel, timer);
+		timer = next;
+	}
+	return index;
+}
+
+socket_timer_wheel_t socket_timer_wheel_new(void)
+{
+	socket_timer_wheel_t wheel = (socket_timer_wheel_t)calloc(1, sizeof(struct socket_timer_wheel));
+	if (!wheel) {
+		return NULL;
+	}
+	wheel->now = socket_time_ms();
+	return wheel;
+}
+
+void socket_timer_wheel_free(socket_timer_wheel_t wheel)
+{
+	free(wheel);
+}
+
+int socket_timer_wheel_next_timeout(socket_timer_wheel_t wheel)
+{
+	uint64_t now;
+	uint64_t next;
+	unsigned int i;
+	unsigned int until_cascade;
+
+	if (!wheel || wheel->count == 0) {
+		return -1;
+	}
+	// only look up to the next cascade, which might bring in earlier timers
+	until_cascade = (unsigned int)(-wheel->now & (SOCKET_TIMER_L0_SIZE - 1));
+	for (i = 0; i < until_cascade; i++) {
+		if (wheel->l0[(wheel->now + i) & (SOCKET_TIMER_L0_SIZE - 1)]) {
+			break;
+		}
+	}
+	next = wheel->now + i;
+	now = socket_time_ms();
+	if (next <= now) {
+		return 0;
+	}
+	return (next - now > INT_MAX) ? INT_MAX : (int)(next - now);
+}
+
+int socket_timer_wheel_advance(socket_timer_wheel_t wheel)
+{
+	uint64_t now;
+	int count = 0;
+
+	if (!wheel) {
+		return -EINVAL;
+	}
+	now = socket_time_ms();
+	while (wheel->now <= now) {
+		struct socket_timer *list;
+		struct socket_timer *timer;
+		if (wheel->count == 0) {
+			wheel->now = now + 1;
+			break;
+		}
+		if ((wheel->now & (SOCKET_TIMER_L0_SIZE - 1)) == 0) {
+			int level;
+			for (level = 1; level < SOCKET_TIMER_LEVELS; level++) {
+				if (socket_timer_cascade(wheel, level) != 0) {
+					break;
+				}
+			}
+		}
+		list = wheel->l0[wheel->now & (SOCKET_TIMER_L0_SIZE - 1)];
+		wheel->l0[wheel->now & (SOCKET_TIMER_L0_SIZE - 1)] = NULL;
+		// timers (re)started from the callbacks land in later slots
+		wheel->now++;
+		if (list) {
+			list->pprev = &list;
+		}
+		while ((timer = list) != NULL) {
+			socket_timer_unlink(timer);
+			wheel->count--;
+			timer->callback(timer, timer->user_data);
+			count++;
+		}
+	}
+	return count;
+}
+
+socket_timer_t socket_timer_new(socket_timer_wheel_t wheel, socket_timer_cb_t callback, void *user_data)
+{
+	if (!wheel || !callback) {
+		return NULL;
+	}
+	socket_timer_t timer = (socket_timer_t)malloc(sizeof(struct socket_timer));
+	if (!timer) {
+		return NULL;
+	}
+	socket_timer_init(timer, wheel, callback, user_data);
+	return timer;
+}
+
+void socket_timer_free(socket_timer_t timer)
+{
+	if (!timer) {
+		return;
+	}
+	socket_timer_stop(timer);
+	free(timer);
+}
+
+int socket_timer_start(socket_timer_t timer, unsigned int timeout)
+{
+	if (!timer) {
+		return -EINVAL;
+	}
+	uint64_t now = socket_time_ms();
+	if (timer->pprev) {
+		socket_timer_unlink(timer);
+	} else {
+		if (timer->wheel->count == 0 && timer->wheel->now < now) {
+			// nothing pending, skip the idle period instead of walking through it
+			timer->wheel->now = now;
+		}
+		timer->wheel->count++;
+	}
+	timer->expires = now + timeout;
+	socket_timer_link(timer->wheel, timer);
+	return 0;
+}
+
+void socket_timer_stop(socket_timer_t timer)
+{
+	if (timer && timer->pprev) {
+		socket_timer_unlink(timer);
+		timer->wheel->count--;
+	}
+}
+
+int socket_timer_pending(socket_timer_t timer)
+{
+	return (timer && timer->pprev) ? 1 : 0;
+}
+
+struct socket_loop_entry {
+	int fd;
+	int events;
+	unsigned int timeout;
+	unsigned int read_timeout;
+	unsigned int write_timeout;
+	struct socket_timer idle_timer;
+	struct socket_timer read_timer;
+	struct socket_timer write_timer;
+	socket_loop_t loop;
+	socket_loop_cb_t callback;
+	void *user_data;
+	int removed;
+	struct socket_loop_entry *hash_next;
+};
+
+struct socket_loop {
+	struct socket_loop_entry **entries;
+	unsigned int num_entries;
+	unsigned int capacity;
+	unsigned int num_active;
+	struct socket_loop_entry **hash;
+	unsigned int hash_bits;
+	socket_timer_wheel_t wheel;
+	int dispatching;
+	int stop;
+	socket_wakeup_t wakeup;
+#ifdef HAVE_SYS_EPOLL_H
+	int epfd;
+	struct epoll_event *ev;
+	int ev_size;
+#elif defined(HAVE_POLL)
+	struct pollfd *pfds;
+	unsigned int pfds_size;
+#endif
+};
+
+static ALWAYS_INLINE unsigned int socket_loop_hash(socket_loop_t loop, int fd)
+{
+	return ((uint32_t)fd * 2654435761u) >> (32 - loop->hash_bits);
+}
+
+static struct socket_loop_entry* socket_loop_lookup(socket_loop_t loop, int fd)
+{
+	struct socket_loop_entry *entry = loop->hash[socket_loop_hash(loop, fd)];
+	while (entry && entry->fd != fd) {
+		entry = entry->hash_next;
+	}
+	return entry;
+}
+
+static int socket_loop_hash_grow(socket_loop_t loop)
+{
+	unsigned int old_size = 1u << loop->hash_bits;
+	unsigned int new_bits = loop->hash_bits + 1;
+	struct socket_loop_entry **new_hash = (struct socket_loop_entry**)calloc(1u << new_bits, sizeof(struct socket_loop_entry*));
+	if (!new_hash) {
+		return -ENOMEM;
+	}
+	struct socket_loop_entry **old_hash = loop->hash;
+	loop->hash = new_hash;
+	loop->hash_bits = new_bits;
+	unsigned int i;
+	for (i = 0; i < old_size; i++) {
+		struct socket_loop_entry *entry = old_hash[i];
+		while (entry) {
+			struct socket_loop_entry *next = entry->hash_next;
+			unsigned int h = socket_loop_hash(loop, entry->fd);
+			entry->hash_next = new_hash[h];
+			new_hash[h] = entry;
+			entry = next;
+		}
+	}
+	free(old_hash);
+	return 0;
+}
+
+static void socket_loop_hash_unlink(socket_loop_t loop, struct socket_loop_entry *entry)
+{
+	struct socket_loop_entry **pp = &loop->hash[socket_loop_hash(loop, entry->fd)];
+	while (*pp) {
+		if (*pp == entry) {
+			*pp = entry->hash_next;
+			break;
+		}
+		pp = &(*pp)->hash_next;
+	}
+	entry->hash_next = NULL;
+}
+
+static void socket_loop_compact(socket_loop_t loop)
+{
+	unsigned int i, j = 0;
+	for (i = 0; i < loop->num_entries; i++) {
+		if (loop->entries[i]->removed) {
+			free(loop->entries[i]);
+		} else {
+			loop->entries[j++] = loop->entries[i];
+		}
+	}
+	loop->num_entries = j;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static uint32_t socket_events_to_epoll(int events)
+{
+	uint32_t ev = 0;
+	if (events & SOCKET_EVENT_READ) {
+		// also report a peer half-close as SOCKET_EVENT_HUP, not only as a 0-byte read
+		ev |= EPOLLIN | EPOLLPRI | EPOLLRDHUP;
+	}
+	if (events & SOCKET_EVENT_WRITE) {
+		ev |= EPOLLOUT;
+	}
+	return ev;
+}
+
+static int socket_events_from_epoll(uint32_t ev)
+{
+	int events = 0;
+	if (ev & (EPOLLIN | EPOLLPRI)) {
+		events |= SOCKET_EVENT_READ;
+	}
+	if (ev & EPOLLOUT) {
+		events |= SOCKET_EVENT_WRITE;
+	}
+	if (ev & EPOLLERR) {
+		events |= SOCKET_EVENT_ERROR;
+	}
+	if (ev & (EPOLLHUP | EPOLLRDHUP)) {
+		events |= SOCKET_EVENT_HUP;
+	}
+	return events;
+}
+#endif
+
+static void socket_loop_idle_expired(socket_timer_t timer, void *user_data)
+{
+	struct socket_loop_entry *entry = (struct socket_loop_entry*)user_data;
+	socket_timer_start(timer, entry->timeout);
+	entry->callback(entry->loop, entry->fd, SOCKET_EVENT_TIMEOUT, entry->user_data);
+}
+
+static void socket_loop_read_expired(socket_timer_t timer, void *user_data)
+{
+	struct socket_loop_entry *entry = (struct socket_loop_entry*)user_data;
+	socket_timer_start(timer, entry->read_timeout);
+	entry->callback(entry->loop, entry->fd, SOCKET_EVENT_TIMEOUT | SOCKET_EVENT_READ_TIMEOUT, entry->user_data);
+}
+
+static void socket_loop_write_expired(socket_timer_t timer, void *user_data)
+{
+	struct socket_loop_entry *entry = (struct socket_loop_entry*)user_data;
+	socket_timer_start(timer, entry->write_timeout);
+	entry->callback(entry->loop, entry->fd, SOCKET_EVENT_TIMEOUT | SOCKET_EVENT_WRITE_TIMEOUT, entry->user_data);
+}
+
+// (re)arm or stop a timer depending on whether it has a timeout and the fd is waiting for the respective event
+static void socket_loop_update_timer(struct socket_timer *timer, unsigned int timeout, int wanted, int restart)
+{
+	if (timeout == 0 || !wanted) {
+		socket_timer_stop(timer);
+	} else if (restart || !socket_timer_pending(timer)) {
+		socket_timer_start(timer, timeout);
+	}
+}
+
+socket_loop_t socket_loop_new(void)
+{
+	socket_loop_t loop = (socket_loop_t)calloc(1, sizeof(struct socket_loop));
+	if (!loop) {
+		return NULL;
+	}
+	loop->hash_bits = 6;
+	loop->hash = (struct socket_loop_entry**)calloc(1u << loop->hash_bits, sizeof(struct socket_loop_entry*));
+	if (!loop->hash) {
+		free(loop);
+		return NULL;
+	}
+	loop->wheel = socket_timer_wheel_new();
+	if (!loop->wheel) {
+		free(loop->hash);
+		free(loop);
+		return NULL;
+	}
+	// lets socket_loop_stop() interrupt a blocking wait from another thread
+	loop->wakeup = socket_wakeup_new();
+	if (!loop->wakeup) {
+		socket_timer_wheel_free(loop->wheel);
+		free(loop->hash);
+		free(loop);
+		return NULL;
+	}
+#ifdef HAVE_SYS_EPOLL_H
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0) {
+		SOCKET_ERR(1, "%s: epoll_create1: %s\n", __func__, strerror(errno));
+		socket_wakeup_free(loop->wakeup);
+		socket_timer_wheel_free(loop->wheel);
+		free(loop->hash);
+		free(loop);
+		return NULL;
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	loop->ev_size = 64;
+	loop->ev = (struct epoll_event*)malloc(sizeof(struct epoll_event) * loop->ev_size);
+	if (!loop->ev || epoll_ctl(loop->epfd, EPOLL_CTL_ADD, socket_wakeup_get_fd(loop->wakeup), &ev) < 0) {
+		free(loop->ev);
+		close(loop->epfd);
+		socket_wakeup_free(loop->wakeup);
+		socket_timer_wheel_free(loop->wheel);
+		free(loop->hash);
+		free(loop);
+		return NULL;
+	}
+#endif
+	return loop;
+}
+
+void socket_loop_free(socket_loop_t loop)
+{
+	if (!loop) {
+		return;
+	}
+	unsigned int i;
+	for (i = 0; i < loop->num_entries; i++) {
+		free(loop->entries[i]);
+	}
+	free(loop->entries);
+	free(loop->hash);
+	socket_timer_wheel_free(loop->wheel);
+#ifdef HAVE_SYS_EPOLL_H
+	close(loop->epfd);
+	free(loop->ev);
+#elif defined(HAVE_POLL)
+	free(loop->pfds);
+#endif
+	socket_wakeup_free(loop->wakeup);
+	free(loop);
+}
+
+int socket_loop_add(socket_loop_t loop, int fd, int events, unsigned int timeout, socket_loop_cb_t callback, void *user_data)
+{
+	if (!loop || fd < 0 || !callback) {
+		return -EINVAL;
+	}
+	if (socket_loop_lookup(loop, fd)) {
+		return -EEXIST;
+	}
+#if !defined(HAVE_SYS_EPOLL_H) && !defined(HAVE_POLL)
+	// one slot of the fd_sets is taken by the wakeup fd
+	if (loop->num_active + 1 >= FD_SETSIZE) {
+		return -EMFILE;
+	}
+#endif
+	if (loop->num_active >= (1u << loop->hash_bits)) {
+		if (socket_loop_hash_grow(loop) < 0) {
+			return -ENOMEM;
+		}
+	}
+	if (loop->num_entries >= loop->capacity) {
+		unsigned int new_capacity = (loop->capacity) ? loop->capacity * 2 : 16;
+		struct socket_loop_entry **new_entries = (struct socket_loop_entry**)realloc(loop->entries, sizeof(struct socket_loop_entry*) * new_capacity);
+		if (!new_entries) {
+			return -ENOMEM;
+		}
+		loop->entries = new_entries;
+		loop->capacity = new_capacity;
+	}
+
+	struct socket_loop_entry *entry = (struct socket_loop_entry*)calloc(1, sizeof(struct socket_loop_entry));
+	if (!entry) {
+		return -ENOMEM;
+	}
+	entry->fd = fd;
+	entry->events = events;
+	entry->timeout = timeout;
+	entry->loop = loop;
+	entry->callback = callback;
+	entry->user_data = user_data;
+	socket_timer_init(&entry->idle_timer, loop->wheel, socket_loop_idle_expired, entry);
+	socket_timer_init(&entry->read_timer, loop->wheel, socket_loop_read_expired, entry);
+	socket_timer_init(&entry->write_timer, loop->wheel, socket_loop_write_expired, entry);
+
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = socket_events_to_epoll(events);
+	ev.data.ptr = entry;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		int err = errno;
+		SOCKET_ERR(1, "%s: epoll_ctl(ADD) fd=%d: %s\n", __func__, fd, strerror(err));
+		free(entry);
+		return -err;
+	}
+#endif
+
+	unsigned int h = socket_loop_hash(loop, fd);
+	entry->hash_next = loop->hash[h];
+	loop->hash[h] = entry;
+	loop->entries[loop->num_entries++] = entry;
+	loop->num_active++;
+	socket_loop_update_timer(&entry->idle_timer, timeout, 1, 1);
+
+	return 0;
+}
+
+int socket_loop_modify(socket_loop_t loop, int fd, int events, unsigned int timeout)
+{
+	if (!loop || fd < 0) {
+		return -EINVAL;
+	}
+	struct socket_loop_entry *entry = socket_loop_lookup(loop, fd);
+	if (!entry) {
+		return -ENOENT;
+	}
+#ifdef HAVE_SYS_EPOLL_H
+	if (events != entry->events) {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = socket_events_to_epoll(events);
+		ev.data.ptr = entry;
+		if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+			int err = errno;
+			SOCKET_ERR(1, "%s: epoll_ctl(MOD) fd=%d: %s\n", __func__, fd, strerror(err));
+			return -err;
+		}
+	}
+#endif
+	entry->events = events;
+	// only a new timeout restarts the idle timer, changing the interest set is no activity
+	socket_loop_update_timer(&entry->idle_timer, timeout, 1, timeout != entry->timeout);
+	entry->timeout = timeout;
+	socket_loop_update_timer(&entry->read_timer, entry->read_timeout, events & SOCKET_EVENT_READ, 0);
+	socket_loop_update_timer(&entry->write_timer, entry->write_timeout, events & SOCKET_EVENT_WRITE, 0);
+	return 0;
+}
+
+int socket_loop_set_io_timeouts(socket_loop_t loop, int fd, unsigned int read_timeout, unsigned int write_timeout)
+{
+	if (!loop || fd < 0) {
+		return -EINVAL;
+	}
+	struct socket_loop_entry *entry = socket_loop_lookup(loop, fd);
+	if (!entry) {
+		return -ENOENT;
+	}
+	entry->read_timeout = read_timeout;
+	entry->write_timeout = write_timeout;
+	socket_loop_update_timer(&entry->read_timer, read_timeout, entry->events & SOCKET_EVENT_READ, 1);
+	socket_loop_update_timer(&entry->write_timer, write_timeout, entry->events & SOCKET_EVENT_WRITE, 1);
+	return 0;
+}
+
+socket_timer_wheel_t socket_loop_get_timer_wheel(socket_loop_t loop)
+{
+	return (loop) ? loop->wheel : NULL;
+}
+
+int socket_loop_remove(socket_loop_t loop, int fd)
+{
+	if (!loop || fd < 0) {
+		return -EINVAL;
+	}
+	struct socket_loop_entry *entry = socket_loop_lookup(loop, fd);
+	if (!entry) {
+		return -ENOENT;
+	}
+#ifdef HAVE_SYS_EPOLL_H
+	// the fd might already be closed, in which case epoll has dropped it already
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+	socket_loop_hash_unlink(loop, entry);
+	socket_timer_stop(&entry->idle_timer);
+	socket_timer_stop(&entry->read_timer);
+	socket_timer_stop(&entry->write_timer);
+	entry->removed = 1;
+	loop->num_active--;
+	// entries are only released after dispatching, pending events might still reference them
+	if (!loop->dispatching) {
+		socket_loop_compact(loop);
+	}
+	return 0;
+}
+
+static void socket_loop_dispatch(socket_loop_t loop, struct socket_loop_entry *entry, int events)
+{
+	// any activity pushes the idle deadline out, read/write progress the respective one
+	socket_loop_update_timer(&entry->idle_timer, entry->timeout, 1, 1);
+	if (events & SOCKET_EVENT_READ) {
+		socket_loop_update_timer(&entry->read_timer, entry->read_timeout, entry->events & SOCKET_EVENT_READ, 1);
+	}
+	if (events & SOCKET_EVENT_WRITE) {
+		socket_loop_update_timer(&entry->write_timer, entry->write_timeout, entry->events & SOCKET_EVENT_WRITE, 1);
+	}
+	entry->callback(loop, entry->fd, events, entry->user_data);
+}
+
+int socket_loop_run_once(socket_loop_t loop, int timeout)
+{
+	int count = 0;
+	int wait_ms = timeout;
+	unsigned int i;
+
+	if (!loop) {
+		return -EINVAL;
+	}
+
+	// wake up in time for the closest timer
+	int next_timer = socket_timer_wheel_next_timeout(loop->wheel);
+	if (next_timer >= 0 && (wait_ms < 0 || next_timer < wait_ms)) {
+		wait_ms = next_timer;
+	}
+
+	loop->dispatching = 1;
+
+#ifdef HAVE_SYS_EPOLL_H
+	int n = epoll_wait(loop->epfd, loop->ev, loop->ev_size, wait_ms);
+	if (n < 0) {
+		if (errno != EINTR) {
+			int err = errno;
+			SOCKET_ERR(2, "%s: epoll_wait failed: %s\n", __func__, strerror(err));
+			loop->dispatching = 0;
+			return -err;
+		}
+		n = 0;
+	}
+	for (i = 0; i < (unsigned int)n; i++) {
+		struct socket_loop_entry *entry = (struct socket_loop_entry*)loop->ev[i].data.ptr;
+		if (!entry) {
+			socket_wakeup_clear(loop->wakeup);
+			continue;
+		}
+		if (entry->removed) {
+			continue;
+		}
+		socket_loop_dispatch(loop, entry, socket_events_from_epoll(loop->ev[i].events));
+		count++;
+	}
+	if (n == loop->ev_size) {
+		struct epoll_event *new_ev = (struct epoll_event*)realloc(loop->ev, sizeof(struct epoll_event) * loop->ev_size * 2);
+		if (new_ev) {
+			loop->ev = new_ev;
+			loop->ev_size *= 2;
+		}
+	}
+#elif defined(HAVE_POLL)
+	unsigned int nfds = loop->num_entries;
+	// one extra slot at the end for the wakeup fd
+	if (nfds + 1 > loop->pfds_size) {
+		struct pollfd *new_pfds = (struct pollfd*)realloc(loop->pfds, sizeof(struct pollfd) * (nfds + 1));
+		if (!new_pfds) {
+			loop->dispatching = 0;
+			return -ENOMEM;
+		}
+		loop->pfds = new_pfds;
+		loop->pfds_size = nfds + 1;
+	}
+	for (i = 0; i < nfds; i++) {
+		struct socket_loop_entry *entry = loop->entries[i];
+		loop->pfds[i].fd = (entry->removed) ? -1 : entry->fd;
+		loop->pfds[i].events = socket_events_to_poll(entry->events);
+		loop->pfds[i].revents = 0;
+	}
+	loop->pfds[nfds].fd = socket_wakeup_get_fd(loop->wakeup);
+	loop->pfds[nfds].events = POLLIN;
+	loop->pfds[nfds].revents = 0;
+	int n = poll(loop->pfds, nfds + 1, wait_ms);
+	if (n < 0) {
+		if (errno != EINTR) {
+			int err = errno;
+			SOCKET_ERR(2, "%s: poll failed: %s\n", __func__, strerror(err));
+			loop->dispatching = 0;
+			return -err;
+		}
+		n = 0;
+	}
+	if (n > 0 && loop->pfds[nfds].revents != 0) {
+		socket_wakeup_clear(loop->wakeup);
+		n--;
+	}
+	for (i = 0; i < nfds && n > 0; i++) {
+		struct socket_loop_entry *entry = loop->entries[i];
+		if (loop->pfds[i].revents == 0) {
+			continue;
+		}
+		n--;
+		if (entry->removed) {
+			continue;
+		}
+		socket_loop_dispatch(loop, entry, socket_events_from_poll(loop->pfds[i].revents));
+		count++;
+	}
+#else
+	unsigned int nfds = loop->num_entries;
+	fd_set rfds, wfds, efds;
+	int wakeup_fd = socket_wakeup_get_fd(loop->wakeup);
+	int maxfd = wakeup_fd;
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+	FD_ZERO(&efds);
+	FD_SET(wakeup_fd, &rfds);
+	for (i = 0; i < nfds; i++) {
+		struct socket_loop_entry *entry = loop->entries[i];
+		if (entry->removed) {
+			continue;
+		}
+		if (entry->events & SOCKET_EVENT_READ) {
+			FD_SET(entry->fd, &rfds);
+		}
+		if (entry->events & SOCKET_EVENT_WRITE) {
+			FD_SET(entry->fd, &wfds);
+		}
+		FD_SET(entry->fd, &efds);
+		if (entry->fd > maxfd) {
+			maxfd = entry->fd;
+		}
+	}
+	// the wakeup fd is always in the read set, so select() never gets empty sets (which fail on Windows)
+	struct timeval to;
+	struct timeval *pto = NULL;
+	if (wait_ms >= 0) {
+		to.tv_sec = (time_t)(wait_ms / 1000);
+		to.tv_usec = (time_t)((wait_ms % 1000) * 1000);
+		pto = &to;
+	}
+	int n = select(maxfd + 1, &rfds, &wfds, &efds, pto);
+	if (n < 0) {
+#ifdef _WIN32
+		errno = WSAError_to_errno(WSAGetLastError());
+#endif
+		if (errno != EINTR) {
+			int err = errno;
+			SOCKET_ERR(2, "%s: select failed: %s\n", __func__, strerror(err));
+			loop->dispatching = 0;
+			return -err;
+		}
+		n = 0;
+	}
+	if (n > 0 && FD_ISSET(wakeup_fd, &rfds)) {
+		socket_wakeup_clear(loop->wakeup);
+		n--;
+	}
+	for (i = 0; i < nfds && n > 0; i++) {
+		struct socket_loop_entry *entry = loop->entries[i];
+		int events = 0;
+		if (entry->removed) {
+			continue;
+		}
+		if (FD_ISSET(entry->fd, &rfds)) {
+			events |= SOCKET_EVENT_READ;
+		}
+		if (FD_ISSET(entry->fd, &wfds)) {
+			events |= SOCKET_EVENT_WRITE;
+		}
+		if (FD_ISSET(entry->fd, &efds)) {
+			events |= SOCKET_EVENT_ERROR;
+		}
+		if (events) {
+			socket_loop_dispatch(loop, entry, events);
+			count++;
+		}
+	}
+#endif
+
+	count += socket_timer_wheel_advance(loop->wheel);
+
+	loop->dispatching = 0;
+	if (loop->num_entries > loop->num_active) {
+		socket_loop_compact(loop);
+	}
+
+	return count;
+}
+
+int socket_loop_run(socket_loop_t loop)
+{
+	int res = 0;
+	if (!loop) {
+		return -EINVAL;
+	}
+	while (!ATOMIC_LOAD_RELAXED(&loop->stop) && loop->num_active > 0) {
+		res = socket_loop_run_once(loop, -1);
+		if (res < 0) {
+			break;
+		}
+		res = 0;
+	}
+	ATOMIC_STORE_RELAXED(&loop->stop, 0);
+	return res;
+}
+
+void socket_loop_stop(socket_loop_t loop)
+{
+	if (loop) {
+		ATOMIC_STORE_RELAXED(&loop->stop, 1);
+		socket_wakeup_signal(loop->wakeup);
+	}
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * Minimal io_uring submission/completion handling using the raw syscalls,
+ * so there is no dependency on liburing.
+ */
+struct socket_uring_req {
+	int fd;
+	int is_recv;
+	socket_uring_cb_t callback;
+	void *user_data;
+	struct socket_uring_req *next_free;
+};
+
+struct socket_uring {
+	int ring_fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sq_entries;
+	unsigned int to_submit;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	size_t sqes_size;
+	struct socket_uring_req *reqs;
+	struct socket_uring_req *free_reqs;
+};
+
+static int socket_uring_enter(int ring_fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+	return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+#endif
+
+socket_uring_t socket_uring_new(unsigned int entries)
+{
+#ifdef HAVE_IO_URING
+	struct io_uring_params params;
+	unsigned int i;
+
+	if (entries == 0) {
+		entries = 256;
+	}
+	socket_uring_t ring = (socket_uring_t)calloc(1, sizeof(struct socket_uring));
+	if (!ring) {
+		return NULL;
+	}
+
+	memset(&params, 0, sizeof(params));
+	ring->ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->ring_fd < 0) {
+		SOCKET_ERR(1, "%s: io_uring_setup: %s\n", __func__, strerror(errno));
+		free(ring);
+		return NULL;
+	}
+
+	ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size) {
+			ring->sq_size = ring->cq_size;
+		}
+		ring->cq_size = ring->sq_size;
+	}
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		SOCKET_ERR(1, "%s: mmap sq ring: %s\n", __func__, strerror(errno));
+		close(ring->ring_fd);
+		free(ring);
+		return NULL;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			SOCKET_ERR(1, "%s: mmap cq ring: %s\n", __func__, strerror(errno));
+			munmap(ring->sq_ptr, ring->sq_size);
+			close(ring->ring_fd);
+			free(ring);
+			return NULL;
+		}
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		SOCKET_ERR(1, "%s: mmap sqes: %s\n", __func__, strerror(errno));
+		if (ring->cq_ptr != ring->sq_ptr) {
+			munmap(ring->cq_ptr, ring->cq_size);
+		}
+		munmap(ring->sq_ptr, ring->sq_size);
+		close(ring->ring_fd);
+		free(ring);
+		return NULL;
+	}
+
+	ring->sq_head = (unsigned int*)((char*)ring->sq_ptr + params.sq_off.head);
+	ring->sq_tail = (unsigned int*)((char*)ring->sq_ptr + params.sq_off.tail);
+	ring->sq_mask = (unsigned int*)((char*)ring->sq_ptr + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int*)((char*)ring->sq_ptr + params.sq_off.array);
+	ring->sq_entries = params.sq_entries;
+	ring->cq_head = (unsigned int*)((char*)ring->cq_ptr + params.cq_off.head);
+	ring->cq_tail = (unsigned int*)((char*)ring->cq_ptr + params.cq_off.tail);
+	ring->cq_mask = (unsigned int*)((char*)ring->cq_ptr + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ptr + params.cq_off.cqes);
+
+	// never have more requests in flight than the completion queue can hold
+	ring->reqs = (struct socket_uring_req*)calloc(params.cq_entries, sizeof(struct socket_uring_req));
+	if (!ring->reqs) {
+		socket_uring_free(ring);
+		return NULL;
+	}
+	for (i = 0; i < params.cq_entries; i++) {
+		ring->reqs[i].next_free = ring->free_reqs;
+		ring->free_reqs = &ring->reqs[i];
+	}
+
+	return ring;
+#else
+	errno = ENOSYS;
+	return NULL;
+#endif
+}
+
+void socket_uring_free(socket_uring_t ring)
+{
+#ifdef HAVE_IO_URING
+	if (!ring) {
+		return;
+	}
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr != ring->sq_ptr) {
+		munmap(ring->cq_ptr, ring->cq_size);
+	}
+	munmap(ring->sq_ptr, ring->sq_size);
+	// closing the ring cancels all requests that are still in flight
+	close(ring->ring_fd);
+	free(ring->reqs);
+	free(ring);
+#endif
+}
+
+int socket_uring_get_fd(socket_uring_t ring)
+{
+#ifdef HAVE_IO_URING
+	if (!ring) {
+		return -EINVAL;
+	}
+	return ring->ring_fd;
+#else
+	return -ENOSYS;
+#endif
+}
+
+int socket_uring_submit(socket_uring_t ring)
+{
+#ifdef HAVE_IO_URING
+	int submitted = 0;
+	if (!ring) {
+		return -EINVAL;
+	}
+	while (ring->to_submit > 0) {
+		int res = socket_uring_enter(ring->ring_fd, ring->to_submit, 0, 0);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			int err = errno;
+			SOCKET_ERR(2, "%s: io_uring_enter: %s\n", __func__, strerror(err));
+			return -err;
+		}
+		ring->to_submit -= (unsigned int)res;
+		submitted += res;
+		if (res == 0) {
+			break;
+		}
+	}
+	return submitted;
+#else
+	return -ENOSYS;
+#endif
+}
+
+#ifdef HAVE_IO_URING
+static int socket_uring_queue(socket_uring_t ring, int fd, int opcode, void *data, size_t length, int flags, socket_uring_cb_t callback, void *user_data)
+{
+	if (!ring || fd < 0 || !callback || length > UINT32_MAX) {
+		return -EINVAL;
+	}
+	if (socket_fd_transport(fd, NULL)) {
+		// the kernel would read/write the raw socket and bypass the transport
+		return -ENOTSUP;
+	}
+	if (!ring->free_reqs) {
+		return -EBUSY;
+	}
+
+	unsigned int tail = *ring->sq_tail;
+	if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+		// submission queue is full, hand it to the kernel first
+		int res = socket_uring_submit(ring);
+		if (res < 0) {
+			return res;
+		}
+		if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+			return -EBUSY;
+		}
+	}
+
+	struct socket_uring_req *req = ring->free_reqs;
+	ring->free_reqs = req->next_free;
+	req->fd = fd;
+	req->is_recv = (opcode == IORING_OP_RECV);
+	req->callback = callback;
+	req->user_data = user_data;
+
+	unsigned int idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = (uint8_t)opcode;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)data;
+	sqe->len = (uint32_t)length;
+	sqe->msg_flags = (uint32_t)flags;
+	sqe->user_data = (uint64_t)(uintptr_t)req;
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+
+	return 0;
+}
+#endif
+
+int socket_submit_recv(socket_uring_t ring, int fd, void *data, size_t length, int flags, socket_uring_cb_t callback, void *user_data)
+{
+#ifdef HAVE_IO_URING
+	return socket_uring_queue(ring, fd, IORING_OP_RECV, data, length, flags, callback, user_data);
+#else
+	return -ENOSYS;
+#endif
+}
+
+int socket_submit_send(socket_uring_t ring, int fd, const void *data, size_t length, socket_uring_cb_t callback, void *user_data)
+{
+#ifdef HAVE_IO_URING
+	int flags = 0;
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+	return socket_uring_queue(ring, fd, IORING_OP_SEND, (void*)data, length, flags, callback, user_data);
+#else
+	return -ENOSYS;
+#endif
+}
+
+int socket_uring_wait(socket_uring_t ring, int timeout)
+{
+#ifdef HAVE_IO_URING
+	int count = 0;
+	int res;
+
+	if (!ring) {
+		return -EINVAL;
+	}
+
+	res = socket_uring_submit(ring);
+	if (res < 0) {
+		return res;
+	}
+
+	unsigned int head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) && timeout != 0) {
+		if (timeout < 0) {
+			res = socket_uring_enter(ring->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+			if (res < 0 && errno != EINTR) {
+				return -errno;
+			}
+		} else {
+			// the ring fd becomes readable when completions are available
+			switch (poll_wrapper(ring->ring_fd, FDM_READ, timeout)) {
+				case poll_status_success:
+					break;
+				case poll_status_timeout:
+					return 0;
+				case poll_status_error:
+				default:
+					return -ECONNRESET;
+			}
+		}
+	}
+
+	while (1) {
+		head = *ring->cq_head;
+		if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		struct socket_uring_req *req = (struct socket_uring_req*)(uintptr_t)cqe->user_data;
+		int result = cqe->res;
+		__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+		int fd = req->fd;
+		socket_uring_cb_t callback = req->callback;
+		void *user_data = req->user_data;
+		if (req->is_recv && result == 0) {
+			// same as socket_receive_timeout()
+			result = -ECONNRESET;
+		}
+		req->next_free = ring->free_reqs;
+		ring->free_reqs = req;
+
+		callback(ring, fd, result, user_data);
+		count++;
+	}
+
+	return count;
+#else
+	return -ENOSYS;
+#endif
+}
+
+struct socket_pool_entry {
+	int fd;
+	int idle;
+	uint64_t idle_since;
+	char *key;
+};
+
+struct socket_pool {
+	mutex_t mutex;
+	struct collection entries;
+	unsigned int max_idle;
+	unsigned int idle_ttl;
+};
+
+static void socket_pool_entry_free(struct socket_pool_entry *entry, int close_fd)
+{
+	if (close_fd) {
+		socket_close(entry->fd);
+	}
+	free(entry->key);
+	free(entry);
+}
+
+// an idle connection must not be readable; if it is, the peer closed it or sent unexpected data
+static int socket_pool_entry_healthy(struct socket_pool_entry *entry)
+{
+	return poll_wrapper(entry->fd, FDM_READ, 0) == poll_status_timeout;
+}
+
+// must be called with the pool mutex held
+static void socket_pool_expire(socket_pool_t pool, uint64_t now)
+{
+	if (pool->idle_ttl == 0) {
+		return;
+	}
+	FOREACH(struct socket_pool_entry *entry, &pool->entries) {
+		if (entry->idle && now - entry->idle_since >= pool->idle_ttl) {
+			collection_remove(&pool->entries, entry);
+			socket_pool_entry_free(entry, 1);
+		}
+	} ENDFOREACH
+}
+
+socket_pool_t socket_pool_new(unsigned int max_idle, unsigned int idle_ttl)
+{
+	socket_pool_t pool = (socket_pool_t)calloc(1, sizeof(struct socket_pool));
+	if (!pool) {
+		return NULL;
+	}
+	mutex_init(&pool->mutex);
+	collection_init(&pool->entries);
+	pool->max_idle = max_idle;
+	pool->idle_ttl = idle_ttl;
+	return pool;
+}
+
+void socket_pool_free(socket_pool_t pool)
+{
+	if (!pool) {
+		return;
+	}
+	mutex_lock(&pool->mutex);
+	FOREACH(struct socket_pool_entry *entry, &pool->entries) {
+		// connections currently handed out stay with their owners
+		socket_pool_entry_free(entry, entry->idle);
+	} ENDFOREACH
+	collection_free(&pool->entries);
+	mutex_unlock(&pool->mutex);
+	mutex_destroy(&pool->mutex);
+	free(pool);
+}
+
+static int socket_pool_get(socket_pool_t pool, char *key, int (*connect_cb)(const void *, uint16_t), const void *target, uint16_t port)
+{
+	struct socket_pool_entry *found = NULL;
+	uint64_t now = socket_time_ms();
+
+	mutex_lock(&pool->mutex);
+	socket_pool_expire(pool, now);
+	FOREACH(struct socket_pool_entry *entry, &pool->entries) {
+		if (!entry->idle || strcmp(entry->key, key) != 0) {
+			continue;
+		}
+		if (!socket_pool_entry_healthy(entry)) {
+			SOCKET_ERR(3, "%s: dropping stale connection fd=%d for %s\n", __func__, entry->fd, key);
+			collection_remove(&pool->entries, entry);
+			socket_pool_entry_free(entry, 1);
+			continue;
+		}
+		// prefer the most recently used connection
+		if (!found || entry->idle_since > found->idle_since) {
+			found = entry;
+		}
+	} ENDFOREACH
+	if (found) {
+		found->idle = 0;
+		mutex_unlock(&pool->mutex);
+		free(key);
+		return found->fd;
+	}
+	mutex_unlock(&pool->mutex);
+
+	int fd = connect_cb(target, port);
+	if (fd < 0) {
+		free(key);
+		return fd;
+	}
+
+	struct socket_pool_entry *entry = (struct socket_pool_entry*)calloc(1, sizeof(struct socket_pool_entry));
+	if (!entry) {
+		free(key);
+		socket_close(fd);
+		errno = ENOMEM;
+		return -1;
+	}
+	entry->fd = fd;
+	entry->key = key;
+
+	mutex_lock(&pool->mutex);
+	collection_add(&pool->entries, entry);
+	mutex_unlock(&pool->mutex);
+
+	return fd;
+}
+
+static int socket_pool_connect_tcp_cb(const void *target, uint16_t port)
+{
+	return socket_connect((const char*)target, port);
+}
+
+int socket_pool_connect(socket_pool_t pool, const char *addr, uint16_t port)
+{
+	if (!pool || !addr) {
+		errno = EINVAL;
+		return -1;
+	}
+	size_t keylen = strlen(addr) + 16;
+	char *key = (char*)malloc(keylen);
+	if (!key) {
+		errno = ENOMEM;
+		return -1;
+	}
+	snprintf(key, keylen, "tcp:%s:%u", addr, port);
+	return socket_pool_get(pool, key, socket_pool_connect_tcp_cb, addr, port);
+}
+
+#ifndef _WIN32
+static int socket_pool_connect_unix_cb(const void *target, uint16_t port)
+{
+	return socket_connect_unix((const char*)target);
+}
+
+int socket_pool_connect_unix(socket_pool_t pool, const char *filename)
+{
+	if (!pool || !filename) {
+		errno = EINVAL;
+		return -1;
+	}
+	size_t keylen = strlen(filename) + 6;
+	char *key = (char*)malloc(keylen);
+	if (!key) {
+		errno = ENOMEM;
+		return -1;
+	}
+	snprintf(key, keylen, "unix:%s", filename);
+	return socket_pool_get(pool, key, socket_pool_connect_unix_cb, filename, 0);
+}
+#endif
+
+static struct socket_pool_entry* socket_pool_find_active(socket_pool_t pool, int fd)
+{
+	FOREACH(struct socket_pool_entry *entry, &pool->entries) {
+		if (!entry->idle && entry->fd == fd) {
+			return entry;
+		}
+	} ENDFOREACH
+	return NULL;
+}
+
+int socket_pool_release(socket_pool_t pool, int fd)
+{
+	struct socket_pool_entry *entry = NULL;
+	struct socket_pool_entry *oldest = NULL;
+	unsigned int idle_count = 0;
+	uint64_t now = socket_time_ms();
+
+	if (!pool || fd < 0) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&pool->mutex);
+	entry = socket_pool_find_active(pool, fd);
+	if (!entry) {
+		mutex_unlock(&pool->mutex);
+		SOCKET_ERR(2, "%s: fd %d does not belong to this pool\n", __func__, fd);
+		return -EINVAL;
+	}
+	if (!socket_pool_entry_healthy(entry)) {
+		collection_remove(&pool->entries, entry);
+		socket_pool_entry_free(entry, 1);
+		mutex_unlock(&pool->mutex);
+		return 0;
+	}
+	entry->idle = 1;
+	entry->idle_since = now;
+
+	FOREACH(struct socket_pool_entry *e, &pool->entries) {
+		if (!e->idle || strcmp(e->key, entry->key) != 0) {
+			continue;
+		}
+		idle_count++;
+		if (!oldest || e->idle_since < oldest->idle_since) {
+			oldest = e;
+		}
+	} ENDFOREACH
+	if (idle_count > pool->max_idle && oldest) {
+		collection_remove(&pool->entries, oldest);
+		socket_pool_entry_free(oldest, 1);
+	}
+	socket_pool_expire(pool, now);
+	mutex_unlock(&pool->mutex);
+
+	return 0;
+}
+
+int socket_pool_discard(socket_pool_t pool, int fd)
+{
+	struct socket_pool_entry *entry = NULL;
+
+	if (!pool || fd < 0) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&pool->mutex);
+	entry = socket_pool_find_active(pool, fd);
+	if (entry) {
+		collection_remove(&pool->entries, entry);
+	}
+	mutex_unlock(&pool->mutex);
+
+	if (!entry) {
+		SOCKET_ERR(2, "%s: fd %d does not belong to this pool\n", __func__, fd);
+		return -EINVAL;
+	}
+	socket_pool_entry_free(entry, 1);
+
+	return 0;
+}
+
+struct socket_reader {
+	int fd;
+	unsigned char *buf;
+	unsigned char *scratch;  // swap buffer for linearizing wrapped data
+	size_t capacity;         // power of two
+	size_t head;             // index of the first buffered byte
+	size_t count;            // number of buffered bytes
+};
+
+socket_reader_t socket_reader_new(int fd, size_t capacity)
+{
+	socket_reader_t reader;
+	size_t cap = 16;
+
+	if (fd < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (capacity == 0) {
+		capacity = SOCKET_READER_DEFAULT_SIZE;
+	}
+	while (cap < capacity) {
+		cap <<= 1;
+	}
+
+	reader = (socket_reader_t)calloc(1, sizeof(struct socket_reader));
+	if (!reader) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	reader->buf = (unsigned char*)malloc(cap);
+	if (!reader->buf) {
+		free(reader);
+		errno = ENOMEM;
+		return NULL;
+	}
+	reader->fd = fd;
+	reader->capacity = cap;
+	return reader;
+}
 
-/* map prefix to netmask */
-			ifa->ifa_netmask->sa_family = unicast->Address.lpSockaddr->sa_family;
-			switch (unicast->Address.lpSockaddr->sa_family) {
-			case AF_INET:
-				if (0 == prefixLength || prefixLength > 32) {
-					prefixLength = 32;
-				}
-#if defined( _WIN32) && ( _WIN32_WINNT >= 0x0600 )
-/* Added in Vista, but no IPv6 equivalent. */
-				{
-				ULONG Mask;
-				ConvertLengthToIpv4Mask (prefixLength, &Mask);
-				((struct sockaddr_in*)ifa->ifa_netmask)->sin_addr.s_addr = Mask;	/* network order */
-				}
-#else
-/* NB: left-shift of full bit-width is undefined in C standard. */
-				((struct sockaddr_in*)ifa->ifa_netmask)->sin_addr.s_addr = htonl( 0xffffffffU << ( 32 - prefixLength ) );
-#endif
-				break;
+void socket_reader_free(socket_reader_t reader)
+{
+	if (!reader) {
+		return;
+	}
+	free(reader->buf);
+	free(reader->scratch);
+	free(reader);
+}
 
-			case AF_INET6:
-				if (0 == prefixLength || prefixLength > 128) {
-					prefixLength = 128;
-				}
-				for (LONG i = prefixLength, j = 0; i > 0; i -= 8, ++j) {
-					((struct sockaddr_in6*)ifa->ifa_netmask)->sin6_addr.s6_addr[ j ] = i >= 8 ? 0xff : (ULONG)(( 0xffU << ( 8 - i ) ) & 0xffU );
-				}
-				break;
-			default:
-				break;
-			}
-		}
+size_t socket_reader_available(socket_reader_t reader)
+{
+	return (reader) ? reader->count : 0;
+}
+
+// copies length buffered bytes starting at offset without consuming them
+static void socket_reader_copy(socket_reader_t reader, size_t offset, void *data, size_t length)
+{
+	size_t pos = (reader->head + offset) & (reader->capacity - 1);
+	size_t first = reader->capacity - pos;
+	if (first > length) {
+		first = length;
 	}
-	free(pAddresses);
+	memcpy(data, reader->buf + pos, first);
+	if (length > first) {
+		memcpy((unsigned char*)data + first, reader->buf, length - first);
+	}
+}
 
-	return 0;
+static void socket_reader_drop(socket_reader_t reader, size_t length)
+{
+	reader->count -= length;
+	if (reader->count == 0) {
+		// start over at the beginning to keep the data contiguous
+		reader->head = 0;
+	} else {
+		reader->head = (reader->head + length) & (reader->capacity - 1);
+	}
 }
-#else
-#error No reference implementation for getifaddrs available for this platform.
-#endif
-#endif
 
-int get_primary_mac_address(unsigned char mac_addr_buf[6])
+// makes the buffered data contiguous, starting at buf[0]
+static int socket_reader_linearize(socket_reader_t reader)
 {
-	int result = -1;
-	struct ifaddrs *ifaddr = NULL, *ifa = NULL;
-	if (getifaddrs(&ifaddr) != -1) {
-		for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
-			if (ifa->ifa_addr == NULL) {
-				continue;
-			}
-			if ((ifa->ifa_flags & IFF_UP) == 0) {
-				continue;
-			}
-			if (ifa->ifa_flags & IFF_LOOPBACK) {
-				continue;
-			}
-#if defined(__APPLE__) || defined (__FreeBSD__) || defined (__HAIKU__)
-			if (ifa->ifa_addr->sa_family != AF_LINK) {
-				continue;
-			}
-#if defined (__APPLE__)
-			if (!strcmp(ifa->ifa_name, "en0")) {
-#elif defined (__FreeBSD__) || defined (__HAIKU__)
-			{
-#endif
-				memcpy(mac_addr_buf, (unsigned char *)LLADDR((struct sockaddr_dl *)(ifa)->ifa_addr), 6);
-				result = 0;
-				break;
-			}
-#elif defined (__linux__)
-			if (ifa->ifa_addr->sa_family != AF_PACKET) {
-				continue;
-			}
-			if (strcmp(ifa->ifa_name, "lo") != 0) {
-				memcpy(mac_addr_buf, ((struct sockaddr_ll*)ifa->ifa_addr)->sll_addr, 6);
-				result = 0;
-				break;
-			}
-#elif defined (WIN32)
-			if (ifa->ifa_data) {
-				memcpy(mac_addr_buf, ifa->ifa_data, 6);
-				result = 0;
-				break;
-			}
-#elif defined(__CYGWIN__)
-			if (ifa->ifa_data) {
-				memcpy(mac_addr_buf, ((struct ifaddrs_hwdata *)ifa->ifa_data)->ifa_hwaddr.sa_data, 6);
-				result = 0;
-				break;
-			}
-#else
-#error get_primary_mac_address is not supported on this platform.
-#endif
+	if (reader->head + reader->count <= reader->capacity) {
+		return 0;
+	}
+	if (!reader->scratch) {
+		reader->scratch = (unsigned char*)malloc(reader->capacity);
+		if (!reader->scratch) {
+			return -ENOMEM;
 		}
-		freeifaddrs(ifaddr);
 	}
-	return result;
+	socket_reader_copy(reader, 0, reader->scratch, reader->count);
+	unsigned char *tmp = reader->buf;
+	reader->buf = reader->scratch;
+	reader->scratch = tmp;
+	reader->head = 0;
+	return 0;
 }
 
-static int32_t _sockaddr_in6_scope_id(struct sockaddr_in6* addr)
+// receives as much as fits into the free space with a single call
+static int socket_reader_fill_once(socket_reader_t reader, unsigned int timeout)
 {
-	int32_t res = -1;
-	struct ifaddrs *ifaddr = NULL, *ifa = NULL;
-	uint32_t addr_scope;
+	struct iovec iov[2];
+	int iovcnt = 1;
+	size_t space = reader->capacity - reader->count;
+	size_t tail = (reader->head + reader->count) & (reader->capacity - 1);
+	int res;
 
-	/* get scope for requested address */
-	addr_scope = _in6_addr_scope(&addr->sin6_addr);
-	if (addr_scope == 0) {
-		/* global scope doesn't need a specific scope id */
-		return addr_scope;
+	if (space == 0) {
+		return -ENOBUFS;
 	}
-
-	/* get interfaces */
-	if (getifaddrs(&ifaddr) == -1) {
-#ifdef _WIN32
-		errno = WSAError_to_errno(WSAGetLastError());
-#endif
-		SOCKET_ERR(1, "getifaddrs(): %s\n", strerror(errno));
-		return res;
+	iov[0].iov_base = reader->buf + tail;
+	iov[0].iov_len = reader->capacity - tail;
+	if (iov[0].iov_len >= space) {
+		iov[0].iov_len = space;
+	} else {
+		iov[1].iov_base = reader->buf;
+		iov[1].iov_len = space - iov[0].iov_len;
+		iovcnt = 2;
 	}
+	res = socket_receivev_timeout(reader->fd, iov, iovcnt, 0, timeout);
+	if (res > 0) {
+		reader->count += (size_t)res;
+	}
+	return res;
+}
 
-	/* loop over interfaces */
-	for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
-		/* skip if no address is available */
-		if (ifa->ifa_addr == NULL) {
-			continue;
+// makes sure at least length bytes are buffered, waiting until deadline
+static int socket_reader_ensure(socket_reader_t reader, size_t length, uint64_t deadline)
+{
+	while (reader->count < length) {
+		unsigned int remaining = 0;
+		int res = socket_deadline_remaining(deadline, &remaining);
+		if (res < 0) {
+			return res;
+		}
+		res = socket_reader_fill_once(reader, remaining);
+		if (res < 0 && res != -EINTR && res != -EAGAIN && res != -EWOULDBLOCK) {
+			return res;
 		}
+	}
+	return 0;
+}
 
-		/* skip if wrong family */
-		if (ifa->ifa_addr->sa_family != AF_INET6) {
-			continue;
+int socket_reader_fill(socket_reader_t reader, unsigned int timeout)
+{
+	if (!reader) {
+		return -EINVAL;
+	}
+	return socket_reader_fill_once(reader, timeout);
+}
+
+int socket_reader_read(socket_reader_t reader, void *data, size_t length, unsigned int timeout)
+{
+	int res;
+
+	if (!reader || (!data && length > 0)) {
+		return -EINVAL;
+	}
+	if (length == 0) {
+		return 0;
+	}
+	if (reader->count == 0) {
+		res = socket_reader_fill_once(reader, timeout);
+		if (res < 0) {
+			return res;
 		}
+	}
+	if (length > reader->count) {
+		length = reader->count;
+	}
+	if (length > INT_MAX) {
+		length = INT_MAX;
+	}
+	socket_reader_copy(reader, 0, data, length);
+	socket_reader_drop(reader, length);
+	return (int)length;
+}
 
-		/* skip if not up */
-		if ((ifa->ifa_flags & IFF_UP) == 0) {
-			continue;
+int socket_reader_read_exact(socket_reader_t reader, void *data, size_t length, unsigned int timeout)
+{
+	uint64_t deadline = (timeout > 0) ? socket_time_ms() + timeout : 0;
+	size_t buffered;
+	int res;
+
+	if (!reader || (!data && length > 0)) {
+		return -EINVAL;
+	}
+	if (length <= reader->capacity) {
+		res = socket_reader_ensure(reader, length, deadline);
+		if (res < 0) {
+			return res;
 		}
+		socket_reader_copy(reader, 0, data, length);
+		socket_reader_drop(reader, length);
+		return 0;
+	}
 
-#ifndef __HAIKU__
-		/* skip if not running */
-		if ((ifa->ifa_flags & IFF_RUNNING) == 0) {
-			continue;
+	// too large for the buffer: hand out what is buffered and receive the rest directly
+	buffered = reader->count;
+	socket_reader_copy(reader, 0, data, buffered);
+	socket_reader_drop(reader, buffered);
+	if (deadline) {
+		unsigned int remaining = 0;
+		res = socket_deadline_remaining(deadline, &remaining);
+		if (res < 0) {
+			return res;
 		}
-#endif
+		timeout = remaining;
+	}
+	return socket_receive_all(reader->fd, (unsigned char*)data + buffered, length - buffered, timeout, NULL);
+}
 
-		struct sockaddr_in6* addr_in = (struct sockaddr_in6*)ifa->ifa_addr;
+int socket_reader_read_until(socket_reader_t reader, const void *delim, size_t delim_len, void *data, size_t max_length, unsigned int timeout)
+{
+	uint64_t deadline = (timeout > 0) ? socket_time_ms() + timeout : 0;
+	size_t scanned = 0;
+	int res;
 
-		/* skip if scopes do not match */
-		if (_in6_addr_scope(&addr_in->sin6_addr) != addr_scope) {
-			continue;
-		}
+	if (!reader || !delim || delim_len == 0 || !data || max_length < delim_len) {
+		return -EINVAL;
+	}
 
-		/* use if address is equal */
-		if (memcmp(&addr->sin6_addr.s6_addr, &addr_in->sin6_addr.s6_addr, sizeof(addr_in->sin6_addr.s6_addr)) == 0) {
-			/* if scope id equals the requested one then assume it was valid */
-			if (addr->sin6_scope_id == addr_in->sin6_scope_id) {
-				res = addr_in->sin6_scope_id;
-				break;
+	while (1) {
+		res = socket_reader_linearize(reader);
+		if (res < 0) {
+			return res;
+		}
+		const unsigned char *p = reader->buf + reader->head;
+		size_t i = (scanned >= delim_len) ? scanned - delim_len + 1 : 0;
+		for (; i + delim_len <= reader->count; i++) {
+			if (p[i] == ((const unsigned char*)delim)[0] && memcmp(p + i, delim, delim_len) == 0) {
+				size_t length = i + delim_len;
+				if (length > max_length || length > INT_MAX) {
+					return -EMSGSIZE;
+				}
+				memcpy(data, p, length);
+				socket_reader_drop(reader, length);
+				return (int)length;
 			}
-			res = addr_in->sin6_scope_id;
-			continue;
 		}
-
-		/* skip loopback interface if not already matched exactly above */
-		if ((ifa->ifa_flags & IFF_LOOPBACK) != 0) {
-			continue;
+		scanned = reader->count;
+		if (scanned >= max_length) {
+			return -EMSGSIZE;
+		}
+		if (scanned == reader->capacity) {
+			return -ENOBUFS;
 		}
+		res = socket_reader_ensure(reader, scanned + 1, deadline);
+		if (res < 0) {
+			return res;
+		}
+	}
+}
 
-		res = addr_in->sin6_scope_id;
+static int socket_reader_peek_u32(socket_reader_t reader, uint32_t *value, unsigned int timeout)
+{
+	uint64_t deadline = (timeout > 0) ? socket_time_ms() + timeout : 0;
+	int res;
 
-		/* if scope id equals the requested one then assume it was valid */
-		if (addr->sin6_scope_id == addr_in->sin6_scope_id) {
-			/* set the scope id of this interface as most likely candidate */
-			break;
+	if (!reader || !value) {
+		return -EINVAL;
+	}
+	res = socket_reader_ensure(reader, sizeof(uint32_t), deadline);
+	if (res < 0) {
+		return res;
+	}
+	socket_reader_copy(reader, 0, value, sizeof(uint32_t));
+	return 0;
+}
+
+int socket_reader_peek_u32be(socket_reader_t reader, uint32_t *value, unsigned int timeout)
+{
+	int res = socket_reader_peek_u32(reader, value, timeout);
+	if (res == 0) {
+		*value = be32toh(*value);
+	}
+	return res;
+}
+
+int socket_reader_peek_u32le(socket_reader_t reader, uint32_t *value, unsigned int timeout)
+{
+	int res = socket_reader_peek_u32(reader, value, timeout);
+	if (res == 0) {
+		*value = le32toh(*value);
+	}
+	return res;
+}
+
+int socket_reader_borrow(socket_reader_t reader, size_t length, const void **data, unsigned int timeout)
+{
+	uint64_t deadline = (timeout > 0) ? socket_time_ms() + timeout : 0;
+	int res;
+
+	if (!reader || !data) {
+		return -EINVAL;
+	}
+	if (length > reader->capacity) {
+		return -EMSGSIZE;
+	}
+	res = socket_reader_ensure(reader, length, deadline);
+	if (res < 0) {
+		return res;
+	}
+	if (reader->head + length > reader->capacity) {
+		res = socket_reader_linearize(reader);
+		if (res < 0) {
+			return res;
 		}
 	}
+	*data = reader->buf + reader->head;
+	return 0;
+}
+
+int socket_reader_consume(socket_reader_t reader, size_t length)
+{
+	if (!reader || length > reader->count) {
+		return -EINVAL;
+	}
+	socket_reader_drop(reader, length);
+	return 0;
+}
+
+struct socket_writer {
+	int fd;
+	unsigned char *buf;
+	size_t capacity;
+	size_t length;
+	unsigned int flush_delay;
+	uint64_t deadline;  // time by which buffered data must be sent, 0 if none
+};
+
+socket_writer_t socket_writer_new(int fd, size_t capacity, unsigned int flush_delay)
+{
+	socket_writer_t writer;
+
+	if (fd < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (capacity == 0) {
+		capacity = SOCKET_WRITER_DEFAULT_SIZE;
+	}
+	writer = (socket_writer_t)calloc(1, sizeof(struct socket_writer));
+	if (!writer) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	writer->buf = (unsigned char*)malloc(capacity);
+	if (!writer->buf) {
+		free(writer);
+		errno = ENOMEM;
+		return NULL;
+	}
+	writer->fd = fd;
+	writer->capacity = capacity;
+	writer->flush_delay = flush_delay;
+	return writer;
+}
 
-	freeifaddrs(ifaddr);
-
-	return res;
+void socket_writer_free(socket_writer_t writer)
+{
+	if (!writer) {
+		return;
+	}
+	if (writer->length > 0) {
+		SOCKET_ERR(2, "%s: discarding %zu unflushed bytes\n", __func__, writer->length);
+	}
+	free(writer->buf);
+	free(writer);
 }
-#endif
 
-int socket_connect_addr(struct sockaddr* addr, uint16_t port)
+size_t socket_writer_pending(socket_writer_t writer)
 {
-	int sfd = -1;
-	int yes = 1;
-	int bufsize = 0x20000;
-	int addrlen = 0;
-#ifdef _WIN32
-	u_long l_yes = 1;
-#endif
+	return (writer) ? writer->length : 0;
+}
 
-	if (addr->sa_family == AF_INET) {
-		struct sockaddr_in* addr_in = (struct sockaddr_in*)addr;
-		addr_in->sin_port = htons(port);
-		addrlen = sizeof(struct sockaddr_in);
+// removes sent bytes from the buffer, keeping what is left for the next flush
+static void socket_writer_sent(socket_writer_t writer, size_t sent)
+{
+	if (sent >= writer->length) {
+		writer->length = 0;
+		writer->deadline = 0;
+		return;
 	}
-#ifdef AF_INET6
-	else if (addr->sa_family == AF_INET6) {
-		struct sockaddr_in6* addr_in = (struct sockaddr_in6*)addr;
-		addr_in->sin6_port = htons(port);
+	memmove(writer->buf, writer->buf + sent, writer->length - sent);
+	writer->length -= sent;
+}
 
-		/*
-		 * IPv6 Routing Magic:
-		 *
-		 * If the scope of the address is a link-local one, IPv6 requires the
-		 * scope id set to an interface number to allow proper routing. However,
-		 * as the provided sockaddr might contain a wrong scope id, we must find
-		 * a scope id from a suitable interface on this system or routing might
-		 * fail. An IPv6 guru should have another look though...
-		 */
-		addr_in->sin6_scope_id = _sockaddr_in6_scope_id(addr_in);
+/*
+ * Sends the buffered data followed by iov with as few system calls as
+ * possible. If sending fails, unsent buffered data is kept, but the part
+ * of iov that was not sent is lost.
+ */
+static int socket_writer_send(socket_writer_t writer, const struct iovec *iov, int iovcnt)
+{
+	struct iovec local[SOCKET_IOV_CHUNK];
+	struct iovec *vec = local;
+	size_t sent = 0;
+	int cnt = 0;
+	int i;
+	int res;
 
-		addrlen = sizeof(struct sockaddr_in6);
+	if (iovcnt + 1 > SOCKET_IOV_CHUNK) {
+		vec = (struct iovec*)malloc(sizeof(struct iovec) * (iovcnt + 1));
+		if (!vec) {
+			return -ENOMEM;
+		}
 	}
-#endif
-	else {
-		SOCKET_ERR(1, "ERROR: Unsupported address family\n");
-		return -1;
+	if (writer->length > 0) {
+		vec[cnt].iov_base = writer->buf;
+		vec[cnt].iov_len = writer->length;
+		cnt++;
 	}
-
-	sfd = socket(addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
-	if (sfd == -1) {
-#ifdef _WIN32
-		errno = WSAError_to_errno(WSAGetLastError());
-#endif
-		SOCKET_ERR(1, "socket(): %s\n", strerror(errno));
-		return -1;
+	for (i = 0; i < iovcnt; i++) {
+		vec[cnt++] = iov[i];
 	}
-
-#ifdef SO_NOSIGPIPE
-	if (setsockopt(sfd, SOL_SOCKET, SO_NOSIGPIPE, (void*)&yes, sizeof(int)) == -1) {
-		SOCKET_ERR(1, "setsockopt() SO_NOSIGPIPE: %s\n", strerror(errno));
-		socket_close(sfd);
-		return -1;
+	res = socket_sendv_all(writer->fd, vec, cnt, SOCKET_SEND_TIMEOUT, &sent);
+	if (vec != local) {
+		free(vec);
 	}
-#endif
+	socket_writer_sent(writer, sent);
+	return res;
+}
 
-	if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void*)&yes, sizeof(int)) == -1) {
-#ifdef _WIN32
-		errno = WSAError_to_errno(WSAGetLastError());
-#endif
-		SOCKET_ERR(1, "setsockopt() SO_REUSEADDR: %s\n", strerror(errno));
-		socket_close(sfd);
-		return -1;
+int socket_writer_flush(socket_writer_t writer)
+{
+	if (!writer) {
+		return -EINVAL;
+	}
+	if (writer->length == 0) {
+		return 0;
 	}
+	return socket_writer_send(writer, NULL, 0);
+}
 
-#ifdef _WIN32
-	ioctlsocket(sfd, FIONBIO, &l_yes);
-#else
-	int flags = fcntl(sfd, F_GETFL, 0);
-	fcntl(sfd, F_SETFL, flags | O_NONBLOCK);
-#endif
+int socket_writer_flush_if_due(socket_writer_t writer, int *next_timeout)
+{
+	int res = 0;
 
-	do {
-		if (connect(sfd, addr, addrlen) != -1) {
-			break;
-		}
-#ifdef _WIN32
-		if (WSAGetLastError() == WSAEWOULDBLOCK)
-#else
-		if (errno == EINPROGRESS)
-#endif
-		{
-			if (poll_wrapper(sfd, FDM_WRITE, CONNECT_TIMEOUT) == poll_status_success) {
-				int so_error;
-				socklen_t len = sizeof(so_error);
-				getsockopt(sfd, SOL_SOCKET, SO_ERROR, (void*)&so_error, &len);
-				if (so_error == 0) {
-					errno = 0;
-					break;
-				}
-#ifdef _WIN32
-				so_error = WSAError_to_errno(so_error);
-#endif
-				errno = so_error;
-			} else {
-				int so_error = 0;
-				socklen_t len = sizeof(so_error);
-				getsockopt(sfd, SOL_SOCKET, SO_ERROR, (void*)&so_error, &len);
-				if (so_error != 0) {
-#ifdef _WIN32
-					so_error = WSAError_to_errno(so_error);
-#endif
-					errno = so_error;
-				}
-			}
+	if (!writer) {
+		return -EINVAL;
+	}
+	if (writer->length > 0 && writer->deadline > 0 && socket_time_ms() >= writer->deadline) {
+		res = socket_writer_flush(writer);
+	}
+	if (next_timeout) {
+		if (writer->length == 0 || writer->deadline == 0) {
+			*next_timeout = -1;
+		} else {
+			uint64_t now = socket_time_ms();
+			*next_timeout = (writer->deadline > now) ? (int)(writer->deadline - now) : 0;
 		}
-		socket_close(sfd);
-		sfd = -1;
-	} while (0);
+	}
+	return res;
+}
 
-	if (sfd < 0) {
-		if (verbose >= 2) {
-			char addrtxt[48];
-			socket_addr_to_string(addr, addrtxt, sizeof(addrtxt));
-			SOCKET_ERR(2, "%s: Could not connect to %s port %d\n", __func__, addrtxt, port);
-		}
-		return -1;
+int socket_writer_writev(socket_writer_t writer, const struct iovec *iov, int iovcnt)
+{
+	size_t total = 0;
+	int i;
+
+	if (!writer || (!iov && iovcnt > 0) || iovcnt < 0) {
+		return -EINVAL;
+	}
+	for (i = 0; i < iovcnt; i++) {
+		total += iov[i].iov_len;
+	}
+	if (total == 0) {
+		return 0;
 	}
 
-	if (setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void*)&yes, sizeof(int)) == -1) {
-#ifdef _WIN32
-		errno = WSAError_to_errno(WSAGetLastError());
-#endif
-		SOCKET_ERR(1, "Could not set TCP_NODELAY on socket: %s\n", strerror(errno));
+	if (writer->length + total >= writer->capacity) {
+		// threshold reached, send everything at once without copying
+		return socket_writer_send(writer, iov, iovcnt);
 	}
 
-	if (setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, (void*)&bufsize, sizeof(int)) == -1) {
-#ifdef _WIN32
-		errno = WSAError_to_errno(WSAGetLastError());
-#endif
-		SOCKET_ERR(1, "Could not set send buffer for socket: %s\n", strerror(errno));
+	if (writer->length == 0 && writer->flush_delay > 0) {
+		writer->deadline = socket_time_ms() + writer->flush_delay;
+	}
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(writer->buf + writer->length, iov[i].iov_base, iov[i].iov_len);
+		writer->length += iov[i].iov_len;
 	}
 
-	if (setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, (void*)&bufsize, sizeof(int)) == -1) {
-#ifdef _WIN32
-		errno = WSAError_to_errno(WSAGetLastError());
-#endif
-		SOCKET_ERR(1, "Could not set receive buffer for socket: %s\n", strerror(errno));
+	if (writer->deadline > 0 && socket_time_ms() >= writer->deadline) {
+		return socket_writer_flush(writer);
 	}
+	return 0;
+}
 
-	return sfd;
+int socket_writer_write(socket_writer_t writer, const void *data, size_t length)
+{
+	struct iovec iov;
+
+	if (!data && length > 0) {
+		return -EINVAL;
+	}
+	iov.iov_base = (void*)data;
+	iov.iov_len = length;
+	return socket_writer_writev(writer, &iov, 1);
 }
 
-int socket_connect(const char *addr, uint16_t port)
+struct socket_server_conn {
+	struct socket_server_conn *next;
+	int fd;
+	struct sockaddr_storage peer;
+};
+
+struct socket_server_acceptor {
+	socket_server_t server;
+	int fd;
+	THREAD_T thread;
+};
+
+struct socket_server {
+	struct socket_server_acceptor *acceptors;
+	unsigned int num_acceptors;
+	THREAD_T *workers;
+	unsigned int num_workers;
+	unsigned int num_started_workers;
+	socket_server_cb_t callback;
+	void *user_data;
+	socket_wakeup_t wakeup;
+	int running;
+	int stop;
+	int error;
+	mutex_t mutex;
+	cond_t cond;
+	struct socket_server_conn *queue_head;
+	struct socket_server_conn *queue_tail;
+};
+
+void socket_server_options_init(struct socket_server_options *sopts)
 {
-	int sfd = -1;
-	int yes = 1;
-	int bufsize = 0x20000;
-	struct addrinfo hints;
-	struct addrinfo *result, *rp;
-	char portstr[8];
-	int res;
-#ifdef _WIN32
-	u_long l_yes = 1;
+	if (!sopts) {
+		return;
+	}
+	memset(sopts, 0, sizeof(struct socket_server_options));
+	sopts->num_listeners = 1;
+#ifdef SOMAXCONN
+	sopts->backlog = SOMAXCONN;
 #else
-	int flags = 0;
+	sopts->backlog = 128;
 #endif
+}
 
-	memset(&hints, '\0', sizeof(struct addrinfo));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_NUMERICSERV;
-	hints.ai_protocol = IPPROTO_TCP;
-
-	snprintf(portstr, 8, "%d", port);
+static void socket_server_dispatch(socket_server_t server, int fd, struct sockaddr_storage *peer)
+{
+	struct socket_server_conn *conn;
 
-	res = getaddrinfo(addr, portstr, &hints, &result);
-	if (res != 0) {
-		SOCKET_ERR(1, "%s: getaddrinfo: %s\n", __func__, gai_strerror(res));
-		return -1;
+	if (server->num_workers == 0) {
+		server->callback(server, fd, peer, server->user_data);
+		return;
 	}
+	conn = (struct socket_server_conn*)malloc(sizeof(struct socket_server_conn));
+	if (!conn) {
+		SOCKET_ERR(1, "%s: Out of memory, dropping connection\n", __func__);
+		socket_close(fd);
+		return;
+	}
+	conn->next = NULL;
+	conn->fd = fd;
+	memcpy(&conn->peer, peer, sizeof(struct sockaddr_storage));
 
-	for (rp = result; rp != NULL; rp = rp->ai_next) {
-		sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-		if (sfd == -1) {
-			continue;
-		}
-
-#ifdef SO_NOSIGPIPE
-		if (setsockopt(sfd, SOL_SOCKET, SO_NOSIGPIPE, (void*)&yes, sizeof(int)) == -1) {
-			SOCKET_ERR(1, "setsockopt() SO_NOSIGPIPE: %s\n", strerror(errno));
-			socket_close(sfd);
-			return -1;
-		}
-#endif
+	mutex_lock(&server->mutex);
+	if (server->queue_tail) {
+		server->queue_tail->next = conn;
+	} else {
+		server->queue_head = conn;
+	}
+	server->queue_tail = conn;
+	cond_signal(&server->cond);
+	mutex_unlock(&server->mutex);
+}
 
-		if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void*)&yes, sizeof(int)) == -1) {
-#ifdef _WIN32
-			errno = WSAError_to_errno(WSAGetLastError());
-#endif
-			SOCKET_ERR(1, "setsockopt() SO_REUSEADDR: %s\n", strerror(errno));
-			socket_close(sfd);
-			continue;
-		}
+// errors an acceptor can recover from by waiting a bit (resource shortage)
+static int socket_server_error_is_transient(int err)
+{
+	return (err == EINTR || err == EAGAIN || err == ENOMEM || err == ENOBUFS || err == EMFILE || err == ENFILE);
+}
 
-#ifdef _WIN32
-		ioctlsocket(sfd, FIONBIO, &l_yes);
-#else
-		flags = fcntl(sfd, F_GETFL, 0);
-		fcntl(sfd, F_SETFL, flags | O_NONBLOCK);
-#endif
+// wait before retrying, a stop request cuts the wait short
+static void socket_server_backoff(socket_server_t server)
+{
+	struct socket_poll_entry entry = { socket_wakeup_get_fd(server->wakeup), SOCKET_EVENT_READ, 0 };
+	socket_check_fds(&entry, 1, SOCKET_SERVER_RETRY_INTERVAL);
+}
 
-		if (connect(sfd, rp->ai_addr, rp->ai_addrlen) != -1) {
+static void* socket_server_acceptor_thread(void *data)
+{
+	struct socket_server_acceptor *acceptor = (struct socket_server_acceptor*)data;
+	socket_server_t server = acceptor->server;
+	int err = 0;
+
+	while (!ATOMIC_LOAD_RELAXED(&server->stop)) {
+		struct socket_poll_entry entries[2] = {
+			{ acceptor->fd, SOCKET_EVENT_READ, 0 },
+			{ socket_wakeup_get_fd(server->wakeup), SOCKET_EVENT_READ, 0 }
+		};
+		int res = socket_check_fds(entries, 2, 0);
+		if (res < 0) {
+			if (socket_server_error_is_transient(-res)) {
+				SOCKET_ERR(2, "%s: poll failed on listener fd %d: %s, retrying\n", __func__, acceptor->fd, strerror(-res));
+				socket_server_backoff(server);
+				continue;
+			}
+			err = -res;
 			break;
 		}
-#ifdef _WIN32
-		if (WSAGetLastError() == WSAEWOULDBLOCK)
-#else
-		if (errno == EINPROGRESS)
-#endif
-		{
-			if (poll_wrapper(sfd, FDM_WRITE, CONNECT_TIMEOUT) == poll_status_success) {
-				int so_error;
-				socklen_t len = sizeof(so_error);
-				getsockopt(sfd, SOL_SOCKET, SO_ERROR, (void*)&so_error, &len);
-				if (so_error == 0) {
-					errno = 0;
+		if (entries[1].revents) {
+			// stop request
+			continue;
+		}
+		// drain the accept queue, the listener is non-blocking
+		while (1) {
+			struct sockaddr_storage peer;
+			int fd = socket_accept_ex(acceptor->fd, &peer, SOCKET_ACCEPT_NONBLOCK | SOCKET_ACCEPT_CLOEXEC);
+			if (fd < 0) {
+				if (errno == EINTR || errno == ECONNABORTED) {
+					continue;
+				}
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
 					break;
 				}
-#ifdef _WIN32
-				so_error = WSAError_to_errno(so_error);
-#endif
-				errno = so_error;
-			} else {
-				int so_error = 0;
-				socklen_t len = sizeof(so_error);
-				getsockopt(sfd, SOL_SOCKET, SO_ERROR, (void*)&so_error, &len);
-				if (so_error != 0) {
-#ifdef _WIN32
-					so_error = WSAError_to_errno(so_error);
-#endif
-					errno = so_error;
+				if (socket_server_error_is_transient(errno)) {
+					// the pending connection stays queued, don't spin on it
+					SOCKET_ERR(2, "%s: accept(): %s, retrying\n", __func__, strerror(errno));
+					socket_server_backoff(server);
+					break;
 				}
+				err = errno;
+				break;
 			}
+			socket_server_dispatch(server, fd, &peer);
+		}
+		if (err) {
+			break;
 		}
-		socket_close(sfd);
+	}
+	if (err) {
+		// make the failure visible to the caller, see socket_server_get_error()
+		SOCKET_ERR(1, "%s: listener fd %d stopped accepting: %s\n", __func__, acceptor->fd, strerror(err));
+		ATOMIC_STORE_RELAXED(&server->error, -err);
 	}
 
-	freeaddrinfo(result);
+	return NULL;
+}
 
-	if (rp == NULL) {
-		SOCKET_ERR(2, "%s: Could not connect to %s:%d\n", __func__, addr, port);
-		return -1;
+static void* socket_server_worker_thread(void *data)
+{
+	socket_server_t server = (socket_server_t)data;
+
+	mutex_lock(&server->mutex);
+	while (1) {
+		struct socket_server_conn *conn = server->queue_head;
+		if (!conn) {
+			if (server->stop) {
+				break;
+			}
+			socket_cond_wait_timeout(&server->cond, &server->mutex, SOCKET_SERVER_POLL_INTERVAL);
+			continue;
+		}
+		server->queue_head = conn->next;
+		if (!server->queue_head) {
+			server->queue_tail = NULL;
+		}
+		if (server->stop) {
+			socket_close(conn->fd);
+			free(conn);
+			continue;
+		}
+		mutex_unlock(&server->mutex);
+
+		server->callback(server, conn->fd, &conn->peer, server->user_data);
+		free(conn);
+
+		mutex_lock(&server->mutex);
 	}
+	mutex_unlock(&server->mutex);
 
-	if (setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void*)&yes, sizeof(int)) == -1) {
-#ifdef _WIN32
-		errno = WSAError_to_errno(WSAGetLastError());
-#endif
-		SOCKET_ERR(1, "Could not set TCP_NODELAY on socket: %s\n", strerror(errno));
+	return NULL;
+}
+
+socket_server_t socket_server_new(const char *addr, uint16_t port, const struct socket_server_options *sopts, const struct socket_options *opts, socket_server_cb_t callback, void *user_data)
+{
+	struct socket_server_options defsopts;
+	socket_server_t server;
+	unsigned int i;
+	int reuseport = 0;
+
+	if (!callback) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (!sopts) {
+		socket_server_options_init(&defsopts);
+		sopts = &defsopts;
 	}
 
-	if (setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, (void*)&bufsize, sizeof(int)) == -1) {
-#ifdef _WIN32
-		errno = WSAError_to_errno(WSAGetLastError());
+	server = (socket_server_t)calloc(1, sizeof(struct socket_server));
+	if (!server) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	server->num_acceptors = (sopts->num_listeners > 0) ? sopts->num_listeners : 1;
+#if defined(__linux__) && defined(SO_REUSEPORT)
+	// the kernel balances incoming connections between SO_REUSEPORT listeners
+	reuseport = (server->num_acceptors > 1);
+#else
+	if (server->num_acceptors > 1) {
+		SOCKET_ERR(2, "%s: SO_REUSEPORT load balancing not supported, using a single listener\n", __func__);
+		server->num_acceptors = 1;
+	}
 #endif
-		SOCKET_ERR(1, "Could not set send buffer for socket: %s\n", strerror(errno));
+	server->num_workers = sopts->num_workers;
+	server->callback = callback;
+	server->user_data = user_data;
+	mutex_init(&server->mutex);
+	cond_init(&server->cond);
+
+	server->wakeup = socket_wakeup_new();
+	server->acceptors = (struct socket_server_acceptor*)calloc(server->num_acceptors, sizeof(struct socket_server_acceptor));
+	if (!server->wakeup || !server->acceptors) {
+		socket_server_free(server);
+		errno = ENOMEM;
+		return NULL;
 	}
-
-	if (setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, (void*)&bufsize, sizeof(int)) == -1) {
+	for (i = 0; i < server->num_acceptors; i++) {
+		server->acceptors[i].fd = -1;
+	}
+	for (i = 0; i < server->num_acceptors; i++) {
+		int fd = socket_create_listener(addr, port, opts, (sopts->backlog > 0) ? sopts->backlog : 128, reuseport);
+		if (fd < 0) {
+			int err = errno;
+			socket_server_free(server);
+			errno = err;
+			return NULL;
+		}
+		server->acceptors[i].server = server;
+		server->acceptors[i].fd = fd;
 #ifdef _WIN32
-		errno = WSAError_to_errno(WSAGetLastError());
+		u_long l_yes = 1;
+		ioctlsocket(fd, FIONBIO, &l_yes);
+#else
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+#endif
+#ifdef TCP_DEFER_ACCEPT
+		if (sopts->defer_accept > 0) {
+			// only wake up the acceptor once the client has sent data
+			socket_setsockopt_int(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, (int)sopts->defer_accept, "TCP_DEFER_ACCEPT");
+		}
 #endif
-		SOCKET_ERR(1, "Could not set receive buffer for socket: %s\n", strerror(errno));
+		if (port == 0 && i == 0 && reuseport) {
+			// let the other listeners share the port the system picked
+			uint16_t p = 0;
+			if (socket_get_socket_port(fd, &p) == 0) {
+				port = p;
+			}
+		}
 	}
 
-	return sfd;
+	return server;
 }
 
-int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout)
+int socket_server_start(socket_server_t server)
 {
-	if (fd < 0) {
-		SOCKET_ERR(2, "ERROR: invalid fd in check_fd %d\n", fd);
+	unsigned int i;
+
+	if (!server) {
 		return -EINVAL;
 	}
+	if (server->running) {
+		return -EBUSY;
+	}
+	server->stop = 0;
+	server->error = 0;
+	socket_wakeup_clear(server->wakeup);
+	if (server->num_workers > 0) {
+		server->workers = (THREAD_T*)calloc(server->num_workers, sizeof(THREAD_T));
+		if (!server->workers) {
+			return -ENOMEM;
+		}
+	}
+	server->running = 1;
+	server->num_started_workers = 0;
+	for (i = 0; i < server->num_workers; i++) {
+		if (thread_new(&server->workers[i], socket_server_worker_thread, server) != 0) {
+			socket_server_stop(server);
+			return -EAGAIN;
+		}
+		server->num_started_workers++;
+	}
+	for (i = 0; i < server->num_acceptors; i++) {
+		if (thread_new(&server->acceptors[i].thread, socket_server_acceptor_thread, &server->acceptors[i]) != 0) {
+			for (; i < server->num_acceptors; i++) {
+				server->acceptors[i].thread = THREAD_T_NULL;
+			}
+			socket_server_stop(server);
+			return -EAGAIN;
+		}
+	}
 
-	int timeout_ms;
-	if (timeout > 0) {
-		timeout_ms = (int)timeout;
-		if (timeout_ms <= 0)
-			timeout_ms = -1;
-	} else {
-		timeout_ms = -1;
+	return 0;
+}
+
+void socket_server_stop(socket_server_t server)
+{
+	unsigned int i;
+
+	if (!server || !server->running) {
+		return;
+	}
+	mutex_lock(&server->mutex);
+	ATOMIC_STORE_RELAXED(&server->stop, 1);
+	for (i = 0; i < server->num_started_workers; i++) {
+		cond_signal(&server->cond);
+	}
+	mutex_unlock(&server->mutex);
+	socket_wakeup_signal(server->wakeup);
+
+	for (i = 0; i < server->num_acceptors; i++) {
+		if (server->acceptors[i].thread != THREAD_T_NULL) {
+			thread_join(server->acceptors[i].thread);
+			thread_free(server->acceptors[i].thread);
+			server->acceptors[i].thread = THREAD_T_NULL;
+		}
+	}
+	for (i = 0; i < server->num_started_workers; i++) {
+		thread_join(server->workers[i]);
+		thread_free(server->workers[i]);
+	}
+	free(server->workers);
+	server->workers = NULL;
+	server->num_started_workers = 0;
+
+	// connections that were accepted but not handled anymore
+	while (server->queue_head) {
+		struct socket_server_conn *conn = server->queue_head;
+		server->queue_head = conn->next;
+		socket_close(conn->fd);
+		free(conn);
 	}
+	server->queue_tail = NULL;
+	server->running = 0;
+}
 
-	switch (poll_wrapper(fd, fdm, timeout_ms)) {
-		case poll_status_success:
-			return 1;
-		case poll_status_timeout:
-			return -ETIMEDOUT;
-		case poll_status_error:
-		default:
-			SOCKET_ERR(2, "%s: poll_wrapper failed\n", __func__);
-			return -ECONNRESET;
+void socket_server_free(socket_server_t server)
+{
+	unsigned int i;
+
+	if (!server) {
+		return;
+	}
+	socket_server_stop(server);
+	if (server->acceptors) {
+		for (i = 0; i < server->num_acceptors; i++) {
+			if (server->acceptors[i].fd >= 0) {
+				socket_close(server->acceptors[i].fd);
+			}
+		}
+		free(server->acceptors);
 	}
+	socket_wakeup_free(server->wakeup);
+	cond_destroy(&server->cond);
+	mutex_destroy(&server->mutex);
+	free(server);
+}
 
-	return -ECONNRESET;
+int socket_server_get_fd(socket_server_t server, unsigned int index)
+{
+	if (!server || index >= server->num_acceptors) {
+		return -EINVAL;
+	}
+	return server->acceptors[index].fd;
 }
 
-int socket_accept(int fd, uint16_t port)
+int socket_server_get_error(socket_server_t server)
 {
-#ifdef _WIN32
-	int addr_len;
-#else
-	socklen_t addr_len;
+	if (!server) {
+		return -EINVAL;
+	}
+	return ATOMIC_LOAD_RELAXED(&server->error);
+}
+
+/* bidirectional relay */
+
+#if defined(__linux__) && defined(HAVE_SPLICE)
+#define HAVE_SOCKET_RELAY_SPLICE 1
 #endif
-	int result;
-	struct sockaddr_storage addr;
-	addr_len = sizeof(addr);
 
-	result = accept(fd, (struct sockaddr*)&addr, &addr_len);
-#ifdef _WIN32
-	if (result < 0) {
-		errno = WSAError_to_errno(WSAGetLastError());
-	}
+struct socket_relay_dir {
+	int src;
+	int dst;
+	const struct socket_transport *src_transport;
+	void *src_ctx;
+	const struct socket_transport *dst_transport;
+	void *dst_ctx;
+	unsigned char *buf;
+	size_t capacity;
+	size_t head;
+	size_t len;
+#ifdef HAVE_SOCKET_RELAY_SPLICE
+	int pipe_fds[2];
 #endif
-	return result;
-}
+	int eof;
+	int done;
+	uint64_t bytes;
+};
 
-int socket_shutdown(int fd, int how)
+void socket_relay_options_init(struct socket_relay_options *ropts)
 {
-	int result = shutdown(fd, how);
-#ifdef _WIN32
-	if (result < 0) {
-		errno = WSAError_to_errno(WSAGetLastError());
+	if (!ropts) {
+		return;
 	}
-#endif
-	return result;
+	memset(ropts, 0, sizeof(struct socket_relay_options));
+	ropts->buffer_size = SOCKET_RELAY_DEFAULT_SIZE;
 }
 
-int socket_close(int fd)
+static int socket_relay_dir_init(struct socket_relay_dir *dir, int src, int dst, const struct socket_relay_options *ropts)
 {
-#ifdef _WIN32
-	int result = closesocket(fd);
-	if (result < 0) {
-		errno = WSAError_to_errno(WSAGetLastError());
+	memset(dir, 0, sizeof(struct socket_relay_dir));
+	dir->src = src;
+	dir->dst = dst;
+	dir->src_transport = socket_fd_transport(src, &dir->src_ctx);
+	dir->dst_transport = socket_fd_transport(dst, &dir->dst_ctx);
+	dir->capacity = (ropts->buffer_size > 0) ? ropts->buffer_size : SOCKET_RELAY_DEFAULT_SIZE;
+	if (dir->capacity > INT_MAX) {
+		dir->capacity = INT_MAX;
+	}
+#ifdef HAVE_SOCKET_RELAY_SPLICE
+	dir->pipe_fds[0] = dir->pipe_fds[1] = -1;
+	// data has to pass through userspace when a transport is installed
+	if (!ropts->no_splice && !dir->src_transport && !dir->dst_transport && pipe(dir->pipe_fds) == 0) {
+		fcntl(dir->pipe_fds[0], F_SETFL, fcntl(dir->pipe_fds[0], F_GETFL, 0) | O_NONBLOCK);
+		fcntl(dir->pipe_fds[1], F_SETFL, fcntl(dir->pipe_fds[1], F_GETFL, 0) | O_NONBLOCK);
+#ifdef F_SETPIPE_SZ
+		int size = fcntl(dir->pipe_fds[1], F_SETPIPE_SZ, (int)dir->capacity);
+		if (size > 0) {
+			dir->capacity = (size_t)size;
+		}
+#endif
+		return 0;
 	}
-	return result;
-#else
-	return close(fd);
 #endif
+	dir->buf = (unsigned char*)malloc(dir->capacity);
+	return (dir->buf) ? 0 : -ENOMEM;
 }
 
-int socket_receive(int fd, void *data, size_t length)
+static void socket_relay_dir_cleanup(struct socket_relay_dir *dir)
 {
-	return socket_receive_timeout(fd, data, length, 0, RECV_TIMEOUT);
+#ifdef HAVE_SOCKET_RELAY_SPLICE
+	if (dir->pipe_fds[0] >= 0) {
+		close(dir->pipe_fds[0]);
+		close(dir->pipe_fds[1]);
+	}
+#endif
+	free(dir->buf);
 }
 
-int socket_peek(int fd, void *data, size_t length)
+static int socket_relay_dir_readable(struct socket_relay_dir *dir)
 {
-	return socket_receive_timeout(fd, data, length, MSG_PEEK, RECV_TIMEOUT);
+	return !dir->eof && dir->head + dir->len < dir->capacity;
 }
 
-int socket_receive_timeout(int fd, void *data, size_t length, int flags, unsigned int timeout)
+// read as much as fits from src, returns 0 if nothing was available
+static int socket_relay_fill(struct socket_relay_dir *dir)
 {
 	int res;
-	int result;
-
-	// check if data is available
-	res = socket_check_fd(fd, FDM_READ, timeout);
-	if (res <= 0) {
-		return res;
+#ifdef HAVE_SOCKET_RELAY_SPLICE
+	if (!dir->buf) {
+		uint64_t stats_start = SOCKET_STATS_BEGIN();
+		ssize_t n = splice(dir->src, NULL, dir->pipe_fds[1], NULL, dir->capacity - dir->len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		SOCKET_STATS_IO(dir->src, 0, n, (n > 0) ? n : 0, stats_start);
+		res = (n < 0) ? -errno : (int)n;
+	} else
+#endif
+	if (dir->src_transport) {
+		res = dir->src_transport->receive(dir->src_ctx, dir->src, dir->buf + dir->head + dir->len, dir->capacity - dir->head - dir->len, 0);
+	} else {
+#ifdef MSG_DONTWAIT
+		res = socket_receive_raw(dir->src, dir->buf + dir->head + dir->len, dir->capacity - dir->head - dir->len, MSG_DONTWAIT);
+#else
+		res = socket_receive_raw(dir->src, dir->buf + dir->head + dir->len, dir->capacity - dir->head - dir->len, 0);
+#endif
 	}
-	// if we get here, there _is_ data available
-	result = recv(fd, data, length, flags);
-	if (result == 0) {
-		// but this is an error condition
-		SOCKET_ERR(3, "%s: fd=%d recv returned 0\n", __func__, fd);
-		return -ECONNRESET;
+	if (res == 0) {
+		dir->eof = 1;
+		return 0;
 	}
-	if (result < 0) {
-#ifdef _WIN32
-		errno = WSAError_to_errno(WSAGetLastError());
-#endif
-		return -errno;
+	if (res < 0) {
+		return (res == -EAGAIN || res == -EWOULDBLOCK || res == -EINTR) ? 0 : res;
 	}
-	return result;
+	dir->len += (size_t)res;
+	return res;
 }
 
-int socket_send(int fd, const void *data, size_t length)
+// write out pending data to dst, returns 0 if it would block
+static int socket_relay_flush(struct socket_relay_dir *dir)
 {
-	int flags = 0;
-	int res = socket_check_fd(fd, FDM_WRITE, SEND_TIMEOUT);
-	if (res <= 0) {
-		return res;
-	}
-#ifdef MSG_NOSIGNAL
-	flags |= MSG_NOSIGNAL;
+	int res;
+#ifdef HAVE_SOCKET_RELAY_SPLICE
+	if (!dir->buf) {
+		uint64_t stats_start = SOCKET_STATS_BEGIN();
+		ssize_t n = splice(dir->pipe_fds[0], NULL, dir->dst, NULL, dir->len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		SOCKET_STATS_IO(dir->dst, 1, n, (n > 0) ? n : 0, stats_start);
+		res = (n < 0) ? -errno : (int)n;
+	} else
 #endif
-	int s = (int)send(fd, data, length, flags);
-	if (s < 0) {
-#ifdef _WIN32
-		errno = WSAError_to_errno(WSAGetLastError());
+	if (dir->dst_transport) {
+		res = dir->dst_transport->send(dir->dst_ctx, dir->dst, dir->buf + dir->head, dir->len);
+	} else {
+#ifdef MSG_DONTWAIT
+		res = socket_send_raw(dir->dst, dir->buf + dir->head, dir->len, MSG_DONTWAIT);
+#else
+		res = socket_send_raw(dir->dst, dir->buf + dir->head, dir->len, 0);
 #endif
-		return -errno;
 	}
-	return s;
+	if (res < 0) {
+		return (res == -EAGAIN || res == -EWOULDBLOCK || res == -EINTR) ? 0 : res;
+	}
+	dir->len -= (size_t)res;
+	dir->bytes += (uint64_t)res;
+	if (dir->buf) {
+		dir->head = (dir->len > 0) ? dir->head + (size_t)res : 0;
+	}
+	return res;
 }
 
-int socket_get_socket_port(int fd, uint16_t *port)
+#ifndef _WIN32
+static int socket_relay_set_nonblocking(int fd)
 {
-#ifdef _WIN32
-	int addr_len;
-#else
-	socklen_t addr_len;
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags >= 0 && !(flags & O_NONBLOCK)) {
+		fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	}
+	return flags;
+}
+
+static void socket_relay_restore_flags(int fd, int flags)
+{
+	if (flags >= 0 && !(flags & O_NONBLOCK)) {
+		fcntl(fd, F_SETFL, flags);
+	}
+}
 #endif
-	struct sockaddr_in addr;
 
-	memset(&addr, 0, sizeof(addr));
+int socket_relay(int fd_a, int fd_b, const struct socket_relay_options *ropts, struct socket_relay_stats *stats)
+{
+	struct socket_relay_options defaults;
+	struct socket_relay_dir dirs[2];
+	int res = 0;
+	int i;
 
-	addr_len = sizeof(addr);
-	if (0 > getsockname(fd, (struct sockaddr*)&addr, &addr_len)) {
-#ifdef _WIN32
-		errno = WSAError_to_errno(WSAGetLastError());
+	if (stats) {
+		memset(stats, 0, sizeof(struct socket_relay_stats));
+	}
+	if (fd_a < 0 || fd_b < 0 || fd_a == fd_b) {
+		return -EINVAL;
+	}
+	if (!ropts) {
+		socket_relay_options_init(&defaults);
+		ropts = &defaults;
+	}
+	res = socket_relay_dir_init(&dirs[0], fd_a, fd_b, ropts);
+	if (res == 0) {
+		res = socket_relay_dir_init(&dirs[1], fd_b, fd_a, ropts);
+		if (res < 0) {
+			socket_relay_dir_cleanup(&dirs[0]);
+		}
+	}
+	if (res < 0) {
+		return res;
+	}
+
+#ifndef _WIN32
+	// nothing in the loop may block, it only waits in poll
+	int flags_a = socket_relay_set_nonblocking(fd_a);
+	int flags_b = socket_relay_set_nonblocking(fd_b);
 #endif
-		return -1;
+#ifdef HAVE_SOCKET_RELAY_SPLICE
+	// splice() has no MSG_NOSIGNAL, keep a closed peer from raising SIGPIPE
+	sigset_t sigpipe_mask;
+	sigset_t old_mask;
+	sigset_t pending;
+	int sigpipe_was_pending;
+	sigemptyset(&sigpipe_mask);
+	sigaddset(&sigpipe_mask, SIGPIPE);
+	sigpending(&pending);
+	sigpipe_was_pending = sigismember(&pending, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigpipe_mask, &old_mask);
+#endif
+
+	uint64_t last_activity = socket_time_ms();
+	while (!dirs[0].done || !dirs[1].done) {
+		struct socket_poll_entry entries[2];
+		int have_pending = 0;
+		int timeout = -1;
+
+		for (i = 0; i < 2; i++) {
+			entries[i].fd = dirs[i].src;
+			entries[i].events = 0;
+			entries[i].revents = 0;
+		}
+		for (i = 0; i < 2; i++) {
+			if (dirs[i].done) {
+				continue;
+			}
+			if (dirs[i].len > 0) {
+				entries[1 - i].events |= SOCKET_EVENT_WRITE;
+			}
+			if (socket_relay_dir_readable(&dirs[i])) {
+				entries[i].events |= SOCKET_EVENT_READ;
+				if (dirs[i].src_transport && dirs[i].src_transport->pending && dirs[i].src_transport->pending(dirs[i].src_ctx, dirs[i].src) > 0) {
+					have_pending = 1;
+				}
+			}
+		}
+		for (i = 0; i < 2; i++) {
+			if (entries[i].events == 0) {
+				// an fd with nothing to wait for must not report HUP over and over
+				entries[i].fd = -1;
+			}
+		}
+		if (have_pending) {
+			timeout = 0;
+		} else if (ropts->idle_timeout > 0) {
+			uint64_t now = socket_time_ms();
+			if (now >= last_activity + ropts->idle_timeout) {
+				res = -ETIMEDOUT;
+				break;
+			}
+			timeout = (int)(last_activity + ropts->idle_timeout - now);
+		}
+		res = poll_wrapper_multi(entries, 2, timeout);
+		if (res < 0) {
+			break;
+		}
+		res = 0;
+
+		for (i = 0; i < 2 && res >= 0; i++) {
+			struct socket_relay_dir *dir = &dirs[i];
+			if (dir->done) {
+				continue;
+			}
+			if (socket_relay_dir_readable(dir) && ((entries[i].revents & (SOCKET_EVENT_READ | SOCKET_EVENT_ERROR | SOCKET_EVENT_HUP)) || have_pending)) {
+				res = socket_relay_fill(dir);
+				if (res < 0) {
+					break;
+				}
+				if (res > 0 || dir->eof) {
+					last_activity = socket_time_ms();
+				}
+			}
+			if (dir->len > 0 && (entries[1 - i].revents & (SOCKET_EVENT_WRITE | SOCKET_EVENT_ERROR | SOCKET_EVENT_HUP))) {
+				res = socket_relay_flush(dir);
+				if (res < 0) {
+					break;
+				}
+				if (res > 0) {
+					last_activity = socket_time_ms();
+				}
+			}
+			if (dir->eof && dir->len == 0) {
+				// propagate the half-close to the other side
+				SOCKET_ERR(3, "%s: fd=%d closed, shutting down fd=%d for writing\n", __func__, dir->src, dir->dst);
+				socket_shutdown(dir->dst, SHUT_WR);
+				dir->done = 1;
+			}
+		}
+		if (res < 0) {
+			SOCKET_ERR(2, "%s: fd=%d <-> fd=%d: %s\n", __func__, fd_a, fd_b, strerror(-res));
+			break;
+		}
+	}
+	if (res > 0) {
+		res = 0;
 	}
 
-	*port = ntohs(addr.sin_port);
-	return 0;
+#ifdef HAVE_SOCKET_RELAY_SPLICE
+	sigpending(&pending);
+	if (!sigpipe_was_pending && sigismember(&pending, SIGPIPE)) {
+		struct timespec ts = { 0, 0 };
+		sigtimedwait(&sigpipe_mask, NULL, &ts);
+	}
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+#endif
+#ifndef _WIN32
+	socket_relay_restore_flags(fd_a, flags_a);
+	socket_relay_restore_flags(fd_b, flags_b);
+#endif
+	if (stats) {
+		stats->bytes_a_to_b = dirs[0].bytes;
+		stats->bytes_b_to_a = dirs[1].bytes;
+	}
+	socket_relay_dir_cleanup(&dirs[0]);
+	socket_relay_dir_cleanup(&dirs[1]);
+	return res;
 }